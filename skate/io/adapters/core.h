@@ -29,10 +29,29 @@
 # include <format>
 #endif
 
+#include "../../system/environment.h"
 #include "../../containers/utf.h"
 #include "../../containers/abstract_map.h"
 
 namespace skate {
+    namespace detail {
+        // Returns the index of the lowest set bit in v, which must be nonzero
+        inline unsigned ctz32(std::uint32_t v) noexcept {
+#if GCC_COMPILER | CLANG_COMPILER
+            return unsigned(__builtin_ctz(v));
+#elif MSVC_COMPILER
+            unsigned long index = 0;
+            _BitScanForward(&index, v);
+            return unsigned(index);
+#else
+            unsigned index = 0;
+            for (; !(v & 1); v >>= 1)
+                ++index;
+            return index;
+#endif
+        }
+    }
+
     template<typename InputIterator>
     InputIterator skip_spaces_or_tabs(InputIterator first, InputIterator last) {
         for (; first != last; ++first) {
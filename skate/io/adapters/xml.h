@@ -44,6 +44,116 @@ namespace skate {
             return (ch >= 0x1 && ch <= 0x1f && ch != 0x9 && ch != 0xa && ch != 0xd) ||
                     (ch >= 0x7f && ch <= 0x9f && ch != 0x85);
         }
+
+        // Returns true if the byte would be written as-is by xml_escape() with xml_string_type::text
+        inline bool xml_is_clean_text_byte(std::uint8_t c) noexcept {
+            return c >= 32 && c < 127 && c != '<' && c != '>' && c != '&' && c != '\\' && c != '"';
+        }
+
+        // Returns a pointer to the first '<', '&', ']', or quote character (if quote is nonzero) in [first, last), or last if none is found
+        // A ']' is reported so the caller can check for the forbidden "]]>" sequence in character data
+        inline const char *xml_scan_character_data(const char *first, const char *last, char quote = 0) noexcept {
+            const char needle_quote = quote ? quote : '<';
+
+#if defined(__AVX2__)
+            const __m256i lt = _mm256_set1_epi8('<');
+            const __m256i amp = _mm256_set1_epi8('&');
+            const __m256i bracket = _mm256_set1_epi8(']');
+            const __m256i q = _mm256_set1_epi8(needle_quote);
+
+            for (; last - first >= 32; first += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+                const __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, amp)),
+                                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, bracket), _mm256_cmpeq_epi8(v, q)));
+                const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(hits));
+
+                if (mask)
+                    return first + ctz32(mask);
+            }
+#elif defined(__SSE2__)
+            const __m128i lt = _mm_set1_epi8('<');
+            const __m128i amp = _mm_set1_epi8('&');
+            const __m128i bracket = _mm_set1_epi8(']');
+            const __m128i q = _mm_set1_epi8(needle_quote);
+
+            for (; last - first >= 16; first += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+                const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp)),
+                                                  _mm_or_si128(_mm_cmpeq_epi8(v, bracket), _mm_cmpeq_epi8(v, q)));
+                const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(hits));
+
+                if (mask)
+                    return first + ctz32(mask);
+            }
+#endif
+
+            for (; first != last; ++first) {
+                const char c = *first;
+
+                if (c == '<' || c == '&' || c == ']' || c == needle_quote)
+                    break;
+            }
+
+            return first;
+        }
+
+        // Returns a pointer to the first byte in [first, last) that xml_escape() with xml_string_type::text would not copy verbatim, or last if none is found
+        inline const char *xml_scan_escape(const char *first, const char *last) noexcept {
+#if defined(__AVX2__)
+            const __m256i space = _mm256_set1_epi8(32);
+            const __m256i del = _mm256_set1_epi8(127);
+            const __m256i lt = _mm256_set1_epi8('<');
+            const __m256i gt = _mm256_set1_epi8('>');
+            const __m256i amp = _mm256_set1_epi8('&');
+            const __m256i backslash = _mm256_set1_epi8('\\');
+            const __m256i dquote = _mm256_set1_epi8('"');
+
+            for (; last - first >= 32; first += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+
+                // Signed comparison catches both control characters and bytes >= 0x80
+                __m256i hits = _mm256_or_si256(_mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+                hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)));
+                hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, backslash)));
+                hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(v, dquote));
+
+                const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(hits));
+
+                if (mask)
+                    return first + ctz32(mask);
+            }
+#elif defined(__SSE2__)
+            const __m128i space = _mm_set1_epi8(32);
+            const __m128i del = _mm_set1_epi8(127);
+            const __m128i lt = _mm_set1_epi8('<');
+            const __m128i gt = _mm_set1_epi8('>');
+            const __m128i amp = _mm_set1_epi8('&');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i dquote = _mm_set1_epi8('"');
+
+            for (; last - first >= 16; first += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+
+                // Signed comparison catches both control characters and bytes >= 0x80
+                __m128i hits = _mm_or_si128(_mm_cmpgt_epi8(space, v), _mm_cmpeq_epi8(v, del));
+                hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+                hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, backslash)));
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, dquote));
+
+                const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(hits));
+
+                if (mask)
+                    return first + ctz32(mask);
+            }
+#endif
+
+            for (; first != last; ++first) {
+                if (!xml_is_clean_text_byte(std::uint8_t(*first)))
+                    break;
+            }
+
+            return first;
+        }
     }
 
     enum class xml_string_type {
@@ -147,6 +257,31 @@ namespace skate {
             return failed() ? *this : (std::tie(m_out, m_result) = xml_escape(m_back[1], m_back[0], value, m_out, m_type), m_back[1] = m_back[0], m_back[0] = value, *this);
         }
 
+        // Escapes a run of UTF-8 text. With xml_string_type::text, runs that need no escaping are scanned in bulk and copied directly
+        xml_escape_iterator &append(const char *first, const char *last) {
+            while (first != last && !failed()) {
+                if (m_type == xml_string_type::text) {
+                    const char *run_end = detail::xml_scan_escape(first, last);
+
+                    if (run_end != first) {
+                        m_out = std::copy(first, run_end, m_out);
+                        m_back[1] = run_end - first > 1? unicode(std::uint8_t(run_end[-2])): m_back[0];
+                        m_back[0] = unicode(std::uint8_t(run_end[-1]));
+                        first = run_end;
+
+                        if (first == last)
+                            break;
+                    }
+                }
+
+                unicode u;
+                std::tie(first, u) = utf8_decode_next(first, last);
+                *this = u;
+            }
+
+            return *this;
+        }
+
         constexpr xml_escape_iterator &operator*() noexcept { return *this; }
         constexpr xml_escape_iterator &operator++() noexcept { return *this; }
         constexpr xml_escape_iterator &operator++(int) noexcept { return *this; }
@@ -403,6 +538,48 @@ namespace skate {
     typedef basic_xml_node<std::wstring> xml_wnode;
 
     namespace detail {
+        template<typename String, typename InputIterator>
+        input_result<InputIterator> xml_read_character_data(InputIterator first, InputIterator last, String &value) {
+            auto back_inserter = skate::make_back_inserter(value);
+            unicode back[2];
+
+            for (; first != last; ++first) {
+                const auto c = std::uint32_t(*first);
+
+                if (c == '<' || c == '&')
+                    break;
+                else if (c == '>' && back[0] == ']' && back[1] == ']')
+                    return { first, result_type::failure };
+
+                *back_inserter++ = c;
+                back[1] = back[0];
+                back[0] = c;
+            }
+
+            return { first, result_type::success };
+        }
+
+        // Contiguous narrow input can be scanned in bulk, copying entire runs of plain character data at once
+        template<typename String, typename CharT, typename std::enable_if<std::is_same<typename std::remove_const<CharT>::type, char>::value, int>::type = 0>
+        input_result<CharT *> xml_read_character_data(CharT *first, CharT *last, String &value) {
+            while (first != last) {
+                CharT *run_end = first + (xml_scan_character_data(first, last) - first);
+
+                std::copy(first, run_end, skate::make_back_inserter(value));
+                first = run_end;
+
+                if (first == last || *first != ']')
+                    break;
+
+                if (last - first >= 3 && first[1] == ']' && first[2] == '>')
+                    return { first, result_type::failure };
+
+                skate::push_back(value, *first++);
+            }
+
+            return { first, result_type::success };
+        }
+
         template<typename String, typename InputIterator>
         input_result<InputIterator> read_xml(InputIterator first, InputIterator last, const xml_read_options &options, basic_xml_node<String> &j) {
             if (first == last || options.nesting_limit_reached())
@@ -411,16 +588,11 @@ namespace skate {
             switch (std::uint32_t(*first)) {
                 default: {
                     String value;
-                    auto back_inserter = skate::make_back_inserter(value);
+                    result_type result = result_type::success;
 
-                    for (; first != last; ++first) {
-                        const auto c = std::uint32_t(*first);
-
-                        if (c == '<' || c == '&')
-                            break;
-
-                        *back_inserter++ = c;
-                    }
+                    std::tie(first, result) = xml_read_character_data(first, last, value);
+                    if (result != result_type::success)
+                        return { first, result };
 
                     j = basic_xml_node<String>::text(std::move(value));
 
@@ -852,8 +1024,8 @@ namespace skate {
             return skate::fp_encode(v, out, true, true);
         }
 
-        template<typename OutputIterator, typename T, typename std::enable_if<skate::is_string<T>::value, int>::type = 0>
-        output_result<OutputIterator> write_xml(OutputIterator out, const xml_write_options &, const T &v, xml_string_type type = xml_string_type::text) {
+        template<typename OutputIterator, typename T>
+        output_result<OutputIterator> xml_write_string(OutputIterator out, const T &v, xml_string_type type) {
             result_type result = result_type::success;
 
             {
@@ -868,6 +1040,21 @@ namespace skate {
             return { out, result };
         }
 
+        // Narrow strings are UTF-8, so runs that need no escaping can be copied directly to the output
+        template<typename OutputIterator, typename... StringParams>
+        output_result<OutputIterator> xml_write_string(OutputIterator out, const std::basic_string<char, StringParams...> &v, xml_string_type type) {
+            auto it = xml_escape_iterator<OutputIterator>(out, type);
+
+            it.append(v.data(), v.data() + v.size());
+
+            return { it.underlying(), it.result() };
+        }
+
+        template<typename OutputIterator, typename T, typename std::enable_if<skate::is_string<T>::value, int>::type = 0>
+        output_result<OutputIterator> write_xml(OutputIterator out, const xml_write_options &, const T &v, xml_string_type type = xml_string_type::text) {
+            return xml_write_string(out, v, type);
+        }
+
         template<typename OutputIterator, typename T, typename std::enable_if<skate::is_array<T>::value, int>::type = 0>
         output_result<OutputIterator> write_xml(OutputIterator out, const xml_write_options &options, const T &v) {
             const auto start = begin(v);
@@ -1019,6 +1206,234 @@ namespace skate {
 
         return { result.result == result_type::success ? std::move(j) : String(), result.result };
     }
+
+    // Streaming XML writer that generates a document incrementally, without materializing a basic_xml_node tree
+    // Output is UTF-8 encoded into a reusable contiguous buffer that is handed to the stream buffer in large blocks
+    // Once an operation fails, all further operations fail as well
+    template<typename String>
+    class basic_xml_stream_writer {
+        typedef skate::back_inserter<std::string> buffer_inserter;
+        typedef utf_encode_iterator<char, buffer_inserter> output_iterator;
+
+        struct open_element {
+            String tag;
+            bool has_children;
+        };
+
+        std::streambuf *m_buf;
+        std::string m_buffer;
+        std::size_t m_block_size;
+        std::vector<open_element> m_stack;
+        xml_write_options m_options;
+        result_type m_result;
+        bool m_tag_open;
+        bool m_has_written_top_level;
+
+        static constexpr std::size_t default_block_size = 64 * 1024;
+
+        xml_write_options options_at(std::size_t depth) const noexcept {
+            return { m_options.indent, unsigned(m_options.current_indentation + depth * m_options.indent) };
+        }
+
+        output_iterator out() { return output_iterator(skate::make_back_inserter(m_buffer)); }
+
+        result_type set_result(result_type result) {
+            m_result = merge_results(m_result, result);
+
+            if (m_result == result_type::success && m_buffer.size() >= m_block_size)
+                flush_buffer();
+
+            return m_result;
+        }
+
+        void flush_buffer() {
+            if (m_buffer.empty())
+                return;
+
+            if (!m_buf || m_buf->sputn(m_buffer.data(), std::streamsize(m_buffer.size())) != std::streamsize(m_buffer.size()))
+                m_result = result_type::failure;
+
+            m_buffer.clear();
+        }
+
+        // Closes a pending start tag and indents for the next child node of the current element
+        void begin_child() {
+            if (m_tag_open) {
+                m_buffer.push_back('>');
+                m_tag_open = false;
+            }
+
+            if (m_stack.empty()) {
+                if (m_has_written_top_level && m_options.indent)
+                    options_at(0).write_indent(out());
+
+                m_has_written_top_level = true;
+            } else {
+                m_stack.back().has_children = true;
+                options_at(m_stack.size()).write_indent(out());
+            }
+        }
+
+        template<typename T>
+        result_type write_delimited(const char *start, const T &value, xml_string_type type, const char *ending) {
+            if (m_result != result_type::success)
+                return m_result;
+
+            begin_child();
+
+            m_buffer.append(start);
+
+            const auto result = skate::write_xml(out(), options_at(m_stack.size()), value, type);
+            if (result.result == result_type::success)
+                m_buffer.append(ending);
+
+            return set_result(merge_results(result.result, result.output.result()));
+        }
+
+    public:
+        basic_xml_stream_writer(std::streambuf *buf, const xml_write_options &options = {}, std::size_t block_size = default_block_size)
+            : m_buf(buf)
+            , m_block_size(std::max<std::size_t>(block_size, 1))
+            , m_options(options)
+            , m_result(buf ? result_type::success : result_type::failure)
+            , m_tag_open(false)
+            , m_has_written_top_level(false)
+        {
+            m_buffer.reserve(m_block_size);
+        }
+        basic_xml_stream_writer(std::ostream &os, const xml_write_options &options = {}, std::size_t block_size = default_block_size)
+            : basic_xml_stream_writer(os.rdbuf(), options, block_size)
+        {}
+        basic_xml_stream_writer(const basic_xml_stream_writer &) = delete;
+        ~basic_xml_stream_writer() { flush(); }
+
+        basic_xml_stream_writer &operator=(const basic_xml_stream_writer &) = delete;
+
+        result_type result() const noexcept { return m_result; }
+        bool failed() const noexcept { return m_result != result_type::success; }
+
+        // Returns the number of elements that have been started but not yet ended
+        std::size_t depth() const noexcept { return m_stack.size(); }
+
+        result_type declaration() {
+            if (m_result != result_type::success)
+                return m_result;
+
+            if (m_has_written_top_level || !m_stack.empty())
+                return m_result = result_type::failure;
+
+            m_buffer.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+            m_has_written_top_level = true;
+
+            return set_result(result_type::success);
+        }
+
+        result_type start_element(const String &tag) {
+            if (m_result != result_type::success)
+                return m_result;
+
+            begin_child();
+
+            m_buffer.push_back('<');
+
+            const auto result = skate::write_xml(out(), m_options, tag, xml_string_type::name);
+
+            m_stack.push_back({ tag, false });
+            m_tag_open = true;
+
+            return set_result(merge_results(result.result, result.output.result()));
+        }
+
+        // Attributes may only be added directly after start_element() or another attribute
+        result_type attribute(const String &key, const basic_xml_attribute_value<String> &value) {
+            if (m_result != result_type::success)
+                return m_result;
+
+            if (!m_tag_open)
+                return m_result = result_type::failure;
+
+            m_buffer.push_back(' ');
+
+            auto result = skate::write_xml(out(), m_options, key, xml_string_type::name);
+            if (result.result == result_type::success && !result.output.failed()) {
+                m_buffer.append("=\"");
+
+                result = skate::write_xml(out(), m_options, value.value());
+                if (result.result == result_type::success)
+                    m_buffer.push_back('"');
+            }
+
+            return set_result(merge_results(result.result, result.output.result()));
+        }
+
+        result_type text(const String &value) { return write_delimited("", value, xml_string_type::text, ""); }
+        result_type cdata(const String &value) { return write_delimited("<![CDATA[", value, xml_string_type::cdata, "]]>"); }
+        result_type comment(const String &value) { return write_delimited("<!-- ", value, xml_string_type::comment, " -->"); }
+        result_type processing_instruction(const String &value) { return write_delimited("<?", value, xml_string_type::processing_instruction, "?>"); }
+
+        // Writes a complete node (and its children) as the next child of the current element
+        result_type node(const basic_xml_node<String> &n) {
+            if (m_result != result_type::success)
+                return m_result;
+
+            begin_child();
+
+            const auto result = skate::write_xml(out(), options_at(m_stack.size()), n);
+
+            return set_result(merge_results(result.result, result.output.result()));
+        }
+
+        result_type end_element() {
+            if (m_result != result_type::success)
+                return m_result;
+
+            if (m_stack.empty())
+                return m_result = result_type::failure;
+
+            open_element element = std::move(m_stack.back());
+            m_stack.pop_back();
+
+            if (m_tag_open) {
+                m_buffer.append("/>");
+                m_tag_open = false;
+
+                return set_result(result_type::success);
+            }
+
+            if (element.has_children)
+                options_at(m_stack.size()).write_indent(out());
+
+            m_buffer.append("</");
+
+            const auto result = skate::write_xml(out(), m_options, element.tag, xml_string_type::name);
+            if (result.result == result_type::success)
+                m_buffer.push_back('>');
+
+            return set_result(merge_results(result.result, result.output.result()));
+        }
+
+        // Ends all open elements and flushes the document to the stream buffer
+        result_type end_document() {
+            while (!m_stack.empty() && m_result == result_type::success)
+                end_element();
+
+            return flush();
+        }
+
+        result_type flush() {
+            if (m_result == result_type::success)
+                flush_buffer();
+
+            if (m_result == result_type::success && m_buf && m_buf->pubsync() != 0)
+                m_result = result_type::failure;
+
+            return m_result;
+        }
+    };
+
+    typedef basic_xml_stream_writer<std::string> xml_stream_writer;
+
+    typedef basic_xml_stream_writer<std::wstring> xml_wstream_writer;
 }
 
 #endif // SKATE_XML_H
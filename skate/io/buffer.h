@@ -10,10 +10,17 @@
 #include "../containers/abstract_list.h"
 
 #include <vector>
+#include <array>
+#include <memory>
 #include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 
 namespace skate {
     template<typename T> class io_buffer;
@@ -39,46 +46,163 @@ namespace skate {
                 });
             }
         };
+
+        // Copies count elements into one contiguous segment of an io_buffer
+        // Raw pointers to trivially copyable elements are copied with memcpy, other iterators use std::copy_n
+        template<typename T, typename It>
+        void io_buffer_copy_n(It src, size_t count, T *dst) { std::copy_n(src, count, dst); }
+
+        template<typename T>
+        typename std::enable_if<std::is_trivially_copyable<T>::value>::type io_buffer_copy_n(const T *src, size_t count, T *dst) {
+            if (count)
+                memcpy(dst, src, count * sizeof(T));
+        }
+
+        template<typename T>
+        typename std::enable_if<std::is_trivially_copyable<T>::value>::type io_buffer_copy_n(T *src, size_t count, T *dst) {
+            io_buffer_copy_n(static_cast<const T *>(src), count, dst);
+        }
     }
 
+    // A contiguous run of elements inside an io_buffer, as returned by reserve_write() and peek_read()
+    template<typename T>
+    struct io_buffer_span {
+        io_buffer_span() : data(nullptr), count(0) {}
+        io_buffer_span(T *data, size_t count) : data(data), count(count) {}
+
+        T *begin() const noexcept { return data; }
+        T *end() const noexcept { return data + count; }
+        bool empty() const noexcept { return count == 0; }
+        size_t size() const noexcept { return count; }
+
+        T *data;
+        size_t count;
+    };
+
+    // Up to two spans covering a region of an io_buffer that may wrap around the end of its storage. The second span is empty if the region doesn't wrap
+    template<typename T>
+    using io_buffer_spans = std::array<io_buffer_span<T>, 2>;
+
+    // Free list of fixed-size storage blocks for io_buffer, so buffers that are often empty can hold no memory while idle
+    // Blocks are borrowed by a buffer when data is written to it and returned when it empties
+    // Blocks keep their full size while pooled, so borrowing one doesn't initialize its elements again
+    // Not thread-safe: share a pool only between buffers used on the same thread
+    template<typename T>
+    class io_buffer_pool {
+        io_buffer_pool(const io_buffer_pool &) = delete;
+        io_buffer_pool &operator=(const io_buffer_pool &) = delete;
+
+        std::vector<std::vector<T>> blocks;
+        size_t block_capacity;
+        size_t max_free_blocks;
+
+    public:
+        // The block capacity is rounded up to a power of two, since io_buffer storage always has a power of two size
+        io_buffer_pool(size_t block_capacity = 16 * 1024, size_t max_free_blocks = 1024)
+            : block_capacity(1)
+            , max_free_blocks(max_free_blocks)
+        {
+            while (this->block_capacity < block_capacity)
+                this->block_capacity *= 2;
+        }
+
+        // Returns a vector of block_size() elements. Elements of a reused block keep whatever values they last held
+        std::vector<T> acquire() {
+            if (blocks.empty())
+                return std::vector<T>(block_capacity);
+
+            std::vector<T> block = std::move(blocks.back());
+            blocks.pop_back();
+            return block;
+        }
+
+        // Takes back a vector. Vectors that aren't exactly the block size, or that don't fit in the free list, are freed instead
+        void release(std::vector<T> &&block) {
+            if (block.size() != block_capacity || blocks.size() >= max_free_blocks)
+                return;
+
+            blocks.push_back(std::move(block));
+        }
+
+        size_t block_size() const noexcept { return block_capacity; }
+        size_t free_blocks() const noexcept { return blocks.size(); }
+
+        // Frees all unused blocks
+        void shrink() { decltype(blocks){}.swap(blocks); }
+    };
+
     // Provides a one-way possibly-expanding circular buffer implementation
+    // Capacity is always zero or a power of two, so positions wrap with a mask
     template<typename T>
     class io_buffer
     {
-        void align() {
-            if (buffer_first_element != 0) { // If readers can't keep up with writers, align to beginning and assume they still won't keep up well
-                std::vector<T> copy;
-
-                copy.reserve(size());
-
-                if (capacity() - buffer_first_element >= size()) {                  // Entirely contiguous
-                    copy.insert(copy.begin(),
-                                std::make_move_iterator(data.begin() + buffer_first_element),
-                                std::make_move_iterator(data.begin() + buffer_first_element + size()));
-                } else {                                                            // Partially contiguous
-                    const size_t contiguous = capacity() - buffer_first_element;    // Number of elements before end of circular buffer
-                    const size_t contiguous_remainder = size() - contiguous;        // Number of wrap-around elements at physical beginning of circular buffer
-
-                    copy.insert(copy.begin(),
-                                std::make_move_iterator(data.begin() + buffer_first_element),
-                                std::make_move_iterator(data.end()));
-                    copy.insert(copy.begin(),
-                                std::make_move_iterator(data.begin()),
-                                std::make_move_iterator(data.begin() + contiguous_remainder));
+        size_t mask() const noexcept { return capacity() - 1; }
+
+        // Grows the storage to a power of two with room for at least count more elements
+        // The vector is resized in place when its allocation allows, and at most one of the two wrapped segments is then moved to keep the ring in order
+        void grow(size_t count) {
+            const size_t old_capacity = capacity();
+            const size_t required = size() + count;
+
+            size_t new_capacity = old_capacity? old_capacity * 2: 1;
+            while (new_capacity < required)
+                new_capacity *= 2;
+            while (new_capacity * 2 <= data.capacity())                 // Use all of a reserved or borrowed allocation
+                new_capacity *= 2;
+
+            data.resize(new_capacity);
+
+            const size_t contiguous = old_capacity - buffer_first_element;  // Number of elements before end of old circular buffer
+            if (buffer_size > contiguous) {
+                const size_t contiguous_remainder = buffer_size - contiguous; // Number of wrap-around elements at physical beginning of circular buffer
+
+                if (contiguous_remainder <= contiguous) {               // Move the wrapped elements to follow the old end
+                    std::move(data.begin(), data.begin() + contiguous_remainder, data.begin() + old_capacity);
+                } else {                                                // Move the first elements to the new end
+                    std::move(data.begin() + buffer_first_element, data.begin() + old_capacity, data.end() - contiguous);
+                    buffer_first_element = new_capacity - contiguous;
                 }
+            }
+        }
 
-                data.swap(copy);
+        // Ensures there is room for count more elements, borrowing or growing the storage if needed
+        void make_room(size_t count) {
+            if (capacity() - size() < count) {
+                borrow_storage(count);
 
-                buffer_first_element = 0;
-            } else {
-                data.resize(size());                                                // Shrink vector to remove possible unused elements
+                if (capacity() - size() < count)
+                    grow(count);
             }
         }
 
+        // Call before growing the storage. Borrows a block from the pool if the buffer doesn't have any storage and count elements fit in it
+        void borrow_storage(size_t count) {
+            if (pool && data.capacity() == 0 && count <= pool->block_size())
+                data = pool->acquire();
+        }
+
+        // Copies count elements from begin to the end of the buffer, in at most two contiguous copies
+        template<typename It>
+        void write_segments(It begin, size_t count) {
+            make_room(count);
+
+            const size_t last = (buffer_first_element + buffer_size) & mask();
+            const size_t contiguous = std::min(count, capacity() - last);   // Number of elements before end of circular buffer
+
+            impl::io_buffer_copy_n(begin, contiguous, data.data() + last);
+            if (contiguous < count)
+                impl::io_buffer_copy_n(std::next(begin, contiguous), count - contiguous, data.data());
+
+            buffer_size += count;
+        }
+
         // Only call when buffer is empty. Shrinks the storage needed to a minimal amount to save space
         void do_empty_shrink() {
             buffer_first_element = 0;
-            if ((buffer_limit != 0 && data.capacity() > buffer_limit) ||
+            if (pool) {                             // Return the storage to the pool while empty
+                pool->release(std::move(data));
+                data = std::vector<T>();
+            } else if ((buffer_limit != 0 && data.capacity() > buffer_limit) ||
                 (buffer_limit == 0 && data.capacity() > 1000000)) {
                 decltype(data){}.swap(data);
                 data.reserve(buffer_limit);
@@ -87,12 +211,29 @@ namespace skate {
 
     public:
         io_buffer(size_t buffer_limit = 0)
-            : buffer_limit(buffer_limit)
+            : pool(nullptr)
+            , buffer_limit(buffer_limit)
             , buffer_first_element(0)
             , buffer_size(0)
             , closed(false)
         {}
-        virtual ~io_buffer() {}
+        virtual ~io_buffer() {
+            if (pool)
+                pool->release(std::move(data));
+        }
+
+        // Sets the pool that storage is borrowed from while the buffer holds data, or null to own storage permanently
+        // The pool must outlive the buffer
+        void set_pool(io_buffer_pool<T> *p) {
+            if (pool && empty())
+                do_empty_shrink();
+
+            pool = p;
+
+            if (pool && empty())
+                do_empty_shrink();
+        }
+        io_buffer_pool<T> *get_pool() const noexcept { return pool; }
 
         // Writes a single value to the buffer, returns true if the value was added, false if it could not be added
         template<typename U>
@@ -100,14 +241,9 @@ namespace skate {
             if (free_space() == 0 || is_closed())
                 return false;
 
-            if (capacity() == size()) {             // Need to grow buffer
-                align();
-
-                data.emplace_back(std::forward<U>(v));
-            } else {                                // More space in vector, no need to reallocate
-                data[(buffer_first_element + buffer_size) % capacity()] = std::forward<U>(v);
-            }
+            make_room(1);
 
+            data[(buffer_first_element + buffer_size) & mask()] = std::forward<U>(v);
             ++buffer_size;
 
             return true;
@@ -122,19 +258,7 @@ namespace skate {
             else if (free_space() < c.size() || is_closed())
                 return false;
 
-            if (capacity() - size() < c.size()) {   // Grow buffer and insert elements
-                align();
-
-                data.insert(data.end(), std::make_move_iterator(c.begin()), std::make_move_iterator(c.end()));
-
-                buffer_size += c.size();
-            } else {                                // More space in vector, no need to reallocate
-                for (auto &item: c) {
-                    data[(buffer_first_element + buffer_size) % capacity()] = std::move(item);
-
-                    ++buffer_size;
-                }
-            }
+            write_segments(std::make_move_iterator(c.begin()), c.size());
 
             return true;
         }
@@ -150,19 +274,7 @@ namespace skate {
             else if (free_space() < count || is_closed())
                 return false;
 
-            if (capacity() - size() < count) {      // Grow buffer and insert elements
-                align();
-
-                data.insert(data.end(), begin, end);
-
-                buffer_size += count;
-            } else {                                // More space in vector, no need to reallocate
-                for (; begin != end; ++begin) {
-                    data[(buffer_first_element + buffer_size) % capacity()] = *begin;
-
-                    ++buffer_size;
-                }
-            }
+            write_segments(begin, count);
 
             return true;
         }
@@ -177,7 +289,7 @@ namespace skate {
             if (--buffer_size == 0) {
                 do_empty_shrink();
             } else
-                buffer_first_element %= capacity();
+                buffer_first_element &= mask();
 
             return value;
         }
@@ -193,7 +305,7 @@ namespace skate {
             if (--buffer_size == 0) {
                 do_empty_shrink();
             } else
-                buffer_first_element %= capacity();
+                buffer_first_element &= mask();
 
             return true;
         }
@@ -223,8 +335,8 @@ namespace skate {
                 }
             }
 
-            buffer_first_element = (buffer_first_element + consumed) % capacity();
-            buffer_size -= max;
+            buffer_first_element = (buffer_first_element + consumed) & mask();
+            buffer_size -= consumed;
 
             if (buffer_size == 0)
                 do_empty_shrink();
@@ -277,6 +389,71 @@ namespace skate {
             }
         }
 
+        // Makes room for up to max more elements and returns the free space after the buffer contents, in at most two spans
+        // The elements can be written in place, then made readable with commit_write(). Fewer than max elements are returned if max_size() would be exceeded
+        // No spans are returned if the buffer is closed. The spans are invalidated by any other write to the buffer
+        io_buffer_spans<T> reserve_write(size_t max) {
+            io_buffer_spans<T> spans;
+
+            max = std::min(max, free_space());
+            if (max == 0 || is_closed())
+                return spans;
+
+            make_room(max);
+
+            const size_t last = (buffer_first_element + buffer_size) & mask();
+            const size_t contiguous = std::min(max, capacity() - last);     // Number of elements before end of circular buffer
+
+            spans[0] = io_buffer_span<T>(data.data() + last, contiguous);
+            if (contiguous < max)
+                spans[1] = io_buffer_span<T>(data.data(), max - contiguous);
+
+            return spans;
+        }
+
+        // Adds count elements, written in place to the spans from the last reserve_write(), to the end of the buffer
+        // count must not be more than the number of elements reserved
+        void commit_write(size_t count) {
+            buffer_size += std::min(count, capacity() - size());
+
+            if (buffer_size == 0)                   // Nothing was written, so give back any storage borrowed by reserve_write()
+                do_empty_shrink();
+        }
+
+        // Returns up to max elements from the front of the buffer, in at most two spans, without removing them
+        // The elements can be read (or moved from) in place, then removed with consume(). The spans are invalidated by any write to the buffer
+        io_buffer_spans<T> peek_read(size_t max = SIZE_MAX) {
+            io_buffer_spans<T> spans;
+
+            max = std::min(max, size());
+            if (max == 0)
+                return spans;
+
+            const size_t contiguous = std::min(max, capacity() - buffer_first_element);
+
+            spans[0] = io_buffer_span<T>(data.data() + buffer_first_element, contiguous);
+            if (contiguous < max)
+                spans[1] = io_buffer_span<T>(data.data(), max - contiguous);
+
+            return spans;
+        }
+
+        // Removes count elements from the front of the buffer, usually after reading them with peek_read()
+        // Returns the number of elements removed
+        size_t consume(size_t count) {
+            count = std::min(count, size());
+            if (count == 0)
+                return 0;
+
+            buffer_first_element = (buffer_first_element + count) & mask();
+            buffer_size -= count;
+
+            if (buffer_size == 0)
+                do_empty_shrink();
+
+            return count;
+        }
+
         // All data in the buffer is cleared and memory is released
         void clear() {
             buffer_size = 0;
@@ -305,7 +482,8 @@ namespace skate {
         size_t size() const noexcept { return buffer_size; }
 
     protected:
-        std::vector<T> data;                        // Size of vector is capacity
+        std::vector<T> data;                        // Size of vector is capacity, always zero or a power of two
+        io_buffer_pool<T> *pool;                    // Pool that storage is borrowed from, if any
         size_t buffer_limit;                        // Limit to how many elements can be in buffer. If 0, unlimited
         size_t buffer_first_element;                // Position of first element in buffer
         size_t buffer_size;                         // Number of elements in buffer
@@ -316,7 +494,7 @@ namespace skate {
     // Usage of this buffer should be guarded with io_threadsafe_buffer_producer_guard and io_threadsafe_buffer_consumer_guard
     template<typename T>
     class io_threadsafe_buffer : private io_buffer<T> {
-        template<typename>
+        template<typename, typename>
         friend class io_threadsafe_pipe;
 
         typedef io_buffer<T> base;
@@ -614,12 +792,13 @@ namespace skate {
         return std::make_shared<io_threadsafe_buffer<T>>(buffer_limit);
     }
 
-    template<typename T>
+    // Buffer may be any buffer with register_consumer() and unregister_consumer(), such as io_spsc_buffer<T>
+    template<typename T, typename Buffer = io_threadsafe_buffer<T>>
     class io_threadsafe_buffer_consumer_guard {
-        std::atomic<io_threadsafe_buffer<T> *> buffer;
+        std::atomic<Buffer *> buffer;
 
     public:
-        io_threadsafe_buffer_consumer_guard(io_threadsafe_buffer<T> &buffer) : buffer(&buffer) {
+        io_threadsafe_buffer_consumer_guard(Buffer &buffer) : buffer(&buffer) {
             buffer.register_consumer();
         }
         ~io_threadsafe_buffer_consumer_guard() {
@@ -628,19 +807,20 @@ namespace skate {
 
         // Returns true if just closed, false if already closed
         bool close() {
-            io_threadsafe_buffer<T> *temp = buffer.exchange(nullptr);
+            Buffer *temp = buffer.exchange(nullptr);
             if (temp)
                 temp->unregister_consumer();
             return temp;
         }
     };
 
-    template<typename T>
+    // Buffer may be any buffer with register_producer() and unregister_producer(), such as io_spsc_buffer<T>
+    template<typename T, typename Buffer = io_threadsafe_buffer<T>>
     class io_threadsafe_buffer_producer_guard {
-        std::atomic<io_threadsafe_buffer<T> *> buffer;
+        std::atomic<Buffer *> buffer;
 
     public:
-        io_threadsafe_buffer_producer_guard(io_threadsafe_buffer<T> &buffer) : buffer(&buffer) {
+        io_threadsafe_buffer_producer_guard(Buffer &buffer) : buffer(&buffer) {
             buffer.register_producer();
         }
         ~io_threadsafe_buffer_producer_guard() {
@@ -649,33 +829,698 @@ namespace skate {
 
         // Returns true if just closed, false if already closed
         bool close() {
-            io_threadsafe_buffer<T> *temp = buffer.exchange(nullptr);
+            Buffer *temp = buffer.exchange(nullptr);
             if (temp)
                 temp->unregister_producer();
             return temp;
         }
     };
 
+    // Provides a bounded one-way buffer from exactly one producer thread to exactly one consumer thread, without locking while data flows
+    // The ring has a power-of-two capacity. The producer and consumer each publish their position with a single atomic store per batch,
+    // and only fall back to waiting on a condition variable when the buffer is full or empty
+    // Usage of this buffer may be guarded with io_threadsafe_buffer_producer_guard<T, io_spsc_buffer<T>> and io_threadsafe_buffer_consumer_guard<T, io_spsc_buffer<T>>
+    // Functions documented as producer (or consumer) functions must only be called from the producer (or consumer) thread
+    template<typename T>
+    class io_spsc_buffer {
+        io_spsc_buffer(const io_spsc_buffer &) = delete;
+        io_spsc_buffer &operator=(const io_spsc_buffer &) = delete;
+
+        static constexpr size_t cache_line = 64;
+
+        static size_t round_capacity(size_t capacity) noexcept {
+            size_t result = 1;
+            while (result < capacity && result <= SIZE_MAX / 2)
+                result <<= 1;
+            return result;
+        }
+
+        std::vector<T> slots;
+        const size_t mask;
+
+        char pad0[cache_line];
+        std::atomic<size_t> tail;                   // Position of the next element to be written, only modified by the producer
+        size_t cached_head;                         // Producer's last view of head
+        char pad1[cache_line];
+        std::atomic<size_t> head;                   // Position of the next element to be read, only modified by the consumer
+        size_t cached_tail;                         // Consumer's last view of tail
+        char pad2[cache_line];
+
+        // Blocking is only used when full or empty
+        std::mutex mtx;
+        std::condition_variable producer_wait, consumer_wait;
+        std::atomic<bool> producer_waiting, consumer_waiting;
+        std::atomic<size_t> consumer_count, producer_count;
+        std::atomic<bool> consumer_registered, producer_registered;
+
+        bool consumers_available() const { return consumer_count || !consumer_registered; }
+        bool producers_available() const { return producer_count || !producer_registered; }
+
+        // Producer: returns the number of free slots, refreshing the view of head only if needed elements don't fit
+        size_t producer_free_space(size_t needed) {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            if (slots.size() - (t - cached_head) < needed)
+                cached_head = head.load(std::memory_order_acquire);
+
+            return slots.size() - (t - cached_head);
+        }
+
+        // Consumer: returns the number of available elements, refreshing the view of tail only if the cached view is empty
+        size_t consumer_available() {
+            const size_t h = head.load(std::memory_order_relaxed);
+            if (cached_tail == h)
+                cached_tail = tail.load(std::memory_order_acquire);
+
+            return cached_tail - h;
+        }
+
+        // Waits until ready() returns true. The flag tells the other side that it must notify
+        // Spins briefly first, since the other side is usually about to catch up and sleeping costs far more than a few checks
+        template<typename Ready>
+        void block(std::atomic<bool> &waiting, std::condition_variable &cv, Ready ready) {
+            for (unsigned spins = 0; spins < 128; ++spins) {
+                if (ready())
+                    return;
+                else if (spins >= 64)
+                    std::this_thread::yield();
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+
+            waiting = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst); // The other side stores its position, then checks the flag, so one of them sees the other
+            while (!ready())
+                cv.wait(lock);
+            waiting = false;
+        }
+
+        void notify(std::atomic<bool> &waiting, std::condition_variable &cv) {
+            if (waiting) {
+                std::lock_guard<std::mutex> lock(mtx);
+                cv.notify_one();
+            }
+        }
+
+        void publish(size_t new_tail) {
+            tail.store(new_tail, std::memory_order_seq_cst);
+            notify(consumer_waiting, consumer_wait);
+        }
+
+        void consume(size_t new_head) {
+            head.store(new_head, std::memory_order_seq_cst);
+            notify(producer_waiting, producer_wait);
+        }
+
+        // Producer: waits for count free slots. Returns false if they will never be available
+        bool reserve(size_t count, bool wait) {
+            if (producer_free_space(count) >= count)
+                return true;
+            else if (!wait || count > slots.size())
+                return false;
+
+            bool available = false;
+            block(producer_waiting, producer_wait, [&]() {
+                return (available = producer_free_space(count) >= count) || !consumers_available();
+            });
+
+            return available;
+        }
+
+        // Consumer: waits for data. Returns the number of elements available
+        size_t await(bool wait) {
+            size_t available = consumer_available();
+            if (available || !wait)
+                return available;
+
+            block(consumer_waiting, consumer_wait, [&]() {
+                // Check once more after seeing the producer leave, since it may have published just before leaving
+                return (available = consumer_available()) != 0 || (!producers_available() && ((available = consumer_available()), true));
+            });
+
+            return available;
+        }
+
+    public:
+        // Creates a buffer holding at least capacity elements (rounded up to a power of two)
+        io_spsc_buffer(size_t capacity = 1024)
+            : slots(round_capacity(std::max<size_t>(capacity, 1)))
+            , mask(slots.size() - 1)
+            , tail(0)
+            , cached_head(0)
+            , head(0)
+            , cached_tail(0)
+            , producer_waiting(false)
+            , consumer_waiting(false)
+            , consumer_count(0)
+            , producer_count(0)
+            , consumer_registered(false)
+            , producer_registered(false)
+        {}
+        virtual ~io_spsc_buffer() {}
+
+        void register_consumer() {
+            consumer_registered = true;
+            ++consumer_count;
+        }
+        void unregister_consumer() {
+            size_t count = consumer_count;
+            while (count && !consumer_count.compare_exchange_weak(count, count - 1));
+
+            if (count == 1) { // Let the producer know that the consumer hung up
+                std::lock_guard<std::mutex> lock(mtx);
+                producer_wait.notify_all();
+            }
+        }
+        void register_producer() {
+            producer_registered = true;
+            ++producer_count;
+        }
+        void unregister_producer() {
+            size_t count = producer_count;
+            while (count && !producer_count.compare_exchange_weak(count, count - 1));
+
+            if (count == 1) { // Let the consumer know that the producer hung up
+                std::lock_guard<std::mutex> lock(mtx);
+                consumer_wait.notify_all();
+            }
+        }
+
+        // Producer: writes a single value to the buffer, returns true if the value was added, false if it could not be added
+        // If wait is true, the function blocks until the data was successfully added to the buffer, thus the return value is usually always true
+        // If wait is true, nothing could be written, and the consumer has unregistered, returns false
+        template<typename U>
+        bool write(U &&v, bool wait = true) {
+            if (!reserve(1, wait))
+                return false;
+
+            const size_t t = tail.load(std::memory_order_relaxed);
+            slots[t & mask] = std::forward<U>(v);
+            publish(t + 1);
+
+            return true;
+        }
+
+        // Producer: writes a sequence of values to the buffer, returns true if they were all added, false if none were added
+        // All values are published to the consumer at once
+        // If wait is true, the function blocks until the data was successfully added to the buffer, thus the return value is usually always true
+        // If wait is true, nothing could be written, and the consumer has unregistered, returns false
+        // Also returns false if the sequence is larger than the buffer's capacity
+        template<typename It>
+        bool write(It begin, It end, bool wait = true) {
+            const size_t count = size_t(std::distance(begin, end));
+            if (count == 0)
+                return true;
+            else if (!reserve(count, wait))
+                return false;
+
+            const size_t t = tail.load(std::memory_order_relaxed);
+            const size_t first = t & mask;
+            const size_t contiguous = std::min(count, slots.size() - first);   // Number of elements before end of ring
+
+            impl::io_buffer_copy_n(begin, contiguous, slots.data() + first);
+            if (contiguous < count)
+                impl::io_buffer_copy_n(std::next(begin, contiguous), count - contiguous, slots.data());
+
+            publish(t + count);
+
+            return true;
+        }
+
+        // Producer: writes a sequence of values to the buffer from the provided container, moving them, returns true if they were all added, false if none were added
+        // Has the same semantics as write(begin, end, wait)
+        template<typename Container>
+        bool write_from(Container &&c, bool wait = true) {
+            return write(std::make_move_iterator(c.begin()), std::make_move_iterator(c.end()), wait);
+        }
+
+        // Consumer: returns a default-constructed element if empty() and wait is false
+        // If wait is true, nothing could be read, and the producer has unregistered, returns a default-constructed element
+        T read(bool wait = true) {
+            T value{};
+            read(value, wait);
+            return value;
+        }
+
+        // Consumer: reads a single element if possible
+        // Returns false if nothing could be read
+        bool read(T &element, bool wait = true) {
+            if (!await(wait))
+                return false;
+
+            const size_t h = head.load(std::memory_order_relaxed);
+            element = std::move(slots[h & mask]);
+            consume(h + 1);
+
+            return true;
+        }
+
+        // Consumer: data, up to max elements, is written to predicate as `size_t (T *data, size_t len)`
+        // The predicate must return the number of elements consumed
+        // The data can be moved from the provided parameters, and `len` will never be 0
+        // Predicate may be invoked twice when the data wraps around the end of the ring (although not consuming all data means "stop early")
+        // All consumed elements are released to the producer at once
+        // If wait is true, the function blocks until data is available to be read, thus usually always calling the predicate with at least some data
+        // If wait is true, nothing could be read, and the producer has unregistered, the predicate is never called
+        template<typename Predicate>
+        size_t read(size_t max, Predicate p, bool wait = true) {
+            max = std::min(max, await(wait));
+            if (max == 0)
+                return 0;
+
+            const size_t h = head.load(std::memory_order_relaxed);
+            const size_t first = h & mask;
+            const size_t contiguous = std::min(max, slots.size() - first);
+
+            size_t consumed = std::min<size_t>(contiguous, p(slots.data() + first, contiguous));
+            if (consumed == contiguous && contiguous < max)
+                consumed += std::min<size_t>(max - contiguous, p(slots.data(), max - contiguous));
+
+            if (consumed)
+                consume(h + consumed);
+
+            return consumed;
+        }
+
+        // Consumer: all available data is written to predicate as `size_t (T *data, size_t len)`, with the same semantics as read(max, p, wait)
+        template<typename Predicate>
+        size_t read_all(Predicate p, bool wait = true) { return read(SIZE_MAX, p, wait); }
+
+        // Consumer: data, up to max elements, is added to the specified output iterator
+        // If wait is true, the function waits until data is available to be read
+        template<typename OutputIterator>
+        size_t read_into(size_t max, OutputIterator c, bool wait = true) {
+            return read(max, [&](T *data, size_t len) {
+                for (size_t i = 0; i < len; ++i)
+                    *c++ = std::move(data[i]);
+
+                return len;
+            }, wait);
+        }
+
+        // Consumer: data, up to max elements, is added to a new container of the specified container type with push_back() and returned
+        template<typename Container>
+        Container read(size_t max, bool wait = true) {
+            Container c;
+            read_into(max, std::back_inserter(c), wait);
+            return c;
+        }
+
+        // Consumer: all available data is added to the specified output iterator
+        template<typename OutputIterator>
+        size_t read_all_into(OutputIterator c, bool wait = true) { return read_into(SIZE_MAX, c, wait); }
+
+        // Consumer: all available data is added to a new container of the specified container type with push_back() and returned
+        template<typename Container>
+        Container read_all(bool wait = true) {
+            Container c;
+            read_all_into(std::back_inserter(c), wait);
+            return c;
+        }
+
+        // Consumer: all available data is assigned to the specified vector (NOT appended), reusing its storage
+        void read_all_swap(std::vector<T> &c, bool wait = true) {
+            c.clear();
+            read_all_into(std::back_inserter(c), wait);
+        }
+
+        // Consumer: discards all available data
+        void clear() {
+            const size_t h = head.load(std::memory_order_relaxed);
+            const size_t available = consumer_available();
+
+            for (size_t i = 0; i < available; ++i)
+                slots[(h + i) & mask] = T();
+
+            if (available)
+                consume(h + available);
+        }
+
+        // Returns true if no more data will be able to be read from this buffer (i.e. if empty and the producer has disconnected)
+        bool at_end() const { return empty() && !producers_available(); }
+
+        bool empty() const { return size() == 0; }
+        size_t max_size() const noexcept { return slots.size(); }
+        size_t free_space() const { return slots.size() - size(); }
+        size_t capacity() const noexcept { return slots.size(); }
+        size_t size() const {
+            const size_t h = head.load(std::memory_order_acquire);
+            return tail.load(std::memory_order_acquire) - h;
+        }
+    };
+
+    // Provides a bounded one-way buffer from any number of producer threads to any number of consumer threads, without locking while data flows
+    // Each slot of the power-of-two ring carries a sequence number (D. Vyukov's bounded MPMC queue), so producers and consumers only contend on
+    // a single compare-and-swap of their own position. Blocking falls back to a condition variable only when the buffer is full or empty
+    // The API follows io_threadsafe_buffer, including producer/consumer registration for hang-up detection, except that elements are read one at a time
+    // and predicate-based reads are not available. Unlike io_threadsafe_buffer, the buffer is always bounded
+    template<typename T>
+    class io_mpmc_buffer {
+        io_mpmc_buffer(const io_mpmc_buffer &) = delete;
+        io_mpmc_buffer &operator=(const io_mpmc_buffer &) = delete;
+
+        static constexpr size_t cache_line = 64;
+
+        struct cell {
+            std::atomic<size_t> sequence;           // Equal to the position when free, position + 1 when holding data
+            T value;
+        };
+
+        static size_t round_capacity(size_t capacity) noexcept {
+            size_t result = 2;
+            while (result < capacity && result <= SIZE_MAX / 2)
+                result <<= 1;
+            return result;
+        }
+
+        std::unique_ptr<cell[]> cells;
+        const size_t mask;
+
+        char pad0[cache_line];
+        std::atomic<size_t> enqueue_pos;            // Position of the next slot to be claimed by a producer
+        char pad1[cache_line];
+        std::atomic<size_t> dequeue_pos;            // Position of the next slot to be claimed by a consumer
+        char pad2[cache_line];
+
+        // Blocking is only used when full or empty
+        std::mutex mtx;
+        std::condition_variable producer_wait, consumer_wait;
+        std::atomic<size_t> producers_waiting, consumers_waiting;
+        std::atomic<size_t> consumer_count, producer_count;
+        std::atomic<bool> consumer_registered, producer_registered;
+
+        bool consumers_available() const { return consumer_count || !consumer_registered; }
+        bool producers_available() const { return producer_count || !producer_registered; }
+
+        // Claims count consecutive free slots. Returns false if they aren't all free
+        bool try_claim(size_t count, size_t &pos) {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+
+            while (true) {
+                bool retry = false;
+
+                for (size_t i = 0; i < count; ++i) {
+                    const size_t sequence = cells[(pos + i) & mask].sequence.load(std::memory_order_acquire);
+                    const intptr_t diff = intptr_t(sequence) - intptr_t(pos + i);
+
+                    if (diff < 0)                   // Slot still holds data from the previous lap
+                        return false;
+                    else if (diff > 0) {            // Another producer moved past pos
+                        retry = true;
+                        break;
+                    }
+                }
+
+                if (retry)
+                    pos = enqueue_pos.load(std::memory_order_relaxed);
+                else if (enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                    return true;
+            }
+        }
+
+        // Removes one element into value. Returns false if empty. Callers must notify waiting producers afterwards
+        bool try_pop(T &value) {
+            size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+            cell *c;
+
+            while (true) {
+                c = &cells[pos & mask];
+
+                const size_t sequence = c->sequence.load(std::memory_order_acquire);
+                const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+
+                if (diff == 0) {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                        break;
+                } else if (diff < 0)                // Slot not written yet
+                    return false;
+                else
+                    pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+
+            value = std::move(c->value);
+            c->sequence.store(pos + mask + 1, std::memory_order_release);
+
+            return true;
+        }
+
+        // Waits until ready() returns true, spinning briefly first. The counter tells the other side that it must notify
+        template<typename Ready>
+        void block(std::atomic<size_t> &waiting, std::condition_variable &cv, Ready ready) {
+            for (unsigned spins = 0; spins < 128; ++spins) {
+                if (ready())
+                    return;
+                else if (spins >= 64)
+                    std::this_thread::yield();
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+
+            ++waiting;
+            std::atomic_thread_fence(std::memory_order_seq_cst); // The other side publishes, then checks the counter, so one of them sees the other
+            while (!ready())
+                cv.wait(lock);
+            --waiting;
+        }
+
+        void notify(std::atomic<size_t> &waiting, std::condition_variable &cv) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting) {
+                std::lock_guard<std::mutex> lock(mtx);
+                cv.notify_all();
+            }
+        }
+
+        // Claims count slots, waiting if requested. Returns false if they will never be available
+        bool claim(size_t count, bool wait, size_t &pos) {
+            if (try_claim(count, pos))
+                return true;
+            else if (!wait || count > capacity())
+                return false;
+
+            bool claimed = false;
+            block(producers_waiting, producer_wait, [&]() {
+                return (claimed = try_claim(count, pos)) || !consumers_available();
+            });
+
+            return claimed;
+        }
+
+        void publish(size_t pos) {
+            cells[pos & mask].sequence.store(pos + 1, std::memory_order_release);
+        }
+
+    public:
+        // Creates a buffer holding at least capacity elements (rounded up to a power of two). A capacity of 0 uses the default of 1024
+        io_mpmc_buffer(size_t capacity = 1024)
+            : cells(new cell[round_capacity(capacity? capacity: 1024)])
+            , mask(round_capacity(capacity? capacity: 1024) - 1)
+            , enqueue_pos(0)
+            , dequeue_pos(0)
+            , producers_waiting(0)
+            , consumers_waiting(0)
+            , consumer_count(0)
+            , producer_count(0)
+            , consumer_registered(false)
+            , producer_registered(false)
+        {
+            for (size_t i = 0; i <= mask; ++i)
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        virtual ~io_mpmc_buffer() {}
+
+        void register_consumer() {
+            consumer_registered = true;
+            ++consumer_count;
+        }
+        void unregister_consumer() {
+            size_t count = consumer_count;
+            while (count && !consumer_count.compare_exchange_weak(count, count - 1));
+
+            if (count == 1) { // Let producers know that the last consumer hung up
+                std::lock_guard<std::mutex> lock(mtx);
+                producer_wait.notify_all();
+            }
+        }
+        void register_producer() {
+            producer_registered = true;
+            ++producer_count;
+        }
+        void unregister_producer() {
+            size_t count = producer_count;
+            while (count && !producer_count.compare_exchange_weak(count, count - 1));
+
+            if (count == 1) { // Let consumers know that the last producer hung up
+                std::lock_guard<std::mutex> lock(mtx);
+                consumer_wait.notify_all();
+            }
+        }
+
+        // Writes a single value to the buffer, returns true if the value was added, false if it could not be added
+        // v is only moved from if the value was added
+        // If wait is true, the function blocks until the data was successfully added to the buffer, thus the return value is usually always true
+        // If wait is true, nothing could be written, and all consumers have unregistered, returns false
+        template<typename U>
+        bool write(U &&v, bool wait = true) {
+            size_t pos;
+            if (!claim(1, wait, pos))
+                return false;
+
+            cells[pos & mask].value = std::forward<U>(v);
+            publish(pos);
+            notify(consumers_waiting, consumer_wait);
+
+            return true;
+        }
+
+        // Writes a sequence of values to consecutive slots, returns true if they were all added, false if none were added
+        // Values from other producers are never interleaved with the sequence
+        // If wait is true, the function blocks until the data was successfully added to the buffer, thus the return value is usually always true
+        // If wait is true, nothing could be written, and all consumers have unregistered, returns false
+        // Also returns false if the sequence is larger than the buffer's capacity
+        template<typename It>
+        bool write(It begin, It end, bool wait = true) {
+            const size_t count = size_t(std::distance(begin, end));
+            size_t pos;
+
+            if (count == 0)
+                return true;
+            else if (!claim(count, wait, pos))
+                return false;
+
+            for (size_t i = 0; begin != end; ++begin, ++i) {
+                cells[(pos + i) & mask].value = *begin;
+                publish(pos + i);
+            }
+            notify(consumers_waiting, consumer_wait);
+
+            return true;
+        }
+
+        // Writes a sequence of values to the buffer from the provided container, moving them, with the same semantics as write(begin, end, wait)
+        template<typename Container>
+        bool write_from(Container &&c, bool wait = true) {
+            return write(std::make_move_iterator(c.begin()), std::make_move_iterator(c.end()), wait);
+        }
+
+        // Returns a default-constructed element if empty() and wait is false
+        // If wait is true, nothing could be read, and all producers have unregistered, returns a default-constructed element
+        T read(bool wait = true) {
+            T value{};
+            read(value, wait);
+            return value;
+        }
+
+        // Reads a single element if possible
+        // Returns false if nothing could be read
+        bool read(T &element, bool wait = true) {
+            bool popped = try_pop(element);
+
+            if (!popped && wait) {
+                block(consumers_waiting, consumer_wait, [&]() {
+                    // Check once more after seeing the last producer leave, since it may have published just before leaving
+                    return (popped = try_pop(element)) || (!producers_available() && ((popped = try_pop(element)), true));
+                });
+            }
+
+            if (popped)
+                notify(producers_waiting, producer_wait);
+
+            return popped;
+        }
+
+        // Data, up to max elements, is added to the specified output iterator
+        // If wait is true, the function waits until at least one element is available to be read
+        template<typename OutputIterator>
+        size_t read_into(size_t max, OutputIterator c, bool wait = true) {
+            T value;
+            size_t count = 0;
+
+            if (max == 0 || !read(value, wait))
+                return 0;
+
+            do {
+                *c++ = std::move(value);
+                ++count;
+            } while (count < max && try_pop(value));
+
+            if (count > 1)
+                notify(producers_waiting, producer_wait);
+
+            return count;
+        }
+
+        // Data, up to max elements, is added to a new container of the specified container type with push_back() and returned
+        template<typename Container>
+        Container read(size_t max, bool wait = true) {
+            Container c;
+            read_into(max, std::back_inserter(c), wait);
+            return c;
+        }
+
+        // All available data is added to the specified output iterator
+        template<typename OutputIterator>
+        size_t read_all_into(OutputIterator c, bool wait = true) { return read_into(SIZE_MAX, c, wait); }
+
+        // All available data is added to a new container of the specified container type with push_back() and returned
+        template<typename Container>
+        Container read_all(bool wait = true) {
+            Container c;
+            read_all_into(std::back_inserter(c), wait);
+            return c;
+        }
+
+        // All available data is assigned to the specified vector (NOT appended), reusing its storage
+        void read_all_swap(std::vector<T> &c, bool wait = true) {
+            c.clear();
+            read_all_into(std::back_inserter(c), wait);
+        }
+
+        // Discards all available data
+        void clear() {
+            T value;
+            while (try_pop(value));
+
+            notify(producers_waiting, producer_wait);
+        }
+
+        // Returns true if no more data will be able to be read from this buffer (i.e. if empty and all producers have disconnected)
+        bool at_end() const { return empty() && !producers_available(); }
+
+        bool empty() const { return size() == 0; }
+        size_t max_size() const noexcept { return mask + 1; }
+        size_t free_space() const { return max_size() - size(); }
+        size_t capacity() const noexcept { return mask + 1; }
+        // Approximate while producers or consumers are active
+        size_t size() const {
+            const size_t dequeued = dequeue_pos.load(std::memory_order_acquire);
+            const size_t enqueued = enqueue_pos.load(std::memory_order_acquire);
+            return std::min(enqueued - std::min(enqueued, dequeued), capacity());
+        }
+    };
+
     // A two-way threadsafe pipe buffer, allowing any number of producers and consumers to share the same pipe
     // Usage of this class should be guarded with io_threadsafe_pipe_guard, which also allows shutting down individual channels of the pipe
-    template<typename T>
+    // Buffer is the type of each channel, io_threadsafe_buffer<T> by default or io_mpmc_buffer<T> for a lock-free bounded pipe (see io_mpmc_pipe)
+    template<typename T, typename Buffer = io_threadsafe_buffer<T>>
     class io_threadsafe_pipe {
-        template<typename>
+        template<typename, typename>
         friend class io_threadsafe_pipe_guard;
 
-        std::array<io_threadsafe_buffer_ptr<T>, 2> a;               // Always writes to pipe 0 and reads from pipe 1
+        std::array<std::shared_ptr<Buffer>, 2> a;                   // Always writes to pipe 0 and reads from pipe 1
 
-        io_threadsafe_pipe(io_threadsafe_buffer_ptr<T> l, io_threadsafe_buffer_ptr<T> r) noexcept : a{l, r} {}
+        io_threadsafe_pipe(std::shared_ptr<Buffer> l, std::shared_ptr<Buffer> r) noexcept : a{{l, r}} {}
 
-        io_threadsafe_buffer<T> &sink() noexcept { return *a[0]; }
-        io_threadsafe_buffer<T> &source() noexcept { return *a[1]; }
+        Buffer &sink() noexcept { return *a[0]; }
+        Buffer &source() noexcept { return *a[1]; }
+        const Buffer &source() const noexcept { return *a[1]; }
 
     public:
         virtual ~io_threadsafe_pipe() {}
 
+        // buffer_limit is passed to the constructor of each channel's Buffer
         static std::pair<io_threadsafe_pipe, io_threadsafe_pipe> make_threadsafe_pipe(size_t buffer_limit = 0) {
-            auto  left = make_threadsafe_io_buffer<T>(buffer_limit);
-            auto right = make_threadsafe_io_buffer<T>(buffer_limit);
+            auto  left = std::make_shared<Buffer>(buffer_limit);
+            auto right = std::make_shared<Buffer>(buffer_limit);
 
             return std::make_pair(io_threadsafe_pipe(left, right),
                                   io_threadsafe_pipe(right, left)); // Channels swapped so read/writes go to the other
@@ -743,13 +1588,13 @@ namespace skate {
         }
     };
 
-    template<typename T>
+    template<typename T, typename Buffer = io_threadsafe_buffer<T>>
     class io_threadsafe_pipe_guard {
-        io_threadsafe_buffer_consumer_guard<T> consumer;
-        io_threadsafe_buffer_producer_guard<T> producer;
+        io_threadsafe_buffer_consumer_guard<T, Buffer> consumer;
+        io_threadsafe_buffer_producer_guard<T, Buffer> producer;
 
     public:
-        io_threadsafe_pipe_guard(io_threadsafe_pipe<T> &pipe)
+        io_threadsafe_pipe_guard(io_threadsafe_pipe<T, Buffer> &pipe)
             : consumer(pipe.source())
             , producer(pipe.sink())
         {}
@@ -767,6 +1612,16 @@ namespace skate {
     std::pair<io_threadsafe_pipe<T>, io_threadsafe_pipe<T>> make_threadsafe_pipe(size_t buffer_limit = 0) {
         return io_threadsafe_pipe<T>::make_threadsafe_pipe(buffer_limit);
     }
+
+    // A two-way pipe backed by lock-free bounded channels, for many producers and consumers
+    template<typename T>
+    using io_mpmc_pipe = io_threadsafe_pipe<T, io_mpmc_buffer<T>>;
+
+    // Creates a lock-free pipe whose channels each hold capacity elements (rounded up to a power of two, or 1024 if 0)
+    template<typename T>
+    std::pair<io_mpmc_pipe<T>, io_mpmc_pipe<T>> make_mpmc_pipe(size_t capacity = 1024) {
+        return io_mpmc_pipe<T>::make_threadsafe_pipe(capacity);
+    }
 }
 
 #endif // SKATE_IO_BUFFER_H
@@ -11,6 +11,12 @@
 #include <mutex>
 #include <thread>
 #include <functional>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <type_traits>
+#include <cstring>
+#include <cstdio>
 
 #include "buffer.h"
 #include "../system/time.h"
@@ -44,6 +50,111 @@ namespace skate {
         std::string data;
     };
 
+    // Format of a message logged with async_logger::log_deferred()
+    // Only the address is recorded when logging, so it must outlive the logger (declare it static)
+    // Each "{}" in the format is replaced by the next argument. Arguments without a placeholder are appended to the end
+    struct deferred_log_format {
+        constexpr deferred_log_format(log_type type, const char *format) : type(type), format(format) {}
+
+        log_type type;
+        const char *format;
+    };
+
+    namespace impl {
+        // Output stream buffer that appends to a string, so a batch of log entries can be formatted and then written out at once
+        class log_batch_streambuf : public std::streambuf {
+            std::string &out;
+
+        protected:
+            virtual int_type overflow(int_type c) override {
+                if (!traits_type::eq_int_type(c, traits_type::eof()))
+                    out.push_back(traits_type::to_char_type(c));
+
+                return traits_type::not_eof(c);
+            }
+            virtual std::streamsize xsputn(const char *s, std::streamsize n) override {
+                out.append(s, size_t(n));
+                return n;
+            }
+
+        public:
+            log_batch_streambuf(std::string &out) : out(out) {}
+        };
+    }
+
+    namespace impl {
+        // Header of a binary record written by async_logger::log_deferred(). The arguments follow, copied byte-for-byte
+        struct deferred_log_header {
+            void (*decode)(std::string &out, const char *format, const char *args);
+            const deferred_log_format *format;
+            int64_t ticks;                  // steady_clock time since its epoch
+            size_t size;                    // Size of the record, including this header
+        };
+
+        inline void deferred_log_append(std::string &out, bool v) { out += v? "true": "false"; }
+        inline void deferred_log_append(std::string &out, char v) { out.push_back(v); }
+        inline void deferred_log_append(std::string &out, const char *v) { out += v? v: "(null)"; }
+        inline void deferred_log_append(std::string &out, const void *v) {
+            char buf[32];
+            out.append(buf, std::max(0, snprintf(buf, sizeof(buf), "%p", v)));
+        }
+        inline void deferred_log_append(std::string &out, double v) {
+            char buf[32];
+            out.append(buf, std::max(0, snprintf(buf, sizeof(buf), "%g", v)));
+        }
+        template<typename T>
+        typename std::enable_if<std::is_integral<T>::value>::type deferred_log_append(std::string &out, T v) { out += std::to_string(v); }
+        template<typename T>
+        typename std::enable_if<std::is_enum<T>::value>::type deferred_log_append(std::string &out, T v) {
+            deferred_log_append(out, typename std::underlying_type<T>::type(v));
+        }
+
+        // Appends the format up to the next placeholder, and returns the position after the placeholder
+        inline const char *deferred_log_next(std::string &out, const char *format) {
+            const char *placeholder = strstr(format, "{}");
+            if (!placeholder) {
+                out += format;
+                return format + strlen(format);
+            }
+
+            out.append(format, placeholder);
+            return placeholder + 2;
+        }
+
+        template<typename... Args>
+        struct deferred_log_args;
+
+        template<>
+        struct deferred_log_args<> {
+            static constexpr size_t size = 0;
+            static constexpr bool trivially_copyable = true;
+
+            static void encode(char *) {}
+            static void decode(std::string &out, const char *format, const char *) { out += format; }
+        };
+
+        template<typename T, typename... Rest>
+        struct deferred_log_args<T, Rest...> {
+            static constexpr size_t size = sizeof(T) + deferred_log_args<Rest...>::size;
+            static constexpr bool trivially_copyable = std::is_trivially_copyable<T>::value && deferred_log_args<Rest...>::trivially_copyable;
+
+            static void encode(char *out, const T &value, const Rest &... rest) {
+                memcpy(out, &value, sizeof(T));
+                deferred_log_args<Rest...>::encode(out + sizeof(T), rest...);
+            }
+
+            static void decode(std::string &out, const char *format, const char *args) {
+                T value;
+                memcpy(&value, args, sizeof(T));
+
+                format = deferred_log_next(out, format);
+                deferred_log_append(out, value);
+
+                deferred_log_args<Rest...>::decode(out, format, args + sizeof(T));
+            }
+        };
+    }
+
     class logger_base {
     protected:
         using time_point = std::chrono::time_point<std::chrono::system_clock>;
@@ -66,14 +177,15 @@ namespace skate {
             //
             // Messages with newlines are broken into multiple lines with optional indentation (e.g. "REASON: <indent spaces>message\n")
 
-            std::string tstring;
-
             if (!out)
                 return;
 
+            // Formatted with the thread's cached formatter, so only the fractional digits change between entries in the same second
+            const std::string *tstring = nullptr;
+
             if (options.time_point_options.enabled) {
-                tstring = time_point_to_string(entry.when, options.time_point_options);
-                out->sputn(tstring.c_str(), tstring.size());
+                tstring = &impl::thread_time_point_formatter(options.time_point_options).format(entry.when);
+                out->sputn(tstring->c_str(), tstring->size());
                 out->sputn(": ", 2);
             }
 
@@ -90,8 +202,8 @@ namespace skate {
                 out->sputc('\n');
 
                 // Output time on newly-written line
-                if (options.time_point_options.enabled) {
-                    out->sputn(tstring.c_str(), tstring.size());
+                if (tstring) {
+                    out->sputn(tstring->c_str(), tstring->size());
                     out->sputn(": ", 2);
                 }
 
@@ -229,63 +341,361 @@ namespace skate {
     };
 
     // Simple logger class with asynchronous output, custom date/time formatting, and multiple error levels
+    // Each logging thread stages entries in its own lock-free ring, and the writer thread collects them in batches,
+    // when a thread has staged flush_bytes of messages, when an error is logged, or every flush_interval, whichever comes first
     class async_logger : public logger_base {
         async_logger(const async_logger &) = delete;
         async_logger(async_logger &&) = delete;
         async_logger &operator=(const async_logger &) = delete;
         async_logger &operator=(async_logger &&) = delete;
 
+        // Entries staged by one thread for one logger
+        struct staging {
+            staging(size_t capacity) : ring(capacity), records(nullptr), pending_bytes(0), retired(false) {
+                ring.register_consumer(); // On behalf of the writer thread, so blocked producers give up once it exits
+            }
+            ~staging() { delete records.load(); }
+
+            io_spsc_buffer<logger_entry> ring;
+            std::atomic<io_spsc_buffer<char> *> records; // Binary records from log_deferred(), created on first use
+            std::atomic<size_t> pending_bytes;  // Message bytes staged but not yet collected by the writer
+            std::atomic<bool> retired;          // Set once the writer has exited, so the logging thread can drop its reference
+        };
+
+        struct thread_staging {
+            uint64_t logger;
+            std::shared_ptr<staging> s;
+        };
+
+        static uint64_t next_logger_id() {
+            static std::atomic<uint64_t> id(0);
+            return ++id;
+        }
+
+        // Stagings of the current thread, one per logger it has written to
+        static std::vector<thread_staging> &thread_stagings() {
+            static thread_local std::vector<thread_staging> stagings;
+            return stagings;
+        }
+
     protected:
         template<typename Fn>
         async_logger(Fn fn) : async_logger(fn, [](){}) {}
         template<typename Fn, typename StartFn>
         async_logger(Fn fn, StartFn start) : async_logger(fn, start, [](){}) {}
         template<typename Fn, typename StartFn, typename EndFn>
-        async_logger(Fn fn, StartFn start, EndFn end) : producer_guard(d) {
-            set_buffer_limit(5000000); // Default to store and read no more than 5,000,000 log entries at once
-
+        async_logger(Fn fn, StartFn start, EndFn end)
+            : id(next_logger_id())
+            , system_epoch(std::chrono::system_clock::now())
+            , steady_epoch(std::chrono::steady_clock::now())
+            , retired(false)
+            , staging_capacity(4096)
+            , flush_bytes(64 * 1024)
+            , flush_interval_us(50000)
+            , wake_requested(false)
+            , closing(false)
+        {
             thrd = std::thread([=]() {
-                io_threadsafe_buffer_consumer_guard<logger_entry> consumer_guard(d);
-
                 std::vector<logger_entry> entries;
                 bool started = false;
 
-                do {
-                    d.read_all_swap(entries);
+                while (true) {
+                    const bool stop = wait_for_batch();
+
+                    collect(entries);
+                    if (entries.empty() && !stop)
+                        continue;
 
                     if (!started) {
                         start();
                         started = true;
                     }
 
-                    for (size_t i = 0; i < entries.size(); ++i)
+                    for (size_t i = 0; i < entries.size(); ++i) {
                         fn(std::move(entries[i]));
-                } while (entries.size());
+
+                        if ((i + 1) % max_batch_entries == 0)
+                            async_write_batch_end();
+                    }
+
+                    if (entries.size())
+                        async_write_batch_end();
+
+                    if (stop)               // Entries logged while closing are dropped, as with writes to a closed buffer
+                        break;
+
+                    entries.clear();
+                }
+
+                retire_stagings();
 
                 if (started)
                     end();
             });
         }
 
+        // Called on the writer thread after each batch of entries has been passed to the write function, so batches can be written out at once
+        virtual void async_write_batch_end() {}
+
     private:
-        io_threadsafe_buffer<logger_entry> d; // Unlimited-size thread buffer to allow any number of log writes
-        io_threadsafe_buffer_producer_guard<logger_entry> producer_guard;
+        static constexpr size_t max_batch_entries = 4096; // Most entries passed to the write function between calls to async_write_batch_end()
+
+        const uint64_t id;
+        const std::chrono::system_clock::time_point system_epoch; // Wall-clock time of steady_epoch, to convert deferred record timestamps
+        const std::chrono::steady_clock::time_point steady_epoch;
+        std::mutex stagings_mtx;
+        std::vector<std::shared_ptr<staging>> stagings; // Guarded by stagings_mtx
+        bool retired;                       // Set once the writer has exited, guarded by stagings_mtx
+        std::atomic<size_t> staging_capacity;
+        std::atomic<size_t> flush_bytes;
+        std::atomic<int64_t> flush_interval_us;
+
+        std::mutex wake_mtx;
+        std::condition_variable wake_cv;
+        std::atomic<bool> wake_requested;
+        bool closing;                       // Guarded by wake_mtx
         std::thread thrd;
 
-        virtual void write_log(logger_entry &&entry) final { d.write(std::move(entry)); }
-        virtual void write_logs(logger_entry *entry, size_t n) final { d.write(std::make_move_iterator(entry), std::make_move_iterator(entry + n)); }
+        void wake() {
+            if (!wake_requested.exchange(true)) {
+                std::lock_guard<std::mutex> lock(wake_mtx);
+                wake_cv.notify_one();
+            }
+        }
+
+        // Waits until a batch should be written, and returns true if the logger is closing
+        // The interval is read again whenever the writer is notified, so set_flush_policy() applies to the current wait
+        bool wait_for_batch() {
+            std::unique_lock<std::mutex> lock(wake_mtx);
+            const auto start = std::chrono::steady_clock::now();
+
+            while (!wake_requested.load() && !closing) {
+                const auto deadline = start + std::chrono::microseconds(flush_interval_us.load(std::memory_order_relaxed));
+                if (std::chrono::steady_clock::now() >= deadline)
+                    break;
+
+                wake_cv.wait_until(lock, deadline);
+            }
+            wake_requested = false;
+
+            return closing;
+        }
+
+        // Moves all staged entries into entries, in time order
+        void collect(std::vector<logger_entry> &entries) {
+            std::vector<std::shared_ptr<staging>> current;
+            {
+                std::lock_guard<std::mutex> lock(stagings_mtx);
+
+                // Drop stagings of threads that have exited, once they are empty
+                stagings.erase(std::remove_if(stagings.begin(), stagings.end(), [](const std::shared_ptr<staging> &s) {
+                    const io_spsc_buffer<char> *records = s->records.load(std::memory_order_acquire);
+
+                    return s.use_count() == 1 && s->ring.size() == 0 && (!records || records->size() == 0);
+                }), stagings.end());
+
+                current = stagings;
+            }
+
+            std::vector<char> records;
+            size_t sources = 0;
+            for (const auto &s: current) {
+                if (io_spsc_buffer<char> *ring = s->records.load(std::memory_order_acquire)) {
+                    records.clear();
+                    ring->read_all([&](char *data, size_t n) {
+                        records.insert(records.end(), data, data + n);
+                        return n;
+                    }, false);
+
+                    if (records.size()) {
+                        s->pending_bytes.fetch_sub(records.size(), std::memory_order_relaxed);
+                        decode_records(records, entries);
+                        ++sources;
+                    }
+                }
+
+                size_t bytes = 0;
+                const size_t count = s->ring.read_all([&](logger_entry *data, size_t n) {
+                    for (size_t i = 0; i < n; ++i) {
+                        bytes += data[i].data.size();
+                        entries.push_back(std::move(data[i]));
+                    }
+                    return n;
+                }, false);
+
+                if (count) {
+                    s->pending_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+                    ++sources;
+                }
+            }
+
+            if (sources > 1)
+                std::stable_sort(entries.begin(), entries.end(), [](const logger_entry &a, const logger_entry &b) { return a.when < b.when; });
+        }
+
+        // Formats binary records from log_deferred() into entries. Records are always published whole
+        void decode_records(const std::vector<char> &records, std::vector<logger_entry> &entries) const {
+            for (size_t offset = 0; offset + sizeof(impl::deferred_log_header) <= records.size(); ) {
+                impl::deferred_log_header header;
+                memcpy(&header, records.data() + offset, sizeof(header));
+
+                const auto elapsed = std::chrono::steady_clock::duration(header.ticks) - steady_epoch.time_since_epoch();
+
+                logger_entry entry{system_epoch + std::chrono::duration_cast<std::chrono::system_clock::duration>(elapsed), header.format->type, std::string()};
+                header.decode(entry.data, header.format->format, records.data() + offset + sizeof(header));
+                entries.push_back(std::move(entry));
+
+                offset += header.size;
+            }
+        }
+
+        void retire_stagings() {
+            std::lock_guard<std::mutex> lock(stagings_mtx);
+
+            for (const auto &s: stagings) {
+                s->retired = true;
+                s->ring.unregister_consumer();
+
+                if (io_spsc_buffer<char> *records = s->records.load())
+                    records->unregister_consumer();
+            }
+
+            stagings.clear();
+            retired = true;
+        }
+
+        // Returns the current thread's staging for this logger, or null if the logger is closed
+        staging *thread_staging_for_logger() {
+            std::vector<thread_staging> &local = thread_stagings();
+
+            for (const auto &entry: local)
+                if (entry.logger == id)
+                    return entry.s.get();
+
+            // Forget stagings of closed loggers before adding one
+            local.erase(std::remove_if(local.begin(), local.end(), [](const thread_staging &entry) { return entry.s->retired.load(); }), local.end());
+
+            std::shared_ptr<staging> s = std::make_shared<staging>(staging_capacity.load(std::memory_order_relaxed));
+            {
+                std::lock_guard<std::mutex> lock(stagings_mtx);
+                if (retired)
+                    return nullptr;
+
+                stagings.push_back(s);
+            }
+
+            local.push_back(thread_staging{id, s});
+            return s.get();
+        }
+
+        // Returns the ring for binary records of a staging, or null if the logger is closed
+        io_spsc_buffer<char> *records_for_staging(staging &s) {
+            io_spsc_buffer<char> *records = s.records.load(std::memory_order_relaxed); // Only this thread sets it
+            if (records)
+                return records;
+
+            std::lock_guard<std::mutex> lock(stagings_mtx); // Serializes with retire_stagings(), so the ring is never left registered to an exited writer
+            if (retired)
+                return nullptr;
+
+            records = new io_spsc_buffer<char>(staging_capacity.load(std::memory_order_relaxed) * 64);
+            records->register_consumer();
+            s.records.store(records, std::memory_order_release);
+
+            return records;
+        }
+
+        void stage_record(staging &s, const char *record, size_t size, bool urgent) {
+            io_spsc_buffer<char> *records = records_for_staging(s);
+            if (!records)
+                return;
+
+            if (!records->write(record, record + size, false)) { // Full, so make sure the writer is draining before waiting
+                wake();
+                if (!records->write(record, record + size))
+                    return;
+            }
+
+            const size_t threshold = flush_bytes.load(std::memory_order_relaxed);
+            const size_t before = s.pending_bytes.fetch_add(size, std::memory_order_relaxed);
+            if (urgent || (before < threshold && before + size >= threshold))
+                wake();
+        }
+
+        void stage(staging &s, logger_entry &&entry) {
+            const size_t bytes = entry.data.size();
+            const bool urgent = entry.type == log_type::error || entry.type == log_type::critical;
+
+            if (!s.ring.write(std::move(entry), false)) { // Full, so make sure the writer is draining before waiting
+                wake();
+                if (!s.ring.write(std::move(entry)))
+                    return;
+            }
+
+            const size_t threshold = flush_bytes.load(std::memory_order_relaxed);
+            const size_t before = s.pending_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            if (urgent || (before < threshold && before + bytes >= threshold))
+                wake();
+        }
+
+        virtual void write_log(logger_entry &&entry) final {
+            if (staging *s = thread_staging_for_logger())
+                stage(*s, std::move(entry));
+        }
+        virtual void write_logs(logger_entry *entry, size_t n) final {
+            if (staging *s = thread_staging_for_logger())
+                for (size_t i = 0; i < n; ++i)
+                    stage(*s, std::move(entry[i]));
+        }
 
     public:
         virtual ~async_logger() {
             close();
         }
 
-        // Set maximum number of messages buffered in this logger
-        void set_buffer_limit(size_t buffered_messages) { d.set_max_size(buffered_messages); }
+        // Set maximum number of messages buffered by each logging thread. Only applies to threads that haven't logged yet
+        void set_buffer_limit(size_t buffered_messages) { staging_capacity = std::max<size_t>(buffered_messages, 1); }
+
+        // Set when staged messages are written: once a thread has buffered at least bytes of messages, or after interval, whichever comes first
+        // Errors and critical messages are always written as soon as possible
+        void set_flush_policy(size_t bytes, std::chrono::microseconds interval) {
+            flush_bytes = std::max<size_t>(bytes, 1);
+            flush_interval_us = std::max<int64_t>(interval.count(), 1);
+
+            std::lock_guard<std::mutex> lock(wake_mtx);
+            wake_cv.notify_one();
+        }
+
+        // Logs a message whose formatting is deferred to the writer thread
+        // Only the format's address, a steady_clock timestamp, and a byte copy of the arguments are recorded, so arguments must be trivially copyable
+        // (numbers, characters, enums, and pointers). A const char * argument is printed as a string, so it must point to a string that outlives the logger, like a literal
+        template<typename... Args>
+        void log_deferred(const deferred_log_format &format, const Args &... args) {
+            typedef impl::deferred_log_args<typename std::decay<const Args>::type...> encoding;
+            static_assert(encoding::trivially_copyable, "Arguments of deferred log messages must be trivially copyable");
+
+            char record[sizeof(impl::deferred_log_header) + encoding::size];
+            const impl::deferred_log_header header = {&encoding::decode, &format, int64_t(std::chrono::steady_clock::now().time_since_epoch().count()), sizeof(record)};
+
+            memcpy(record, &header, sizeof(header));
+            encoding::encode(record + sizeof(header), args...);
+
+            if (staging *s = thread_staging_for_logger())
+                stage_record(*s, record, sizeof(record), format.type == log_type::error || format.type == log_type::critical);
+        }
 
         // Permanently closes the logger and waits for all writing to complete
         virtual void close() final {
-            if (producer_guard.close() && thrd.joinable())
+            {
+                std::lock_guard<std::mutex> lock(wake_mtx);
+                if (closing)
+                    return;
+
+                closing = true;
+                wake_cv.notify_one();
+            }
+
+            if (thrd.joinable())
                 thrd.join();
         }
     };
@@ -297,6 +707,8 @@ namespace skate {
         std::string path;
         std::ios_base::openmode flags;
         default_logger_options options;
+        std::string batch;                  // Entries formatted by the asynchronous writer, not yet written to the file
+        impl::log_batch_streambuf batch_buf;
 
         // Constructor options for inheriting loggers
         // Compatibility with async_logger
@@ -312,9 +724,19 @@ namespace skate {
             }, end)
             , path(path)
             , flags(flags)
+            , batch_buf(batch)
         {}
 
     private:
+        // Compatibility with async_logger, writes the formatted batch with a single call and flushes once per batch
+        virtual void async_write_batch_end() final {
+            f.rdbuf()->sputn(batch.data(), batch.size());
+            batch.clear();
+
+            if (options.always_flush)
+                f.flush();
+        }
+
         // Compatibility with sync_logger
         virtual void sync_write_start() final {
             f.open(path, flags);
@@ -328,7 +750,11 @@ namespace skate {
         template<typename Path>
         file_logger_template(Path path, default_logger_options options = {}, std::ios_base::openmode flags = std::ios_base::out | std::ios_base::app)
             : file_logger_template(path, flags, [this](logger_entry &&entry) {
-                LoggerType::do_default_log(f.rdbuf(), std::move(entry), this->options);
+                // Only used by async_logger, which flushes once per batch instead
+                default_logger_options batch_options = this->options;
+                batch_options.always_flush = false;
+
+                LoggerType::do_default_log(&batch_buf, std::move(entry), batch_options);
             })
         {
             this->options = options;
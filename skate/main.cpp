@@ -2,11 +2,13 @@
 //#include <afx.h>
 
 #include <iostream>
+#include <sstream>
 #include "threadbuffer.h"
 #include <thread>
 #include <vector>
 
 #include "io/buffer.h"
+#include "system/thread_pool.h"
 #include "containers/tree.h"
 #include "containers/sparse_array.h"
 
@@ -15,6 +17,9 @@
 
 static std::mutex coutMutex;
 
+// Unlike assert(), always evaluated, so checked calls can have side effects
+#define CHECK(x) do { if (!(x)) { std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #x "\n"; std::abort(); } } while (0)
+
 template<typename Message>
 void consumer(skate::MessageHandler<Message> buffer) {
     Message m;
@@ -435,8 +440,932 @@ void test_xml() {
     std::cout << "XML: " << skate::xml(n, skate::xml_write_options(2)) << '\n';
 }
 
+void test_mpmc_buffer() {
+    // The last producer leaves right after writing, and the blocked consumer must still get everything
+    for (size_t round = 0; round < 1000; ++round) {
+        skate::io_mpmc_buffer<size_t> buffer(4);
+        buffer.register_consumer();
+        buffer.register_producer();
+
+        std::thread producer([&]() {
+            for (size_t i = 0; i < 10; ++i)
+                buffer.write(i);
+            buffer.unregister_producer();
+        });
+
+        size_t value, expected = 0;
+        while (buffer.read(value))
+            CHECK(value == expected++);
+        CHECK(expected == 10);
+        CHECK(buffer.at_end());
+
+        producer.join();
+    }
+
+    // Many producers and consumers
+    skate::io_mpmc_buffer<size_t> buffer(16);
+    std::atomic<size_t> sum(0), count(0);
+    std::vector<std::thread> threads;
+
+    buffer.register_consumer();
+    buffer.register_producer();
+    for (size_t i = 0; i < 4; ++i) {
+        buffer.register_producer();
+        threads.emplace_back([&]() {
+            for (size_t j = 1; j <= 1000; ++j)
+                buffer.write(j);
+            buffer.unregister_producer();
+        });
+        threads.emplace_back([&]() {
+            size_t value;
+            while (buffer.read(value)) {
+                sum += value;
+                ++count;
+            }
+        });
+    }
+    buffer.unregister_producer();
+
+    for (auto &thread: threads)
+        thread.join();
+
+    CHECK(count == 4000);
+    CHECK(sum == 4 * 500500);
+}
+
+void test_spsc_buffer() {
+    for (size_t round = 0; round < 1000; ++round) {
+        skate::io_spsc_buffer<size_t> buffer(4);
+        buffer.register_consumer();
+        buffer.register_producer();
+
+        std::thread producer([&]() {
+            std::vector<size_t> batch = {3, 4, 5};
+
+            buffer.write(size_t(0));
+            buffer.write(size_t(1));
+            buffer.write(size_t(2));
+            buffer.write(batch.begin(), batch.end());
+            for (size_t i = 6; i < 20; ++i)
+                buffer.write(i);
+            buffer.unregister_producer();
+        });
+
+        size_t expected = 0, value;
+        while (expected < 10 && buffer.read(value))
+            CHECK(value == expected++);
+
+        // Wrapped reads may arrive in two parts
+        while (buffer.read(SIZE_MAX, [&](size_t *data, size_t len) {
+            for (size_t i = 0; i < len; ++i)
+                CHECK(data[i] == expected++);
+            return len;
+        }));
+
+        CHECK(expected == 20);
+        CHECK(buffer.at_end());
+
+        producer.join();
+    }
+}
+
+void test_thread_pool() {
+    for (size_t round = 0; round < 20; ++round) {
+        std::atomic<size_t> count(0);
+        std::atomic<bool> outside_worker(false);
+
+        {
+            skate::thread_pool pool(skate::thread_pool_options(4));
+            CHECK(pool.size() == 4);
+            CHECK(!pool.is_worker_thread());
+
+            // Tasks that post more tasks from workers, enough to grow the workers' deques
+            pool.post([&]() {
+                if (!pool.is_worker_thread())
+                    outside_worker = true;
+
+                for (size_t i = 0; i < 100; ++i) {
+                    pool.post([&]() {
+                        for (size_t j = 0; j < 10; ++j)
+                            pool.post([&]() { ++count; });
+
+                        ++count;
+                    });
+                }
+
+                ++count;
+            });
+
+            // Batches from outside and from inside a worker
+            std::vector<std::function<void ()>> batch(100, [&]() { ++count; });
+            pool.post_batch(batch.begin(), batch.end());
+            pool.post([&]() {
+                std::vector<std::function<void ()>> nested(50, [&]() { ++count; });
+                pool.post_batch(nested.begin(), nested.end());
+            });
+
+            std::future<int> value = pool.submit([]() { return 42; });
+            CHECK(value.get() == 42);
+
+            std::future<void> failure = pool.submit([]() { throw std::runtime_error("task failed"); });
+            bool caught = false;
+            try {
+                failure.get();
+            } catch (const std::runtime_error &e) {
+                caught = std::string(e.what()) == "task failed";
+            }
+            CHECK(caught);
+
+            // Queued behind a slow task, so the destructor is still running tasks when called
+            pool.post([]() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+            for (size_t i = 0; i < 1000; ++i)
+                pool.post([&]() { ++count; });
+        }
+
+        CHECK(!outside_worker);
+        CHECK(count == 1 + 100 + 1000 + 100 + 50 + 1000);
+    }
+}
+
+void test_message_queue() {
+    auto queue = skate::MessageQueueInterface<int>::create(4);
+
+    // Full queue
+    for (int i = 0; i < 4; ++i)
+        CHECK(queue->send(i, skate::QueueImmediate) == skate::MessageSuccess);
+    CHECK(queue->send(4, skate::QueueImmediate) == skate::MessageTryAgain);
+    CHECK(queue->send(4, skate::QueueForceSend) == skate::MessageSuccessLostData);
+    CHECK(queue->send(5, skate::QueueBlockUntilDone) == skate::MessageUnsupported);
+    CHECK(queue->waitingMessages() == 4);
+
+    int m;
+    for (int i = 1; i <= 4; ++i) {
+        CHECK(queue->read(m, skate::QueueImmediate) == skate::MessageSuccess);
+        CHECK(m == i);
+    }
+    CHECK(queue->read(m, skate::QueueImmediate) == skate::MessageTryAgain);
+    CHECK(queue->read(m, skate::QueueBlockUntilDone, skate::ReadWithoutRemoving) == skate::MessageUnsupported);
+
+    // Concurrent senders and readers, and readers finish once the queue is closed and drained
+    std::atomic<int> sum(0);
+    std::vector<std::thread> senders, readers;
+
+    for (int i = 0; i < 2; ++i) {
+        readers.emplace_back([&]() {
+            int value;
+            while (skate::MessageWasReceived(queue->read(value)))
+                sum += value;
+        });
+    }
+    for (int i = 0; i < 3; ++i) {
+        senders.emplace_back([&]() {
+            for (int j = 1; j <= 1000; ++j)
+                CHECK(queue->send(j) == skate::MessageSuccess);
+        });
+    }
+
+    for (auto &thread: senders)
+        thread.join();
+    queue->close();
+    for (auto &thread: readers)
+        thread.join();
+
+    CHECK(sum == 3 * 500500);
+    CHECK(queue->send(0) == skate::MessageFailed);
+    CHECK(queue->read(m) == skate::MessageFailed);
+}
+
+void test_timer_wheel() {
+    typedef skate::timer_wheel::clock clock;
+    typedef std::chrono::milliseconds ms;
+
+    const clock::time_point start = clock::now();
+    skate::timer_wheel wheel(ms(1), start);
+    std::vector<int> fired;
+
+    // One timer per level, so each higher-level timer cascades down before firing
+    wheel.arm(ms(5), [&]() { fired.push_back(0); }, start);
+    wheel.arm(ms(300), [&]() { fired.push_back(1); }, start);
+    wheel.arm(ms(70000), [&]() { fired.push_back(2); }, start);
+    wheel.arm(ms(20000000), [&]() { fired.push_back(3); }, start);
+    CHECK(wheel.size() == 4);
+
+    const long long due[] = {5, 300, 70000, 20000000};
+    for (size_t i = 0; i < 4; ++i) {
+        const long long previous = i? due[i - 1]: 0;
+        const clock::time_point before = start + ms(due[i] - 1);
+
+        // The poll timeout must never sleep past a due timer
+        CHECK(wheel.next_timeout(start + ms(previous)) <= ms(due[i] - previous));
+
+        wheel.advance(before);
+        CHECK(fired.size() == i);
+        CHECK(wheel.next_timeout(before) > std::chrono::nanoseconds::zero());
+
+        wheel.advance(start + ms(due[i]));
+        CHECK(fired.size() == i + 1 && fired.back() == int(i));
+    }
+    CHECK(wheel.empty());
+    CHECK(wheel.next_timeout() < std::chrono::nanoseconds::zero());
+
+    // Many timers across levels, fired on the first advance at or after their expiry
+    {
+        skate::timer_wheel random_wheel(ms(1), start);
+        std::vector<long long> expiry(2000), fired_after(2000, -1), fired_at(2000, -1);
+        long long now = 0, last = 0;
+
+        srand(1);
+        for (size_t i = 0; i < expiry.size(); ++i) {
+            expiry[i] = 1 + (((long long) rand() << 8) ^ rand()) % 4000000;
+            random_wheel.arm(ms(expiry[i]), [&, i]() { fired_after[i] = last; fired_at[i] = now; }, start);
+        }
+
+        while (!random_wheel.empty()) {
+            last = now;
+            now += 1 + rand() % 50000;
+            random_wheel.advance(start + ms(now));
+        }
+
+        for (size_t i = 0; i < expiry.size(); ++i)
+            CHECK(fired_after[i] < expiry[i] && expiry[i] <= fired_at[i]);
+    }
+
+    // Cancel and reset
+    {
+        skate::timer_wheel timers(ms(1), start);
+        int count = 0;
+
+        const auto canceled = timers.arm(ms(10), [&]() { count += 1; }, start);
+        const auto moved = timers.arm(ms(10), [&]() { count += 10; }, start);
+        const auto later = timers.arm(ms(100000), [&]() { count += 100; }, start);
+
+        CHECK(timers.cancel(canceled));
+        CHECK(!timers.cancel(canceled));
+        CHECK(!timers.is_armed(canceled));
+        CHECK(timers.reset(moved, ms(500), start + ms(5)));
+        CHECK(timers.reset(later, ms(20), start)); // Moves a level-2 timer down to level 0
+
+        timers.advance(start + ms(20));
+        CHECK(count == 100);
+        CHECK(!timers.reset(later, ms(20), start + ms(20)));
+
+        timers.advance(start + ms(504));
+        CHECK(count == 100);
+        timers.advance(start + ms(505));
+        CHECK(count == 110);
+
+        // Stale ids stay invalid when their slot is reused
+        const auto reused = timers.arm(ms(1), [&]() { count += 1000; }, start + ms(505));
+        CHECK(!timers.cancel(canceled) && !timers.cancel(moved));
+        CHECK(timers.is_armed(reused));
+
+        // Callbacks may arm more timers, which fire on a later advance
+        timers.reset(reused, ms(1), start + ms(505));
+        timers.arm(ms(1), [&]() { timers.arm(ms(1), [&]() { count += 10000; }, start + ms(506)); }, start + ms(505));
+        timers.advance(start + ms(506));
+        CHECK(count == 1110);
+        timers.advance(start + ms(507));
+        CHECK(count == 11110);
+        CHECK(timers.empty());
+    }
+}
+
+struct http_parsed_head {
+    skate::http_request_parser::status status;
+    size_t head_size;
+    std::string method, target;
+    unsigned int major, minor;
+    std::vector<std::pair<std::string, std::string>> headers;
+
+    http_parsed_head(const skate::http_request_parser &parser, const char *data)
+        : status(parser.state())
+        , head_size(parser.head_size())
+        , method(parser.method().to_string(data))
+        , target(parser.target().to_string(data))
+        , major(parser.major())
+        , minor(parser.minor())
+    {
+        for (const auto &header: parser.headers())
+            headers.emplace_back(header.name.to_string(data), header.value_string(data));
+    }
+
+    bool operator==(const http_parsed_head &other) const {
+        return status == other.status && head_size == other.head_size && method == other.method && target == other.target &&
+               major == other.major && minor == other.minor && headers == other.headers;
+    }
+};
+
+void test_http_parser() {
+    // Leading blank line, bare line feeds, a folded header, and the start of a pipelined request after the head
+    const std::string request = "\r\nPOST /path?q=1 HTTP/1.1\r\nHost: example.com\r\nX-Folded: first\r\n  second\r\nX-Empty:\n"
+                                "Content-Length: 5\r\n\r\nhelloGET / HTTP/1.1\r\n";
+    const char *data = request.data();
+
+    skate::http_request_parser parser;
+    CHECK(parser.parse(data, request.size()) == skate::http_request_parser::status::complete);
+    const http_parsed_head whole(parser, data);
+
+    CHECK(whole.method == "POST" && whole.target == "/path?q=1" && whole.major == 1 && whole.minor == 1);
+    CHECK(whole.headers.size() == 4 && whole.headers[1].second == "first second" && whole.headers[2].second.empty());
+    CHECK(request.compare(whole.head_size, 5, "hello") == 0);
+
+    // Split at every byte boundary
+    for (size_t split = 0; split <= request.size(); ++split) {
+        parser.reset();
+
+        const auto first = parser.parse(data, split);
+        CHECK(first == (split >= whole.head_size? skate::http_request_parser::status::complete: skate::http_request_parser::status::incomplete));
+
+        parser.parse(data, request.size());
+        CHECK(http_parsed_head(parser, data) == whole);
+    }
+
+    // One byte at a time
+    parser.reset();
+    for (size_t size = 1; size <= request.size() && parser.state() == skate::http_request_parser::status::incomplete; ++size)
+        parser.parse(data, size);
+    CHECK(http_parsed_head(parser, data) == whole);
+
+    // Errors are found wherever the input is split
+    const std::string bad = "GET / HTTP/1.1\r\nNo colon here\r\n\r\n";
+    for (size_t split = 0; split <= bad.size(); ++split) {
+        parser.reset();
+        parser.parse(bad.data(), split);
+        CHECK(parser.parse(bad.data(), bad.size()) == skate::http_request_parser::status::error);
+    }
+}
+
+void test_http_chunked_decoder() {
+    // Chunk extensions, uppercase hex sizes, trailers, and the start of a pipelined request after the body
+    const std::string encoded = "5;ext=1\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n1\n!\n0\r\nTrailer: yes\r\n\r\nGET / HTTP/1.1\r\n";
+    const std::string expected = "helloabcdefghijklmnopqrstuvwxyz!";
+    const size_t encoded_size = encoded.find("GET");
+
+    skate::http_chunked_decoder decoder;
+    std::string body;
+
+    CHECK(decoder.decode(encoded.data(), encoded.size(), body) == encoded_size);
+    CHECK(decoder.state() == skate::http_chunked_decoder::status::complete);
+    CHECK(body == expected);
+
+    // Split at every byte boundary, passing unconsumed bytes again
+    for (size_t split = 0; split <= encoded.size(); ++split) {
+        decoder.reset();
+        body.clear();
+
+        size_t consumed = decoder.decode(encoded.data(), split, body);
+        CHECK(consumed <= split);
+        CHECK(decoder.state() == (split >= encoded_size? skate::http_chunked_decoder::status::complete: skate::http_chunked_decoder::status::incomplete));
+
+        consumed += decoder.decode(encoded.data() + consumed, encoded.size() - consumed, body);
+        CHECK(consumed == encoded_size);
+        CHECK(decoder.state() == skate::http_chunked_decoder::status::complete);
+        CHECK(body == expected);
+    }
+
+    // One byte at a time
+    decoder.reset();
+    body.clear();
+
+    size_t consumed = 0;
+    for (size_t size = 1; size <= encoded.size() && decoder.state() == skate::http_chunked_decoder::status::incomplete; ++size)
+        consumed += decoder.decode(encoded.data() + consumed, size - consumed, body);
+
+    CHECK(consumed == encoded_size && body == expected);
+
+    // Errors are found wherever the input is split
+    const std::string bad = "5\r\nhelloX\r\n0\r\n\r\n";
+    for (size_t split = 0; split <= bad.size(); ++split) {
+        decoder.reset();
+        body.clear();
+
+        const size_t first = decoder.decode(bad.data(), split, body);
+        decoder.decode(bad.data() + first, bad.size() - first, body);
+        CHECK(decoder.state() == skate::http_chunked_decoder::status::error);
+    }
+}
+
+// Answers each request head with the next canned response, so the client sees exact bytes on the wire
+class test_http_canned_server : public skate::tcp_socket {
+    std::string received;
+
+    virtual void ready_read(std::error_code &ec) override {
+        read_all(ec, received);
+
+        for (size_t end = received.find("\r\n\r\n"); end != received.npos && !ec; end = received.find("\r\n\r\n")) {
+            received.erase(0, end + 4);
+
+            // The chunked response is written in two parts, splitting a chunk, to make the client wait in the middle of the body
+            switch (responses++) {
+                case 0:
+                    write(ec, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5;name=value\r\nhel");
+                    write(ec, "lo\r\n7\r\n, world\r\n0\r\nTrailer: x\r\n\r\n");
+                    break;
+                default:
+                    write(ec, "HTTP/1.1 200 OK\r\nContent-Length: 6\r\n\r\nsecond");
+                    break;
+            }
+        }
+    }
+
+    virtual std::unique_ptr<skate::socket> create(skate::system_socket_descriptor desc, skate::socket_state state, bool blocking) override {
+        ++accepted;
+        return std::unique_ptr<skate::socket>{new test_http_canned_server(desc, state, blocking)};
+    }
+
+public:
+    static int accepted;
+    static int responses;
+
+    test_http_canned_server() {}
+    test_http_canned_server(skate::system_socket_descriptor desc, skate::socket_state state, bool blocking) : tcp_socket(desc, state, blocking) {}
+};
+
+int test_http_canned_server::accepted = 0;
+int test_http_canned_server::responses = 0;
+
+void test_http_client_chunked() {
+    std::error_code ec;
+    skate::socket_server<> server;
+    test_http_canned_server listener;
+
+    listener.bind(ec, skate::socket_address("127.0.0.1", 0));
+    const uint16_t port = listener.local_address(ec).port();
+    listener.set_blocking(ec, false); // Accepted sockets inherit this, so read_all() doesn't wait for close
+    listener.listen(ec);
+    CHECK(!ec);
+    server.serve_socket(&listener);
+
+    // One connection without pipelining, so the second request is sent on the same connection after the chunked response
+    skate::http_client_pool<> pool(server, 1, 1);
+    std::vector<std::string> bodies;
+    std::vector<std::string> lengths;
+
+    for (int i = 0; i < 2; ++i) {
+        skate::http_client_request request;
+        request.set_url(skate::url::from_string("http://127.0.0.1:" + std::to_string(port) + "/" + std::to_string(i)));
+
+        pool.request(ec, request, [&](std::error_code e, skate::http_client_request &&, skate::http_server_response &&response) {
+            CHECK(!e);
+            bodies.push_back(response.body());
+            lengths.push_back(response.header("Content-Length"));
+        });
+    }
+    CHECK(!ec);
+
+    for (int i = 0; i < 100 && bodies.size() < 2; ++i)
+        server.poll(skate::socket_timeout(std::chrono::milliseconds(100)), false);
+
+    CHECK(bodies.size() == 2);
+    CHECK(bodies[0] == "hello, world" && lengths[0].empty());
+    CHECK(bodies[1] == "second" && lengths[1] == "6");
+    CHECK(test_http_canned_server::accepted == 1 && pool.connection_count() == 1);
+}
+
+void test_xml_escape() {
+    // Bulk escaping of narrow strings must match escaping one codepoint at a time
+    const std::string inputs[] = {
+        "",
+        "plain text that is long enough to cover a whole vector block or two",
+        "a<b>c&d\"e\\f",
+        "tab\there, newline\n, and \x01 control",
+        "utf-8 \xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 within a long run of otherwise plain characters <>",
+        "]]> in text is escaped",
+    };
+
+    typedef skate::utf_encode_iterator<char, skate::back_inserter<std::string>> utf8_inserter;
+
+    for (const auto &input : inputs) {
+        for (const auto type : { skate::xml_string_type::text, skate::xml_string_type::cdata }) {
+            std::string bulk, expected;
+
+            skate::xml_escape_iterator<utf8_inserter> it(utf8_inserter(skate::make_back_inserter(bulk)), type);
+            it.append(input.data(), input.data() + input.size());
+
+            const auto codepoints = skate::to_utf32<std::vector<std::uint32_t>>(input.begin(), input.end()).value;
+            const auto result = skate::xml_escape(codepoints.begin(), codepoints.end(), utf8_inserter(skate::make_back_inserter(expected)), type);
+
+            CHECK(it.result() == result.result);
+            if (result.result == skate::result_type::success)
+                CHECK(bulk == expected);
+        }
+    }
+
+    {
+        std::string out;
+        skate::xml_escape_iterator<utf8_inserter> it(utf8_inserter(skate::make_back_inserter(out)), skate::xml_string_type::cdata);
+        const std::string cdata = "a]]>b";
+        it.append(cdata.data(), cdata.data() + cdata.size());
+        CHECK(it.failed());
+    }
+
+    // The reader rejects "]]>" in character data, on both the bulk and the generic path
+    const std::string bad = "text ]]> more";
+    skate::xml_node node;
+
+    CHECK(skate::read_xml(bad.data(), bad.data() + bad.size(), skate::xml_read_options(), node).result != skate::result_type::success);
+    CHECK(skate::read_xml(bad.begin(), bad.end(), skate::xml_read_options(), node).result != skate::result_type::success);
+
+    const std::string good = "a]]b]>c]]]x<";
+
+    const auto bulk = skate::read_xml(good.data(), good.data() + good.size(), skate::xml_read_options(), node);
+    CHECK(bulk.result == skate::result_type::success);
+    CHECK(bulk.input == good.data() + good.size() - 1);
+    CHECK(node.is_character_data() && node.tag() == "a]]b]>c]]]x");
+
+    const auto generic = skate::read_xml(good.begin(), good.end(), skate::xml_read_options(), node);
+    CHECK(generic.result == skate::result_type::success);
+    CHECK(node.is_character_data() && node.tag() == "a]]b]>c]]]x");
+}
+
+void test_xml_stream_writer() {
+    // Counts the blocks handed to the stream buffer
+    struct block_counter : public std::stringbuf {
+        size_t blocks = 0;
+
+        std::streamsize xsputn(const char *s, std::streamsize n) override {
+            ++blocks;
+            return std::stringbuf::xsputn(s, n);
+        }
+    };
+
+    const std::string flat =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<root a=\"x&lt;y &amp; &quot;z&quot;\"><child>1 &lt; 2 &amp; &#233;</child><empty k=\"v\"/>"
+        "<![CDATA[<raw>]]</raw>]]><!-- note --></root>";
+    const std::string indented =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<root a=\"x&lt;y &amp; &quot;z&quot;\">\n"
+        "  <child>\n"
+        "    1 &lt; 2 &amp; &#233;\n"
+        "  </child>\n"
+        "  <empty k=\"v\"/>\n"
+        "  <![CDATA[<raw>]]</raw>]]>\n"
+        "  <!-- note -->\n"
+        "</root>";
+
+    // Small block sizes flush mid-token, which must not change the output
+    for (const size_t block_size : { 1, 3, 7, 64 * 1024 }) {
+        for (const unsigned indent : { 0u, 2u }) {
+            block_counter buf;
+
+            {
+                skate::xml_stream_writer writer(&buf, skate::xml_write_options(indent), block_size);
+
+                CHECK(writer.declaration() == skate::result_type::success);
+                CHECK(writer.start_element("root") == skate::result_type::success);
+                CHECK(writer.attribute("a", "x<y & \"z\"") == skate::result_type::success);
+                CHECK(writer.start_element("child") == skate::result_type::success);
+                CHECK(writer.text("1 < 2 & \xc3\xa9") == skate::result_type::success);
+                CHECK(writer.end_element() == skate::result_type::success);
+                CHECK(writer.start_element("empty") == skate::result_type::success);
+                CHECK(writer.attribute("k", "v") == skate::result_type::success);
+                CHECK(writer.end_element() == skate::result_type::success);
+                CHECK(writer.cdata("<raw>]]</raw>") == skate::result_type::success);
+                CHECK(writer.comment("note") == skate::result_type::success);
+                CHECK(writer.depth() == 1);
+                CHECK(writer.end_document() == skate::result_type::success);
+                CHECK(writer.depth() == 0);
+            }
+
+            CHECK(buf.str() == (indent ? indented : flat));
+            CHECK(block_size >= 64 * 1024 ? buf.blocks == 1 : buf.blocks > 1);
+        }
+    }
+
+    // Errors stick, and nothing buffered by the failed operation reaches the stream buffer
+    {
+        std::stringbuf buf;
+        skate::xml_stream_writer writer(&buf, {}, 1);
+
+        CHECK(writer.start_element("root") == skate::result_type::success);
+        CHECK(writer.cdata("a]]>b") != skate::result_type::success);
+        CHECK(writer.text("more") != skate::result_type::success);
+        CHECK(writer.end_document() != skate::result_type::success);
+        CHECK(buf.str() == "<root");
+    }
+
+    {
+        std::stringbuf buf;
+        skate::xml_stream_writer writer(&buf);
+
+        CHECK(writer.start_element("1bad") != skate::result_type::success);
+        CHECK(writer.attribute("a", "b") != skate::result_type::success);
+    }
+
+    {
+        std::stringbuf buf;
+        skate::xml_stream_writer writer(&buf);
+
+        CHECK(writer.attribute("a", "b") != skate::result_type::success);
+    }
+}
+
+void test_shared_file() {
+#if POSIX_OS
+    const int fd = ::open("/dev/null", O_RDONLY);
+    CHECK(fd >= 0);
+
+    // A queued file range keeps the file open after the caller lets go, and closes it once sent or dropped
+    skate::shared_file file = skate::make_shared_file(fd);
+    skate::socket_write_buffer buffer = skate::socket_write_buffer::file_range(file, 0, 10);
+
+    file.reset();
+    CHECK(buffer.is_file() && buffer.file_descriptor() == fd);
+    CHECK(::fcntl(fd, F_GETFD) != -1);
+
+    buffer = skate::socket_write_buffer(std::string("done"));
+    CHECK(::fcntl(fd, F_GETFD) == -1);
+
+    CHECK(skate::make_shared_file(-1) == nullptr);
+#endif
+}
+
+void test_io_uring_watcher() {
+#if SKATE_IO_URING_AVAILABLE
+    skate::io_uring_socket_watcher watcher;
+    if (!watcher.is_valid()) // Not supported by the running kernel
+        return;
+
+    int fds[2];
+    CHECK(::pipe(fds) == 0);
+
+    // The descriptor is closed before the poll request reaches the kernel, so the request fails for good
+    // That must be reported once instead of being rearmed forever while waiting with an infinite timeout
+    std::error_code ec;
+    watcher.watch(ec, fds[0], skate::WatchRead);
+    CHECK(!ec);
+    ::close(fds[0]);
+
+    skate::socket_watch_flags reported = 0;
+    watcher.poll(ec, [&](skate::system_socket_descriptor fd, skate::socket_watch_flags flags) {
+        CHECK(fd == fds[0]);
+        reported |= flags;
+    }, skate::socket_timeout::infinite());
+
+    CHECK(!ec);
+    CHECK(reported & skate::WatchHangup);
+    CHECK(watcher.watching(fds[0]) == 0);
+
+    ::close(fds[1]);
+#endif
+}
+
+void test_io_buffer_pool() {
+    skate::io_buffer_pool<char> pool(100);
+    CHECK(pool.block_size() == 128);
+
+    skate::io_buffer<char> buffer;
+    buffer.set_pool(&pool);
+    CHECK(buffer.capacity() == 0);
+
+    // A read that gets nothing borrows a block and hands it straight back, without the block being reallocated
+    auto spans = buffer.reserve_write(64);
+    CHECK(spans[0].size() == 64 && buffer.capacity() == 128);
+    const char *block = spans[0].data;
+    buffer.commit_write(0);
+    CHECK(buffer.capacity() == 0 && pool.free_blocks() == 1);
+
+    spans = buffer.reserve_write(64);
+    CHECK(spans[0].data == block && pool.free_blocks() == 0);
+    std::fill_n(spans[0].data, 10, 'x');
+    buffer.commit_write(10);
+    CHECK(buffer.size() == 10);
+
+    CHECK(buffer.read_all<std::string>() == std::string(10, 'x'));
+    CHECK(buffer.capacity() == 0 && pool.free_blocks() == 1);
+
+    // Storage that outgrew the block is freed instead of pooled, and the contents survive the growth
+    const std::string big(300, 'y');
+    CHECK(buffer.write(big.begin(), big.begin() + 100));
+    CHECK(buffer.capacity() == 128 && pool.free_blocks() == 0);
+    CHECK(buffer.write(big.begin() + 100, big.end()));
+    CHECK(buffer.capacity() >= 300);
+    CHECK(buffer.read_all<std::string>() == big);
+    CHECK(pool.free_blocks() == 0);
+}
+
+void test_udp_datagrams() {
+    std::error_code ec;
+    skate::udp_socket sender, receiver;
+
+    receiver.bind(ec, skate::socket_address("127.0.0.1", 0));
+    const skate::socket_address destination = receiver.local_address(ec);
+    CHECK(!ec);
+
+    // Not bound yet, so this one is buffered, and must be sent before anything passed to write_datagrams()
+    sender.write_datagram(ec, destination, "first");
+    CHECK(ec);
+    ec.clear();
+
+    sender.bind(ec, skate::socket_address("127.0.0.1", 0));
+    const skate::socket_address source = sender.local_address(ec);
+    CHECK(!ec);
+
+    const std::string payloads[] = { "second", "third", std::string(1000, 'x') };
+    skate::udp_send_datagram datagrams[3];
+    for (size_t i = 0; i < 3; ++i)
+        datagrams[i] = skate::udp_send_datagram(payloads[i].data(), payloads[i].size(), destination);
+
+    CHECK(sender.write_datagrams(ec, datagrams, 3) == 3);
+    CHECK(!ec);
+
+    std::vector<std::string> storage = { std::string(64, '\0'), std::string(64, '\0'), std::string(64, '\0'), std::string(2000, '\0'), std::string(64, '\0') };
+    skate::udp_receive_slot slots[5];
+    for (size_t i = 0; i < 5; ++i)
+        slots[i] = skate::udp_receive_slot(&storage[i][0], storage[i].size());
+
+    size_t received = 0;
+    while (received < 4 && !ec)
+        received += receiver.read_datagrams(ec, slots + received, 5 - received);
+
+    CHECK(!ec && received == 4);
+    CHECK(std::string(slots[0].data, slots[0].size) == "first" && !slots[0].truncated);
+    CHECK(std::string(slots[1].data, slots[1].size) == "second" && !slots[1].truncated);
+    CHECK(std::string(slots[2].data, slots[2].size) == "third" && !slots[2].truncated);
+    CHECK(std::string(slots[3].data, slots[3].size) == payloads[2] && !slots[3].truncated);
+
+    for (size_t i = 0; i < 4; ++i)
+        CHECK(slots[i].remote.port() == source.port() && slots[i].segment_size == 0);
+}
+
+// Collects what an async_logger writes, both as entries and as default-formatted text without timestamps
+class test_async_logger : public skate::async_logger {
+    std::mutex mtx;
+    std::vector<skate::logger_entry> written;
+    std::string text;
+    skate::impl::log_batch_streambuf text_buf;
+
+    void write_entry(skate::logger_entry &&entry) {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        written.push_back(entry);
+        do_default_log(&text_buf, std::move(entry), skate::default_logger_options(skate::time_point_string_options()));
+    }
+
+public:
+    test_async_logger()
+        : async_logger([this](skate::logger_entry &&entry) { write_entry(std::move(entry)); })
+        , text_buf(text)
+    {}
+    virtual ~test_async_logger() { close(); }
+
+    std::vector<skate::logger_entry> entries() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return written;
+    }
+
+    std::string output() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return text;
+    }
+};
+
+void test_async_logger_batches() {
+    // Entries from several threads are merged in timestamp order
+    {
+        test_async_logger logger;
+        logger.set_flush_policy(SIZE_MAX, std::chrono::seconds(60)); // Everything is written in one batch when closed
+        logger.set_buffer_limit(1000);
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; ++t) {
+            threads.emplace_back([&logger, t]() {
+                for (size_t i = 0; i < 200; ++i)
+                    logger.info(std::to_string(t) + " " + std::to_string(i));
+            });
+        }
+
+        for (auto &thread: threads)
+            thread.join();
+
+        logger.close();
+
+        const auto entries = logger.entries();
+        CHECK(entries.size() == 800);
+
+        size_t next[4] = {};
+        for (size_t i = 0; i < entries.size(); ++i) {
+            CHECK(i == 0 || entries[i - 1].when <= entries[i].when);
+
+            const size_t t = size_t(entries[i].data[0] - '0');
+            CHECK(t < 4 && entries[i].data == std::to_string(t) + " " + std::to_string(next[t]++));
+        }
+    }
+
+    // Errors are written right away instead of waiting for the flush interval, along with what was staged before them
+    {
+        test_async_logger logger;
+        logger.set_flush_policy(SIZE_MAX, std::chrono::seconds(60));
+
+        logger.info("staged");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        CHECK(logger.entries().empty());
+
+        logger.error("failed");
+        for (size_t i = 0; i < 5000 && logger.entries().size() < 2; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        CHECK(logger.output() == "INFO: staged\nERROR: failed\n");
+    }
+
+    // A thread that fills its ring waits for the writer instead of deadlocking
+    {
+        test_async_logger logger;
+        logger.set_flush_policy(SIZE_MAX, std::chrono::seconds(60));
+        logger.set_buffer_limit(4);
+
+        static const skate::deferred_log_format format(skate::log_type::info, "deferred {}");
+
+        for (size_t i = 0; i < 1000; ++i) {
+            logger.info(std::to_string(i));
+            logger.log_deferred(format, i);
+        }
+
+        logger.close();
+        CHECK(logger.entries().size() == 2000);
+    }
+
+    // close() writes everything staged before it, and later entries are dropped
+    {
+        test_async_logger logger;
+        logger.set_flush_policy(SIZE_MAX, std::chrono::seconds(60));
+
+        for (size_t i = 0; i < 10; ++i)
+            logger.warn(std::to_string(i));
+
+        logger.close();
+        logger.warn("after close");
+
+        CHECK(logger.output() == "WARNING: 0\nWARNING: 1\nWARNING: 2\nWARNING: 3\nWARNING: 4\nWARNING: 5\nWARNING: 6\nWARNING: 7\nWARNING: 8\nWARNING: 9\n");
+    }
+}
+
+void test_async_logger_deferred() {
+    enum class test_level { low = 3, high = 7 };
+
+    static const skate::deferred_log_format values(skate::log_type::info, "int={} name={} level={} ok={}");
+    static const skate::deferred_log_format extra(skate::log_type::warn, "count {};");
+    static const skate::deferred_log_format missing(skate::log_type::debug, "a={} b={}");
+    static const skate::deferred_log_format plain(skate::log_type::error, "no arguments {}");
+
+    test_async_logger logger;
+    logger.set_flush_policy(SIZE_MAX, std::chrono::seconds(60)); // Deferred and plain entries are merged in one batch when closed
+
+    const auto before = std::chrono::system_clock::now();
+
+    // Sleeps keep the timestamps distinct, since deferred ones are converted from steady_clock
+    logger.info("first");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    logger.log_deferred(values, -42, "abc", test_level::high, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    logger.info("middle");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    logger.log_deferred(extra, 7u, 'c', 2.5, false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    logger.log_deferred(missing, int64_t(1) << 40);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    logger.log_deferred(plain);
+
+    const auto after = std::chrono::system_clock::now();
+    logger.close();
+
+    CHECK(logger.output() ==
+          "INFO: first\n"
+          "INFO: int=-42 name=abc level=7 ok=true\n"
+          "INFO: middle\n"
+          "WARNING: count 7;c2.5false\n"
+          "DEBUG: a=1099511627776 b={}\n"
+          "ERROR: no arguments {}\n");
+
+    const auto entries = logger.entries();
+    CHECK(entries.size() == 6);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        CHECK(i == 0 || entries[i - 1].when < entries[i].when);
+        CHECK(entries[i].when >= before - std::chrono::milliseconds(50) && entries[i].when <= after + std::chrono::milliseconds(50));
+    }
+}
+
 int main()
 {
+    test_async_logger_deferred();
+    test_async_logger_batches();
+    test_udp_datagrams();
+    test_io_buffer_pool();
+    test_io_uring_watcher();
+    test_shared_file();
+    test_xml_stream_writer();
+    test_xml_escape();
+    test_http_parser();
+    test_http_chunked_decoder();
+    test_http_client_chunked();
+    test_timer_wheel();
+    test_mpmc_buffer();
+    test_spsc_buffer();
+    test_thread_pool();
+    test_message_queue();
+
     test_json();
 
     test_xml();
@@ -28,6 +28,7 @@ HEADERS += \
     socket/wsaasyncselect.h \
     system/benchmark.h \
     system/time.h \
+    system/thread_pool.h \
     threadbuffer.h \
     system/includes.h \
     system/environment.h \
@@ -39,6 +40,8 @@ HEADERS += \
     socket/server.h \
     socket/kqueue.h \
     socket/epoll.h \
+    socket/io_uring.h \
+    socket/timer.h \
     io/adapters/json.h \
     io/adapters/core.h \
     io/adapters/xml.h
@@ -54,6 +54,10 @@ namespace skate {
 
         typedef std::function<void (system_socket_descriptor, socket_watch_flags)> native_watch_function;
 
+        // Returns true if the watcher only reports changes in readiness (edge-triggered) instead of reporting readiness until it is consumed
+        // socket_server drains edge-triggered descriptors until they would block and leaves write interest registered permanently
+        virtual bool edge_triggered() const noexcept { return false; }
+
         // Returns which events are currently being watched on the socket
         // Some watcher types (e.g. epoll(), kqueue()) may not have this information and will always return 0 (not watching)
         virtual socket_watch_flags watching(system_socket_descriptor socket) const = 0;
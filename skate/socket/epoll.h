@@ -16,6 +16,7 @@
 namespace skate {
     class epoll_socket_watcher : public socket_watcher {
         int queue;
+        bool edge;
 
     public:
         static socket_watch_flags watch_flags_from_kernel_flags(uint32_t kernel_flags) noexcept {
@@ -42,12 +43,15 @@ namespace skate {
             return kernel_flags;
         }
 
-        epoll_socket_watcher() : queue(::epoll_create1(0)) {}
+        // If edge_triggered is true, descriptors are registered with EPOLLET and made nonblocking when watched
+        epoll_socket_watcher(bool edge_triggered = false) : queue(::epoll_create1(0)), edge(edge_triggered) {}
         virtual ~epoll_socket_watcher() {
             if (queue >= 0)
                 ::close(queue);
         }
 
+        virtual bool edge_triggered() const noexcept override { return edge; }
+
         virtual socket_watch_flags watching(system_socket_descriptor) const override {
             // TODO: no way to determine if kernel has socket in set already
             return 0;
@@ -57,21 +61,29 @@ namespace skate {
             struct epoll_event ev;
 
             ev.data.fd = socket;
-            ev.events = kernel_flags_from_watch_flags(watch_type);
+            ev.events = kernel_flags_from_watch_flags(watch_type) | (edge? static_cast<uint32_t>(EPOLLET): 0);
+
+            // Edge-triggered descriptors must be drained until they would block, so they can't be left blocking
+            if (edge) {
+                ec.clear();
+                impl::socket_set_blocking(ec, socket, false);
+                if (ec)
+                    return socket_blocking_adjustment::unchanged;
+            }
 
             if (::epoll_ctl(queue, EPOLL_CTL_ADD, socket, &ev) != 0)
                 ec = impl::socket_error();
             else
                 ec.clear();
 
-            return socket_blocking_adjustment::unchanged;
+            return edge? socket_blocking_adjustment::nonblocking: socket_blocking_adjustment::unchanged;
         }
 
         virtual socket_blocking_adjustment modify(std::error_code &ec, system_socket_descriptor socket, socket_watch_flags new_watch_type) override {
             struct epoll_event ev;
 
             ev.data.fd = socket;
-            ev.events = kernel_flags_from_watch_flags(new_watch_type);
+            ev.events = kernel_flags_from_watch_flags(new_watch_type) | (edge? static_cast<uint32_t>(EPOLLET): 0);
 
             if (::epoll_ctl(queue, EPOLL_CTL_MOD, socket, &ev) != 0)
                 ec = impl::socket_error();
@@ -123,12 +135,18 @@ namespace skate {
             } else {
                 ec.clear();
 
-                for (const auto &ev: events) {
-                    fn(ev.data.fd, watch_flags_from_kernel_flags(ev.events));
+                for (int i = 0; i < ready; ++i) {
+                    fn(events[i].data.fd, watch_flags_from_kernel_flags(events[i].events));
                 }
             }
         }
     };
+
+    // epoll() watcher in edge-triggered mode, for use as a socket_server template argument
+    class epoll_edge_socket_watcher : public epoll_socket_watcher {
+    public:
+        epoll_edge_socket_watcher() : epoll_socket_watcher(true) {}
+    };
 }
 #endif
 
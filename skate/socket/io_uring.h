@@ -0,0 +1,442 @@
+/** @file
+ *
+ *  @author Oliver Adams
+ *  @copyright Copyright (C) 2021, Licensed under Apache 2.0
+ */
+
+#ifndef SKATE_IO_URING_H
+#define SKATE_IO_URING_H
+
+#include "../system/includes.h"
+#include "common.h"
+
+#if LINUX_OS
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/poll.h>
+# include <cstring>
+
+# if defined(__NR_io_uring_setup) && defined(IORING_POLL_ADD_MULTI) && defined(IORING_FEAT_EXT_ARG)
+#  define SKATE_IO_URING_AVAILABLE 1
+
+namespace skate {
+    namespace impl {
+        inline int io_uring_setup(unsigned entries, struct io_uring_params *params) noexcept {
+            return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+        }
+
+        inline int io_uring_enter(int ring, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t arg_size) noexcept {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, arg, arg_size));
+        }
+    }
+
+    // Watcher backed by an io_uring instance (Linux 5.13+)
+    //
+    // Each watched descriptor gets one multishot poll request, so readiness is reported edge-triggered and descriptors are made nonblocking.
+    // Watch, modify, and unwatch requests are queued in the submission ring and handed to the kernel in the same io_uring_enter() call
+    // that waits for completions, so one system call services any number of descriptor changes and ready sockets.
+    // Only readiness goes through the ring; accepting, reading, and writing are still done by the sockets with ordinary system calls.
+    class io_uring_socket_watcher : public socket_watcher {
+        static constexpr uint64_t internal_user_data = UINT64_MAX; // Tags completions of poll removal requests, which are ignored
+
+        struct watched_descriptor {
+            uint32_t generation;
+            uint32_t kernel_flags;
+        };
+
+        int ring;
+        unsigned features;
+        uint32_t next_generation;
+        unsigned pending_submissions;
+        unsigned sq_local_tail; // Submission tail not yet published to the kernel
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        std::unordered_map<system_socket_descriptor, watched_descriptor> watched; // Current poll request per descriptor
+
+        static uint64_t make_user_data(system_socket_descriptor fd, uint32_t generation) noexcept {
+            return (uint64_t(generation) << 32) | uint32_t(fd);
+        }
+
+        void destroy() noexcept {
+            if (sqes)
+                ::munmap(sqes, sqes_size);
+            if (cq_ring && cq_ring != sq_ring)
+                ::munmap(cq_ring, cq_ring_size);
+            if (sq_ring)
+                ::munmap(sq_ring, sq_ring_size);
+            if (ring >= 0)
+                ::close(ring);
+
+            ring = -1;
+            sq_ring = cq_ring = nullptr;
+            sqes = nullptr;
+        }
+
+        void create(unsigned entries) noexcept {
+            struct io_uring_params params;
+            memset(&params, 0, sizeof(params));
+
+            ring = impl::io_uring_setup(entries, &params);
+            if (ring < 0)
+                return;
+
+            features = params.features;
+            if (!(features & IORING_FEAT_EXT_ARG)) { // Needed for waiting with a timeout
+                destroy();
+                return;
+            }
+
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+            if (features & IORING_FEAT_SINGLE_MMAP)
+                sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+            sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+            if (sq_ring == MAP_FAILED) {
+                sq_ring = nullptr;
+                destroy();
+                return;
+            }
+
+            if (features & IORING_FEAT_SINGLE_MMAP) {
+                cq_ring = sq_ring;
+            } else {
+                cq_ring = ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+                if (cq_ring == MAP_FAILED) {
+                    cq_ring = nullptr;
+                    destroy();
+                    return;
+                }
+            }
+
+            sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+            sqes = static_cast<struct io_uring_sqe *>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED) {
+                sqes = nullptr;
+                destroy();
+                return;
+            }
+
+            char *sq = static_cast<char *>(sq_ring);
+            char *cq = static_cast<char *>(cq_ring);
+
+            sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_entries = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+            sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+            cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            sq_local_tail = *sq_tail;
+        }
+
+        // Makes filled submission entries visible to the kernel, must be called before every io_uring_enter()
+        void publish_submissions() noexcept {
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        }
+
+        // Submits everything queued without waiting for completions
+        void submit(std::error_code &ec) noexcept {
+            publish_submissions();
+
+            while (pending_submissions && !ec) {
+                const int submitted = impl::io_uring_enter(ring, pending_submissions, 0, 0, nullptr, 0);
+                if (submitted < 0) {
+                    if (errno != EINTR)
+                        ec = impl::socket_error();
+                } else {
+                    pending_submissions -= std::min(pending_submissions, unsigned(submitted));
+                }
+            }
+        }
+
+        // Returns a zeroed submission entry, submitting queued entries first if the ring is full
+        struct io_uring_sqe *next_sqe(std::error_code &ec) noexcept {
+            if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == *sq_entries) {
+                submit(ec);
+                if (ec)
+                    return nullptr;
+            }
+
+            const unsigned index = sq_local_tail++ & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[index];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sq_array[index] = index;
+
+            ++pending_submissions;
+
+            return sqe;
+        }
+
+        void queue_poll_add(std::error_code &ec, system_socket_descriptor fd, const watched_descriptor &desc) {
+            struct io_uring_sqe *sqe = next_sqe(ec);
+            if (!sqe)
+                return;
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = desc.kernel_flags;
+            sqe->user_data = make_user_data(fd, desc.generation);
+        }
+
+        void queue_poll_remove(std::error_code &ec, system_socket_descriptor fd, const watched_descriptor &desc) {
+            struct io_uring_sqe *sqe = next_sqe(ec);
+            if (!sqe)
+                return;
+
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = make_user_data(fd, desc.generation);
+            sqe->user_data = internal_user_data;
+        }
+
+    public:
+        static socket_watch_flags watch_flags_from_kernel_flags(uint32_t kernel_flags) noexcept {
+            socket_watch_flags watch_flags = 0;
+
+            watch_flags |= kernel_flags & POLLIN? WatchRead: 0;
+            watch_flags |= kernel_flags & POLLOUT? WatchWrite: 0;
+            watch_flags |= kernel_flags & POLLPRI? WatchExcept: 0;
+            watch_flags |= kernel_flags & POLLERR? WatchError: 0;
+            watch_flags |= kernel_flags & POLLHUP? WatchHangup: 0;
+            watch_flags |= kernel_flags & POLLNVAL? WatchInvalid: 0;
+
+            return watch_flags;
+        }
+
+        static uint32_t kernel_flags_from_watch_flags(socket_watch_flags watch_flags) noexcept {
+            uint32_t kernel_flags = 0;
+
+            kernel_flags |= watch_flags & WatchRead? static_cast<uint32_t>(POLLIN): 0;
+            kernel_flags |= watch_flags & WatchWrite? static_cast<uint32_t>(POLLOUT): 0;
+            kernel_flags |= watch_flags & WatchExcept? static_cast<uint32_t>(POLLPRI): 0;
+
+            return kernel_flags;
+        }
+
+        // Creates a ring with room for `entries` queued submissions. Completion ring size is chosen by the kernel
+        // If io_uring is not available on the running kernel, is_valid() returns false and every operation fails
+        io_uring_socket_watcher(unsigned entries = 4096)
+            : ring(-1)
+            , features(0)
+            , next_generation(0)
+            , pending_submissions(0)
+            , sq_local_tail(0)
+            , sq_ring(nullptr)
+            , sq_ring_size(0)
+            , cq_ring(nullptr)
+            , cq_ring_size(0)
+            , sqes(nullptr)
+            , sqes_size(0)
+        {
+            create(entries);
+        }
+        virtual ~io_uring_socket_watcher() { destroy(); }
+
+        bool is_valid() const noexcept { return ring >= 0; }
+
+        virtual bool edge_triggered() const noexcept override { return true; }
+
+        virtual socket_watch_flags watching(system_socket_descriptor fd) const override {
+            const auto it = watched.find(fd);
+            if (it == watched.end())
+                return 0;
+
+            return watch_flags_from_kernel_flags(it->second.kernel_flags);
+        }
+
+        virtual socket_blocking_adjustment watch(std::error_code &ec, system_socket_descriptor fd, socket_watch_flags watch_type) override {
+            ec.clear();
+
+            if (!is_valid()) {
+                ec = std::make_error_code(std::errc::function_not_supported);
+                return socket_blocking_adjustment::unchanged;
+            } else if (watched.find(fd) != watched.end()) {
+                ec = std::make_error_code(std::errc::file_exists);
+                return socket_blocking_adjustment::unchanged;
+            }
+
+            // Multishot polls are edge-triggered, so descriptors must be drained until they would block
+            impl::socket_set_blocking(ec, fd, false);
+            if (ec)
+                return socket_blocking_adjustment::unchanged;
+
+            const watched_descriptor desc{next_generation++, kernel_flags_from_watch_flags(watch_type)};
+
+            queue_poll_add(ec, fd, desc);
+            if (!ec)
+                watched[fd] = desc;
+
+            return socket_blocking_adjustment::nonblocking;
+        }
+
+        virtual socket_blocking_adjustment modify(std::error_code &ec, system_socket_descriptor fd, socket_watch_flags new_watch_type) override {
+            ec.clear();
+
+            const auto it = watched.find(fd);
+            if (it == watched.end())
+                return socket_blocking_adjustment::unchanged;
+
+            const uint32_t kernel_flags = kernel_flags_from_watch_flags(new_watch_type);
+            if (kernel_flags == it->second.kernel_flags)
+                return socket_blocking_adjustment::unchanged;
+
+            // Replace the poll request with a new generation so late completions of the old one are ignored
+            queue_poll_remove(ec, fd, it->second);
+            it->second = watched_descriptor{next_generation++, kernel_flags};
+            queue_poll_add(ec, fd, it->second);
+
+            return socket_blocking_adjustment::unchanged;
+        }
+
+        virtual socket_blocking_adjustment unwatch(std::error_code &ec, system_socket_descriptor fd) override {
+            ec.clear();
+
+            const auto it = watched.find(fd);
+            if (it == watched.end())
+                return socket_blocking_adjustment::unchanged;
+
+            queue_poll_remove(ec, fd, it->second);
+            watched.erase(it);
+
+            return socket_blocking_adjustment::unchanged;
+        }
+
+        // The ring holds its own reference to each polled file, so closed descriptors still need their poll request removed
+        virtual void unwatch_dead_descriptor(std::error_code &ec, system_socket_descriptor fd) override {
+            unwatch(ec, fd);
+        }
+
+        virtual void clear(std::error_code &ec) override {
+            ec.clear();
+
+            for (const auto &desc: watched)
+                queue_poll_remove(ec, desc.first, desc.second);
+
+            watched.clear();
+            submit(ec);
+        }
+
+        virtual void poll(std::error_code &ec, native_watch_function fn, socket_timeout timeout) override {
+            if (!is_valid()) {
+                ec = std::make_error_code(std::errc::function_not_supported);
+                return;
+            }
+
+            struct __kernel_timespec ts;
+            struct io_uring_getevents_arg arg;
+
+            memset(&arg, 0, sizeof(arg));
+            if (!timeout.is_infinite()) {
+                ts.tv_sec = timeout.timeout().count() / 1000000;
+                ts.tv_nsec = (timeout.timeout().count() % 1000000) * 1000;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+            }
+
+            // Collect completions first, since callbacks are allowed to change the watched set
+            // Multiple completions for the same descriptor are merged into one event
+            std::vector<std::pair<system_socket_descriptor, socket_watch_flags>> events;
+            std::unordered_map<system_socket_descriptor, size_t> event_index;
+
+            do {
+                // Submit all queued changes and wait for at least one completion in the same call
+                publish_submissions();
+
+                const int submitted = impl::io_uring_enter(ring, pending_submissions, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+                if (submitted >= 0) {
+                    pending_submissions -= std::min(pending_submissions, unsigned(submitted));
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (errno != ETIME) {
+                    ec = impl::socket_error();
+                    return;
+                }
+
+                unsigned head = *cq_head;
+                const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; ++head) {
+                    const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+
+                    if (cqe.user_data == internal_user_data)
+                        continue;
+
+                    const system_socket_descriptor fd = static_cast<system_socket_descriptor>(uint32_t(cqe.user_data));
+                    const uint32_t generation = uint32_t(cqe.user_data >> 32);
+
+                    const auto it = watched.find(fd);
+                    if (it == watched.end() || it->second.generation != generation)
+                        continue; // Completion from a poll request that was already replaced or removed
+
+                    socket_watch_flags flags = 0;
+
+                    if (cqe.flags & IORING_CQE_F_MORE) {
+                        if (cqe.res < 0)
+                            continue;
+
+                        flags = watch_flags_from_kernel_flags(uint32_t(cqe.res));
+                    } else if (cqe.res < 0) {
+                        // The poll request failed and is gone. Rearming would just fail again, and with an infinite timeout
+                        // this loop would never return, so stop watching and report a hangup, which makes the server drop the socket
+                        flags = WatchError | WatchHangup | (cqe.res == -EBADF? WatchInvalid: 0);
+                        watched.erase(it);
+                    } else {
+                        // The kernel ended the multishot request (e.g. completion ring overflow), so it must be rearmed
+                        it->second.generation = next_generation++;
+                        queue_poll_add(ec, fd, it->second);
+                        if (ec)
+                            break;
+
+                        flags = watch_flags_from_kernel_flags(uint32_t(cqe.res));
+                    }
+
+                    const auto existing = event_index.find(fd);
+                    if (existing != event_index.end()) {
+                        events[existing->second].second |= flags;
+                    } else {
+                        event_index[fd] = events.size();
+                        events.push_back({fd, flags});
+                    }
+                }
+
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+                if (ec)
+                    return;
+            } while (events.empty() && timeout.is_infinite()); // Only internal completions arrived, keep waiting
+
+            if (events.empty()) {
+                ec = std::make_error_code(std::errc::timed_out);
+                return;
+            }
+
+            ec.clear();
+
+            for (const auto &event: events) {
+                fn(event.first, event.second);
+            }
+        }
+    };
+}
+# endif
+#endif
+
+#endif // SKATE_IO_URING_H
@@ -20,19 +20,496 @@ namespace skate {
                 return lhs.size() < rhs.size();
             }
         };
+
+        // Returns a pointer to the first '\n' in [first, last), or last if none is found
+        inline const char *http_find_line_feed(const char *first, const char *last) noexcept {
+#if defined(__AVX2__)
+            const __m256i lf = _mm256_set1_epi8('\n');
+
+            for (; last - first >= 32; first += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+                const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)));
+
+                if (mask)
+                    return first + detail::ctz32(mask);
+            }
+#elif defined(__SSE2__)
+            const __m128i lf = _mm_set1_epi8('\n');
+
+            for (; last - first >= 16; first += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+                const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)));
+
+                if (mask)
+                    return first + detail::ctz32(mask);
+            }
+#endif
+
+            for (; first != last; ++first)
+                if (*first == '\n')
+                    break;
+
+            return first;
+        }
+
+        // Returns whether a comma-separated header value, such as Connection or Transfer-Encoding, contains the given token
+        inline bool http_has_token(const std::string &value, const char *token) {
+            const size_t token_length = strlen(token);
+
+            for (size_t start = 0; start < value.size(); ) {
+                size_t end = value.find(',', start);
+                if (end == value.npos)
+                    end = value.size();
+
+                size_t first = start, last = end;
+                while (first < last && isspace_or_tab(value[first]))
+                    ++first;
+                while (last > first && isspace_or_tab(value[last - 1]))
+                    --last;
+
+                if (last - first == token_length) {
+                    size_t i = 0;
+                    for (; i < token_length && skate::tolower(value[first + i]) == skate::tolower(token[i]); ++i);
+
+                    if (i == token_length)
+                        return true;
+                }
+
+                start = end + 1;
+            }
+
+            return false;
+        }
+
+        // Location of a token within a message head, as an offset from the start of the head
+        struct http_span {
+            http_span() : offset(0), length(0) {}
+            http_span(size_t offset, size_t length) : offset(offset), length(length) {}
+
+            std::string to_string(const char *base) const { return std::string(base + offset, length); }
+
+            bool equals_case_insensitive(const char *base, const std::string &s) const {
+                if (s.size() != length)
+                    return false;
+
+                for (size_t i = 0; i < length; ++i)
+                    if (skate::tolower(base[offset + i]) != skate::tolower(s[i]))
+                        return false;
+
+                return true;
+            }
+
+            size_t offset;
+            size_t length;
+        };
+
+        struct http_header_span {
+            http_header_span() : folded(false) {}
+
+            // Returns the value, with any obsolete line folding replaced by a single space
+            std::string value_string(const char *base) const {
+                if (!folded)
+                    return value.to_string(base);
+
+                std::string result;
+                result.reserve(value.length);
+
+                const char *p = base + value.offset;
+                const char *end = p + value.length;
+                while (p != end) {
+                    if (*p == '\r' || *p == '\n') {
+                        while (p != end && (*p == '\r' || *p == '\n' || isspace_or_tab(*p)))
+                            ++p;
+
+                        result.push_back(' ');
+                    } else {
+                        result.push_back(*p++);
+                    }
+                }
+
+                return result;
+            }
+
+            http_span name;
+            http_span value;
+            bool folded;    // Whether the value spans more than one line
+        };
     }
 
+    // Resumable parser for an HTTP/1.x request head (the request line and headers, up to the blank line)
+    // Lines are found with a bulk scan and headers are recorded as spans into the caller's data instead of being copied,
+    // so parsing allocates nothing once the header list has reached its working size
+    // The caller owns the data, and must pass the same bytes (possibly with more appended) on each call until the head is complete
+    class http_request_parser {
+    public:
+        enum class status {
+            incomplete,
+            complete,
+            error
+        };
+
+    private:
+        status m_status;
+        size_t m_line_start;                            // Offset of the line currently being parsed
+        size_t m_scan;                                  // Offset where the search for the next line feed resumes
+        size_t m_max_head_size;
+        bool m_have_request_line;
+
+        impl::http_span m_method;
+        impl::http_span m_target;
+        unsigned int m_major, m_minor;
+        std::vector<impl::http_header_span> m_headers;
+
+        static bool parse_version_number(const char *&p, const char *end, unsigned int &result) {
+            if (p == end || !isdigit(*p & 0xff))
+                return false;
+
+            result = 0;
+            for (; p != end && isdigit(*p & 0xff); ++p)
+                result = std::min(result * 10 + (*p - '0'), 255u);
+
+            return true;
+        }
+
+        bool parse_request_line(const char *data, size_t start, size_t length) {
+            const char *line = data + start;
+            const char *end = line + length;
+
+            // Get method
+            const char *p = line;
+            while (p != end && *p != ' ')
+                ++p;
+
+            if (p == line || p == end)
+                return false;
+
+            m_method = impl::http_span(start, p - line);
+            while (p != end && *p == ' ')
+                ++p;
+
+            // Get request target
+            const char *target = p;
+            while (p != end && *p != ' ')
+                ++p;
+
+            if (p == target || p == end)
+                return false;
+
+            m_target = impl::http_span(start + (target - line), p - target);
+            while (p != end && *p == ' ')
+                ++p;
+
+            // Get HTTP version
+            if (end - p < 5 || memcmp(p, "HTTP/", 5) != 0)
+                return false;
+            p += 5;
+
+            if (!parse_version_number(p, end, m_major) || p == end || *p++ != '.' || !parse_version_number(p, end, m_minor))
+                return false;
+
+            return p == end;
+        }
+
+        bool parse_header_line(const char *data, size_t start, size_t length) {
+            const char *line = data + start;
+            const char *colon = static_cast<const char *>(memchr(line, ':', length));
+
+            if (!colon || colon == line)
+                return false;
+
+            // No whitespace allowed between the header name and colon
+            if (isspace_or_tab(colon[-1]))
+                return false;
+
+            // Skip leading and trailing whitespace around value
+            const char *value = colon + 1;
+            const char *end = line + length;
+
+            while (value != end && isspace_or_tab(*value))
+                ++value;
+            while (end != value && isspace_or_tab(end[-1]))
+                --end;
+
+            impl::http_header_span header;
+            header.name = impl::http_span(start, colon - line);
+            header.value = impl::http_span(start + (value - line), end - value);
+            m_headers.push_back(header);
+
+            return true;
+        }
+
+        // Continues the value of the previous header with an obsolete folded line
+        bool parse_folded_line(const char *data, size_t start, size_t length) {
+            if (m_headers.empty())
+                return false;
+
+            const char *line = data + start;
+            const char *value = line;
+            const char *end = line + length;
+
+            while (value != end && isspace_or_tab(*value))
+                ++value;
+            while (end != value && isspace_or_tab(end[-1]))
+                --end;
+
+            if (value == end)
+                return true;
+
+            impl::http_header_span &header = m_headers.back();
+            if (header.value.length == 0) {
+                header.value = impl::http_span(start + (value - line), end - value);
+            } else {
+                header.value.length = (start + (end - line)) - header.value.offset;
+                header.folded = true;
+            }
+
+            return true;
+        }
+
+    public:
+        http_request_parser(size_t max_head_size = 1024 * 1024)
+            : m_max_head_size(max_head_size)
+        {
+            reset();
+        }
+
+        // Prepares to parse a new head. The header list keeps its capacity
+        void reset() {
+            m_status = status::incomplete;
+            m_line_start = 0;
+            m_scan = 0;
+            m_have_request_line = false;
+            m_method = m_target = {};
+            m_major = m_minor = 0;
+            m_headers.clear();
+        }
+
+        // Parses as much of the head in [data, data + size) as possible, resuming where the last call left off
+        status parse(const char *data, size_t size) {
+            if (m_status != status::incomplete)
+                return m_status;
+
+            while (true) {
+                const char *lf = impl::http_find_line_feed(data + m_scan, data + size);
+                if (lf == data + size) {
+                    m_scan = size;
+
+                    if (size > m_max_head_size)
+                        m_status = status::error;
+
+                    return m_status;
+                }
+
+                // Lines end with "\r\n", but a bare "\n" is accepted too
+                const size_t line_end = lf - data;
+                size_t length = line_end - m_line_start;
+                if (length && data[line_end - 1] == '\r')
+                    --length;
+
+                if (!m_have_request_line) {
+                    if (length) { // Ignore empty lines preceding request line
+                        if (!parse_request_line(data, m_line_start, length))
+                            return m_status = status::error;
+
+                        m_have_request_line = true;
+                    }
+                } else if (length == 0) { // Done reading headers if blank line
+                    m_line_start = m_scan = line_end + 1;
+                    return m_status = status::complete;
+                } else if (isspace_or_tab(data[m_line_start])) {
+                    if (!parse_folded_line(data, m_line_start, length))
+                        return m_status = status::error;
+                } else if (!parse_header_line(data, m_line_start, length)) {
+                    return m_status = status::error;
+                }
+
+                m_line_start = m_scan = line_end + 1;
+                if (m_line_start > m_max_head_size)
+                    return m_status = status::error;
+            }
+        }
+
+        status state() const noexcept { return m_status; }
+
+        // Number of bytes in the head, including the terminating blank line. Only valid once parsing is complete
+        size_t head_size() const noexcept { return m_line_start; }
+
+        // Spans are relative to the start of the data passed to parse()
+        impl::http_span method() const noexcept { return m_method; }
+        impl::http_span target() const noexcept { return m_target; }
+        unsigned int major() const noexcept { return m_major; }
+        unsigned int minor() const noexcept { return m_minor; }
+        const std::vector<impl::http_header_span> &headers() const noexcept { return m_headers; }
+    };
+
+    // Resumable decoder for a body sent with chunked transfer coding
+    // Chunk extensions and trailer fields are accepted but discarded
+    class http_chunked_decoder {
+    public:
+        enum class status {
+            incomplete,
+            complete,
+            error
+        };
+
+    private:
+        enum class stage {
+            chunk_size,
+            chunk_data,
+            chunk_data_end,
+            trailers
+        };
+
+        stage m_stage;
+        status m_status;
+        uint64_t m_remaining;                           // Bytes left in the current chunk
+        size_t m_max_line_size;
+
+        // Returns the length of the line ending at lf, not counting the line ending
+        static size_t line_length(const char *line, const char *lf) noexcept {
+            return lf - line - (lf != line && lf[-1] == '\r');
+        }
+
+        bool parse_chunk_size(const char *line, size_t length) {
+            const char *end = line + length;
+            const char *p = line;
+
+            m_remaining = 0;
+            for (; p != end && isxdigit(*p & 0xff); ++p) {
+                if (m_remaining >> 60) // Would overflow
+                    return false;
+
+                m_remaining = (m_remaining << 4) | (isdigit(*p & 0xff)? *p - '0': (skate::tolower(*p) - 'a' + 10));
+            }
+
+            if (p == line)
+                return false;
+
+            while (p != end && isspace_or_tab(*p))
+                ++p;
+
+            return p == end || *p == ';';
+        }
+
+    public:
+        http_chunked_decoder(size_t max_line_size = 64 * 1024)
+            : m_max_line_size(max_line_size)
+        {
+            reset();
+        }
+
+        void reset() noexcept {
+            m_stage = stage::chunk_size;
+            m_status = status::incomplete;
+            m_remaining = 0;
+        }
+
+        status state() const noexcept { return m_status; }
+
+        // Returns the number of body bytes still expected in the current chunk, or 0 if a line is expected next
+        uint64_t data_remaining() const noexcept { return m_stage == stage::chunk_data? m_remaining: 0; }
+
+        // Decodes as much of [data, data + size) as possible, appending the decoded body to body
+        // Returns the number of bytes consumed. Unconsumed bytes must be passed again, with more data appended, on the next call
+        size_t decode(const char *data, size_t size, std::string &body) {
+            const char *p = data;
+            const char *end = data + size;
+
+            while (m_status == status::incomplete && p != end) {
+                if (m_stage == stage::chunk_data) {
+                    const size_t length = size_t(std::min<uint64_t>(m_remaining, end - p));
+
+                    body.append(p, length);
+                    p += length;
+                    m_remaining -= length;
+
+                    if (m_remaining == 0)
+                        m_stage = stage::chunk_data_end;
+
+                    continue;
+                }
+
+                const char *lf = impl::http_find_line_feed(p, end);
+                if (lf == end) {
+                    if (size_t(end - p) > m_max_line_size)
+                        m_status = status::error;
+
+                    break;
+                }
+
+                const size_t length = line_length(p, lf);
+
+                switch (m_stage) {
+                    default:
+                    case stage::chunk_size:
+                        if (!parse_chunk_size(p, length))
+                            m_status = status::error;
+                        else
+                            m_stage = m_remaining? stage::chunk_data: stage::trailers;
+                        break;
+                    case stage::chunk_data_end:
+                        if (length)
+                            m_status = status::error;
+                        else
+                            m_stage = stage::chunk_size;
+                        break;
+                    case stage::trailers:
+                        if (length == 0) // Done reading trailers if blank line
+                            m_status = status::complete;
+                        break;
+                }
+
+                p = lf + 1;
+            }
+
+            return p - data;
+        }
+    };
+
     // Contains one HTTP request from client -> server
     class http_client_request {
+        friend class http_server_socket;
+
         unsigned int m_major, m_minor;
         std::string m_method;
+        std::string m_target;  // Request target as received, if the request was received by a server
 
         skate::url m_url;
         bool m_server_request; // Whether to use the url (false), or send '*' as the url (true)
 
-        std::map<std::string, std::string, impl::less_case_insensitive> m_headers;
+        mutable std::map<std::string, std::string, impl::less_case_insensitive> m_headers;
         std::string m_body;
 
+        std::string m_raw_head;                                    // Received request head that m_raw_headers refers to
+        mutable std::vector<impl::http_header_span> m_raw_headers; // Received headers not yet copied into m_headers
+
+        // Copies received headers into the header map the first time the map is needed
+        void materialize_headers() const {
+            if (m_raw_headers.empty())
+                return;
+
+            for (const auto &header: m_raw_headers)
+                m_headers[header.name.to_string(m_raw_head.data())] = header.value_string(m_raw_head.data());
+
+            m_raw_headers.clear();
+        }
+
+        // Returns the last received header with the given name, or null if none
+        const impl::http_header_span *find_raw_header(const std::string &key) const {
+            for (auto it = m_raw_headers.rbegin(); it != m_raw_headers.rend(); ++it)
+                if (it->name.equals_case_insensitive(m_raw_head.data(), key))
+                    return &*it;
+
+            return nullptr;
+        }
+
+        // Takes the head received by a server and the header spans within it
+        void set_received_head(std::string head, const std::vector<impl::http_header_span> &headers) {
+            m_headers.clear();
+            m_raw_head = std::move(head);
+            m_raw_headers = headers;
+        }
+
     public:
         http_client_request() : m_major(1), m_minor(1), m_method("GET"), m_server_request(false) {}
 
@@ -44,15 +521,26 @@ namespace skate {
         const std::string &method() const noexcept { return m_method; }
         bool is_wildcard_request() const noexcept { return m_server_request; }
         const skate::url &url() const noexcept { return m_url; }
-        const std::map<std::string, std::string, impl::less_case_insensitive> &headers() const noexcept { return m_headers; }
+        const std::string &target() const noexcept { return m_target; }
+        const std::map<std::string, std::string, impl::less_case_insensitive> &headers() const { materialize_headers(); return m_headers; }
         std::string header(const std::string &key, std::string default_value = {}) const {
+            if (!m_raw_headers.empty()) {
+                const auto raw = find_raw_header(key);
+                return raw? raw->value_string(m_raw_head.data()): default_value;
+            }
+
             const auto it = m_headers.find(key);
             if (it == m_headers.end())
                 return default_value;
 
             return it->second;
         }
-        bool has_header(const std::string &key) const { return m_headers.find(key) != m_headers.end(); }
+        bool has_header(const std::string &key) const {
+            if (!m_raw_headers.empty())
+                return find_raw_header(key) != nullptr;
+
+            return m_headers.find(key) != m_headers.end();
+        }
         const std::string &body() const noexcept { return m_body; }
 #ifdef SKATE_JSON_H
         skate::json_value json(skate::json_value default_value = {}) const {
@@ -89,6 +577,7 @@ namespace skate {
         }
 #endif
         http_client_request &set_headers(const std::map<std::string, std::string> &headers) {
+            m_raw_headers.clear();
             m_headers.clear();
 
             for (const auto &header: headers)
@@ -96,8 +585,8 @@ namespace skate {
 
             return *this;
         }
-        http_client_request &set_header(std::string key, std::string value) { m_headers[std::move(key)] = std::move(value); return *this; }
-        http_client_request &erase_header(const std::string &key) { m_headers.erase(key); return *this; }
+        http_client_request &set_header(std::string key, std::string value) { materialize_headers(); m_headers[std::move(key)] = std::move(value); return *this; }
+        http_client_request &erase_header(const std::string &key) { materialize_headers(); m_headers.erase(key); return *this; }
 
         http_client_request &finalize() {
             set_header("Host", url().get_hostname());
@@ -116,8 +605,12 @@ namespace skate {
         std::map<std::string, std::string, impl::less_case_insensitive> m_headers;
         std::string m_body;
 
+        shared_file m_body_file;        // File to send as the body instead of m_body, or null if none
+        uint64_t m_body_file_offset;
+        uint64_t m_body_file_length;
+
     public:
-        http_server_response() : m_major(1), m_minor(1), m_code(0) {}
+        http_server_response() : m_major(1), m_minor(1), m_code(0), m_body_file_offset(0), m_body_file_length(0) {}
 
         bool valid() const noexcept { return m_code != 0; }
         operator bool() const noexcept { return valid(); }
@@ -136,6 +629,10 @@ namespace skate {
         }
         bool has_header(const std::string &key) const { return m_headers.find(key) != m_headers.end(); }
         const std::string &body() const noexcept { return m_body; }
+        bool has_body_file() const noexcept { return m_body_file != nullptr; }
+        const shared_file &body_file() const noexcept { return m_body_file; }
+        uint64_t body_file_offset() const noexcept { return m_body_file_offset; }
+        uint64_t body_file_length() const noexcept { return m_body_file_length; }
 #ifdef SKATE_JSON_H
         skate::json_value json(skate::json_value default_value = {}) const {
             const auto result = skate::from_json<skate::json_value>(m_body);
@@ -156,11 +653,23 @@ namespace skate {
         }
         http_server_response &set_body(std::string body) {
             m_body = std::move(body);
+            m_body_file.reset();
             return set_header("Content-Length", std::to_string(m_body.size()));
         }
+        // Sends length bytes of an open file, starting at offset, as the body, using stream_socket::send_file()
+        // The response and then the socket share ownership of the file, so it stays open exactly as long as the transfer needs it
+        // Use make_shared_file() to hand over a plain descriptor
+        http_server_response &set_body_file(shared_file file, uint64_t offset, uint64_t length) {
+            m_body.clear();
+            m_body_file = std::move(file);
+            m_body_file_offset = offset;
+            m_body_file_length = length;
+            return set_header("Content-Length", std::to_string(length));
+        }
 #ifdef SKATE_JSON_H
         http_server_response &set_body(const skate::json_value &body) {
             m_body = skate::to_json(body).value;
+            m_body_file.reset();
             return set_header("Content-Type", "application/json").
                    set_header("Content-Length", std::to_string(m_body.size()));
         }
@@ -176,7 +685,26 @@ namespace skate {
         http_server_response &set_header(std::string key, std::string value) { m_headers[std::move(key)] = std::move(value); return *this; }
         http_server_response &erase_header(const std::string &key) { m_headers.erase(key); return *this; }
 
+        // Marks the response as streamed: only the head is sent, and the body follows as chunks written by the server socket
+        http_server_response &set_chunked() {
+            m_body.clear();
+            m_body_file.reset();
+            erase_header("Content-Length");
+            return set_header("Transfer-Encoding", "chunked");
+        }
+        bool is_chunked() const {
+            const auto it = m_headers.find("Transfer-Encoding");
+            return it != m_headers.end() && impl::http_has_token(it->second, "chunked");
+        }
+
         http_server_response &finalize() { return *this; }
+
+        // Moves the body out of the response, leaving it empty (headers are unchanged)
+        std::string take_body() {
+            std::string body = std::move(m_body);
+            m_body.clear();
+            return body;
+        }
     };
 
     class http_client_socket : public skate::tcp_socket {
@@ -193,6 +721,8 @@ namespace skate {
         std::string m_response_line;
         http_server_response m_response;
         int64_t m_expected_length;                        // Expected length if specified, -1 if closed connection indicates end of body, -2 if chunked
+        http_chunked_decoder m_chunked;
+        std::string m_chunked_body;
         std::deque<http_client_request> m_requests;
 
         void emit_response(std::error_code &ec) {
@@ -299,8 +829,15 @@ namespace skate {
                                 return;
                             }
 
-                            if (0) {
-                                // TODO: Check Transfer-Encoding to see if it's chunked
+                            if (m_response.has_header("Transfer-Encoding")) {
+                                // Transfer-Encoding overrides Content-Length, and the body only ends at close unless it's chunked
+                                if (impl::http_has_token(m_response.header("Transfer-Encoding"), "chunked")) {
+                                    m_expected_length = length_chunked;
+                                    m_chunked.reset();
+                                    m_chunked_body.clear();
+                                } else {
+                                    m_expected_length = length_until_close;
+                                }
                             } else if (m_response.has_header("Content-Length")) {
                                 // Check Content-Length to see length of response
                                 errno = 0;
@@ -348,7 +885,31 @@ namespace skate {
                 if (m_expected_length == length_until_close) {
                     skate::tcp_socket::read_all(ec, m_response_line);
                 } else if (m_expected_length == length_chunked) {
-                    // TODO: chunked transfer reading
+                    // Chunk data is read in bulk, and chunk lines a byte at a time like the head, so no bytes of a following response are read
+                    const uint64_t data_remaining = m_chunked.data_remaining();
+
+                    skate::tcp_socket::read(ec, m_response_line, data_remaining? size_t(std::min<uint64_t>(data_remaining, 64 * 1024)): 1);
+                    if (ec)
+                        return;
+
+                    m_response_line.erase(0, m_chunked.decode(m_response_line.data(), m_response_line.size(), m_chunked_body));
+
+                    switch (m_chunked.state()) {
+                        default:
+                        case http_chunked_decoder::status::incomplete:
+                            break;
+                        case http_chunked_decoder::status::error:
+                            ec = std::make_error_code(std::errc::bad_message);
+                            break;
+                        case http_chunked_decoder::status::complete:
+                            // Headers are left as received, so the decoded body has no Content-Length
+                            m_response.set_body(std::move(m_chunked_body)).erase_header("Content-Length");
+                            m_chunked_body = {};
+                            m_response_line.clear();
+
+                            emit_response(ec);
+                            break;
+                    }
                 } else {
                     m_expected_length -= skate::tcp_socket::read(ec, m_response_line, std::min<uintmax_t>(m_expected_length, SIZE_MAX));
 
@@ -390,7 +951,7 @@ namespace skate {
         }
 
     public:
-        http_client_socket() {}
+        http_client_socket() : m_status(status::reading_status), m_expected_length(0) {}
         virtual ~http_client_socket() {}
 
         static http_server_response http_write_request_sync(std::error_code &ec, http_client_request request) {
@@ -451,24 +1012,298 @@ namespace skate {
         }
     };
 
+    // Sends requests over keep-alive connections that are reused for later requests to the same host and port
+    // Each host gets at most a fixed number of connections, served by one socket_server. Requests beyond that wait in a queue,
+    // or are pipelined if idempotent, on connections that have already kept a previous response open
+    // Not thread-safe: use from the thread running the server, or before it starts
+    // Connections are made synchronously, since sockets only support connect_sync()
+    template<typename server_type = socket_server<>>
+    class http_client_pool {
+        http_client_pool(const http_client_pool &) = delete;
+        http_client_pool &operator=(const http_client_pool &) = delete;
+
+    public:
+        // Called with the request and its response, or with an error and an empty response if the request couldn't complete
+        typedef std::function<void (std::error_code, http_client_request &&, http_server_response &&)> callback;
+
+    private:
+        class connection;
+
+        struct pending_request {
+            http_client_request request;
+            callback done;
+            bool retried;
+        };
+
+        struct host {
+            network_address address;
+            std::vector<std::unique_ptr<connection>> connections;
+            std::deque<pending_request> queue;
+        };
+
+        class connection : public http_client_socket {
+            http_client_pool *pool;
+            host *h;
+
+        public:
+            std::deque<pending_request> in_flight;      // Requests written, in order, whose responses haven't arrived yet
+            size_t responses;                           // Responses received over this connection
+            bool persistent;                            // Whether the last response kept the connection open
+            bool retiring;                              // Whether the connection will close after the requests in flight
+
+            connection(http_client_pool *pool, host *h)
+                : pool(pool)
+                , h(h)
+                , responses(0)
+                , persistent(false)
+                , retiring(false)
+            {}
+
+            bool is_idle() const noexcept { return in_flight.empty() && !retiring && !is_null(); }
+
+        protected:
+            virtual void http_response_received(http_client_request &&request, http_server_response &&response) override {
+                pool->collect_closed();
+                ++pool->callback_depth;
+
+                pending_request pending = std::move(in_flight.front());
+                in_flight.pop_front();
+
+                ++responses;
+                persistent = (response.major() > 1 || (response.major() == 1 && response.minor() >= 1)) &&
+                             !impl::http_has_token(response.header("Connection"), "close") &&
+                             !impl::http_has_token(request.header("Connection"), "close");
+                retiring |= !persistent;
+
+                pending.done({}, std::move(request), std::move(response));
+
+                pool->dispatch(*h);
+                --pool->callback_depth;
+            }
+
+            virtual void disconnected(std::error_code &ec) override {
+                http_client_socket::disconnected(ec);
+
+                ++pool->callback_depth;
+                pool->connection_closed(*h, this);
+                --pool->callback_depth;
+            }
+        };
+
+        server_type &server;
+        size_t max_connections_per_host;
+        size_t max_pipeline_depth;
+        std::unordered_map<std::string, std::unique_ptr<host>> hosts;
+        std::vector<std::unique_ptr<connection>> closed;       // Closed connections, destroyed once their server events are over
+        size_t callback_depth;                                  // Nesting depth of connection callbacks, which may still be using a closed connection
+
+        // Destroys closed connections, unless called from within a connection callback
+        void collect_closed() {
+            if (callback_depth == 0)
+                closed.clear();
+        }
+
+        static bool is_idempotent(const std::string &method) {
+            return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "TRACE" || method == "PUT" || method == "DELETE";
+        }
+
+        // Returns a connection that can take the request now, or null if it must wait
+        connection *connection_for(std::error_code &ec, host &h, const http_client_request &request) {
+            size_t live = 0;
+            for (const auto &c: h.connections) {
+                if (c->is_idle())
+                    return c.get();
+
+                live += !c->is_null();
+            }
+
+            // Open a new connection if the host has room
+            if (live < max_connections_per_host) {
+                std::unique_ptr<connection> c{new connection(this, &h)};
+
+                c->connect_sync(ec, c->resolve(ec, h.address));
+                c->set_blocking(ec, false);
+                if (ec)
+                    return nullptr;
+
+                server.serve_socket(c.get());
+                h.connections.push_back(std::move(c));
+
+                return h.connections.back().get();
+            }
+
+            // Otherwise pipeline behind the shortest queue, if allowed
+            if (max_pipeline_depth <= 1 || !is_idempotent(request.method()))
+                return nullptr;
+
+            connection *best = nullptr;
+            for (const auto &c: h.connections) {
+                if (c->is_null() || c->retiring || !c->persistent || c->in_flight.size() >= max_pipeline_depth)
+                    continue;
+
+                if (!std::all_of(c->in_flight.begin(), c->in_flight.end(), [](const pending_request &p) { return is_idempotent(p.request.method()); }))
+                    continue;
+
+                if (!best || c->in_flight.size() < best->in_flight.size())
+                    best = c.get();
+            }
+
+            return best;
+        }
+
+        // Sends queued requests for a host while connections can take them
+        void dispatch(host &h) {
+            while (!h.queue.empty()) {
+                std::error_code ec;
+
+                connection *c = connection_for(ec, h, h.queue.front().request);
+                if (!ec && !c)
+                    return;
+
+                pending_request pending = std::move(h.queue.front());
+                h.queue.pop_front();
+
+                if (!ec) {
+                    c->http_write_request(ec, pending.request);
+                    if (!ec) {
+                        c->retiring |= impl::http_has_token(pending.request.header("Connection"), "close");
+                        c->in_flight.push_back(std::move(pending));
+                        continue;
+                    }
+                }
+
+                pending.done(ec, std::move(pending.request), {});
+            }
+        }
+
+        // Requests in flight on a closed connection are retried once if idempotent and the connection was reused, since a server
+        // may close an idle keep-alive connection just as a request is sent. Others fail
+        void connection_closed(host &h, connection *c) {
+            auto it = std::find_if(h.connections.begin(), h.connections.end(), [c](const std::unique_ptr<connection> &p) { return p.get() == c; });
+            if (it == h.connections.end())
+                return;
+
+            std::deque<pending_request> in_flight = std::move(c->in_flight);
+            c->in_flight.clear();
+
+            closed.push_back(std::move(*it));
+            h.connections.erase(it);
+
+            const bool reused = c->responses > 0;
+            for (auto pending = in_flight.rbegin(); pending != in_flight.rend(); ++pending) {
+                if (reused && !pending->retried && is_idempotent(pending->request.method())) {
+                    pending->retried = true;
+                    h.queue.push_front(std::move(*pending));
+                } else {
+                    pending->done(std::make_error_code(std::errc::connection_reset), std::move(pending->request), {});
+                }
+            }
+
+            dispatch(h);
+        }
+
+    public:
+        // Requests beyond max_pipeline_depth per connection wait for a response. A depth of 1 disables pipelining
+        http_client_pool(server_type &server, size_t max_connections_per_host = 6, size_t max_pipeline_depth = 4)
+            : server(server)
+            , max_connections_per_host(std::max<size_t>(max_connections_per_host, 1))
+            , max_pipeline_depth(std::max<size_t>(max_pipeline_depth, 1))
+            , callback_depth(0)
+        {}
+        virtual ~http_client_pool() {}
+
+        // Queues a request to the host and port of its URL, and sends it as soon as a connection is available
+        // done is called on the server's thread once the response arrives
+        void request(std::error_code &ec, http_client_request request, callback done) {
+            if (ec)
+                return;
+            else if (!request.url().has_host()) {
+                ec = std::make_error_code(std::errc::invalid_argument);
+                return;
+            }
+
+            collect_closed();
+
+            const uint16_t port = request.url().get_port(80);
+            const std::string key = request.url().get_host() + ':' + std::to_string(port);
+
+            auto &h = hosts[key];
+            if (!h) {
+                h.reset(new host());
+                h->address = network_address(request.url().get_host(), port);
+            }
+
+            h->queue.push_back(pending_request{std::move(request), std::move(done), false});
+
+            dispatch(*h);
+        }
+
+        // Returns the number of open connections to all hosts
+        size_t connection_count() const noexcept {
+            size_t count = 0;
+            for (const auto &h: hosts)
+                for (const auto &c: h.second->connections)
+                    count += !c->is_null();
+
+            return count;
+        }
+
+        // Returns the number of requests waiting for a connection
+        size_t queued_count() const noexcept {
+            size_t count = 0;
+            for (const auto &h: hosts)
+                count += h.second->queue.size();
+
+            return count;
+        }
+    };
+
     // TODO: doesn't support Expect: 100-continue at all
     class http_server_socket : public skate::tcp_socket {
         enum class status {
-            reading_status,
-            reading_headers,
+            reading_head,
             reading_body
         };
 
         const int64_t length_chunked = -1;
 
         status m_status;
-        std::string m_request_line;
+        std::string m_input;                              // Start of a request split across reads, or read by a blocking socket. Usually empty, since requests are parsed in place in the read buffer
+        http_request_parser m_parser;
+        http_chunked_decoder m_chunked;
         http_client_request m_request;
         int64_t m_expected_length;                        // Expected length of request if specified, -1 if chunked
 
-        void http_write_response(std::error_code &ec, http_server_response response) {
+        bool m_processing;                                // Whether http_process_input() is running, to prevent reentry
+        bool m_offloaded;                                 // Whether a request is being handled on a worker thread
+        std::shared_ptr<char> m_lifetime;                 // Expires when the socket is destroyed, so offloaded results can detect a closed connection
+        bool m_streaming;                                 // Whether a chunked response body is still being written
+        bool m_stream_raw;                                // Whether the streamed body is sent as-is, for HTTP/1.0 clients
+        bool m_closing;                                   // Whether the connection closes once the current response is sent
+        uint64_t m_chunks_written;
+        timer_wheel::timer_id m_idle_timer;
+
+        void http_write_response(std::error_code &ec, http_server_response response, bool http10, bool keep_alive) {
             response.finalize();
 
+            if (impl::http_has_token(response.header("Connection"), "close"))
+                keep_alive = false;
+
+            // HTTP/1.0 clients don't understand chunked transfer coding, so the body is sent as-is and ended by closing the connection
+            m_streaming = response.is_chunked();
+            m_stream_raw = m_streaming && http10;
+            if (m_stream_raw) {
+                response.erase_header("Transfer-Encoding");
+                keep_alive = false;
+            }
+
+            if (!keep_alive)
+                response.set_header("Connection", "close");
+            else if (http10)
+                response.set_header("Connection", "keep-alive");
+
+            m_closing = !keep_alive;
+
             std::string txbuf;
 
             // Generate response status line
@@ -491,162 +1326,342 @@ namespace skate {
             }
             txbuf += "\r\n";
 
-            // Write status and headers
-            write(ec, txbuf);
+            if (m_streaming) { // Write status and headers, then let the subclass produce the body
+                write(ec, txbuf);
+                http_pump_stream(ec);
+                return;
+            } else if (response.has_body_file()) { // Write status and headers, and a file body
+                write(ec, txbuf);
+                send_file(ec, response.body_file(), response.body_file_offset(), response.body_file_length());
+            } else { // Write status, headers, and body (if any) together, without copying the body
+                std::vector<skate::socket_write_buffer> buffers;
+                buffers.reserve(2);
+                buffers.push_back(std::move(txbuf));
+                buffers.push_back(response.take_body());
+
+                write_vectored(ec, std::move(buffers));
+            }
 
-            // Write body (if any)
-            write(ec, response.body());
+            if (m_closing)
+                close_write_when_flushed();
         }
 
-    protected:
-        http_server_socket(skate::system_socket_descriptor desc, skate::socket_state current_state, bool blocking)
-            : tcp_socket(desc, current_state, blocking)
-            , m_status(status::reading_status)
-            , m_expected_length(0)
-        {}
+        // Asks the subclass for more of a chunked body while everything written so far has been sent
+        void http_pump_stream(std::error_code &ec) {
+            while (!ec && m_streaming && !is_null() && !async_pending_write()) {
+                const uint64_t chunks_written = m_chunks_written;
 
-        virtual void ready_read(std::error_code &ec) final override {
-            if (m_status != status::reading_body) {
-                skate::tcp_socket::read(ec, m_request_line, 1);
+                http_response_writable(ec);
 
-                if (!ends_with(m_request_line, "\r\n")) {
-                    if (m_request_line.size() > 1024 * 1024)
-                        ec = std::make_error_code(std::errc::bad_message);
+                if (m_chunks_written == chunks_written) // Nothing more is available yet
+                    break;
+            }
+        }
+
+        // Restarts the countdown to closing an idle connection
+        void http_touch_idle_timer() {
+            const auto timeout = http_idle_timeout();
+            if (timeout <= std::chrono::milliseconds::zero() || !event_loop() || event_loop()->reset_timer(m_idle_timer, timeout))
+                return;
+
+            const std::weak_ptr<char> lifetime = m_lifetime;
+            m_idle_timer = event_loop()->arm_timer(event_target(), timeout, [this, lifetime](std::error_code &ec) {
+                if (lifetime.expired())
                     return;
-                }
 
-                // Remove trailing "\r\n"
-                m_request_line.pop_back();
-                m_request_line.pop_back();
+                m_idle_timer = 0;
 
-                switch (m_status) {
-                    default:
-                    case status::reading_status: {
-                        if (m_request_line.empty()) { // Ignore empty lines preceding status line
-                            m_request_line.clear();
-                            return;
-                        }
+                // A response still in progress isn't idle
+                if (m_offloaded || m_streaming || async_pending_write())
+                    http_touch_idle_timer();
+                else
+                    disconnect(ec);
+            });
+        }
 
-                        std::cout << m_request_line << std::endl;
+        // Appends everything that can be read without waiting to m_input. Only needed for blocking sockets, since the server fills the read buffer of others
+        void http_fill_input(std::error_code &ec) {
+            size_t available = read_bytes_pending() + impl::socket_pending_read_bytes(ec, native());
+            if (ec)
+                return;
 
-                        const char *start = m_request_line.c_str();
-                        char *end = nullptr;
+            // Always read at least one byte so a blocking socket notices a disconnect
+            available = std::max<size_t>(available, 1);
 
-                        // Get method
-                        size_t offset = m_request_line.find(' ');
-                        if (offset == std::string::npos) {
-                            ec = std::make_error_code(std::errc::bad_message);
-                            return;
-                        }
+            const size_t old_size = m_input.size();
+            m_input.resize(old_size + available);
+            m_input.resize(old_size + skate::tcp_socket::read(ec, &m_input[old_size], available));
+        }
 
-                        m_request.set_method(m_request_line.substr(0, offset));
-                        start = m_request_line.c_str() + offset;
-                        while (*start == ' ')
-                            ++start;
+        void http_dispatch_request(std::error_code &ec) {
+            m_status = status::reading_head;
 
-                        // Get URL
-                        offset = m_request_line.find(' ', start - m_request_line.c_str());
-                        if (offset == std::string::npos) {
-                            ec = std::make_error_code(std::errc::bad_message);
-                            return;
-                        }
+            // HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 connections only persist if requested
+            const bool http10 = m_request.major() < 1 || (m_request.major() == 1 && m_request.minor() == 0);
+            const std::string connection = m_request.header("Connection");
+            const bool keep_alive = http10? impl::http_has_token(connection, "keep-alive"): !impl::http_has_token(connection, "close");
 
-                        const std::string url = m_request_line.substr(start - m_request_line.c_str(), offset - (start - m_request_line.c_str()));
-                        start = m_request_line.c_str() + offset;
-                        while (*start == ' ')
-                            ++start;
+            // Run the handler on a worker thread if asked to, and resume parsing when its response has been written
+            auto handler = http_request_offload_handler(m_request);
+            if (handler && event_loop()) {
+                auto request = std::make_shared<http_client_request>(std::move(m_request));
+                auto response = std::make_shared<http_server_response>();
+                const std::weak_ptr<char> lifetime = m_lifetime;
 
-                        // Get HTTP version
-                        if (!starts_with(start, "HTTP/") || !isdigit(start[5])) {
-                            ec = std::make_error_code(std::errc::bad_message);
-                            return;
-                        }
-                        start += 5;
+                m_request = {};
+                m_offloaded = true;
 
-                        // Get HTTP major version
-                        m_request.set_major(std::max(0L, std::min(strtol(start, &end, 10), 255L)));
-                        start = end;
+                event_loop()->offload(event_target(), [handler, request, response]() {
+                    *response = handler(std::move(*request));
+                }, [this, lifetime, response, http10, keep_alive](std::error_code &ec) {
+                    if (lifetime.expired())
+                        return;
 
-                        if (*start++ != '.') {
-                            ec = std::make_error_code(std::errc::bad_message);
-                            return;
-                        }
+                    m_offloaded = false;
 
-                        // Get HTTP minor version
-                        m_request.set_minor(std::max(0L, std::min(strtol(start, &end, 10), 255L)));
+                    http_write_response(ec, std::move(*response), http10, keep_alive);
+                    http_process_input(ec);
+                });
 
-                        m_request_line.clear();
-                        m_status = status::reading_headers;
+                return;
+            }
 
-                        break;
-                    }
-                    case status::reading_headers: {
-                        if (m_request_line.empty()) { // Done reading headers if blank line
-                            if (0) {
-                                // TODO: Check Transfer-Encoding to see if it's chunked
+            http_server_response response = http_request_received(std::move(m_request));
+            m_request = {};
+
+            http_write_response(ec, std::move(response), http10, keep_alive);
+        }
+
+        // Whether more requests may be parsed now. Parsing pauses while a request is offloaded or a chunked response is being streamed, and stops once the connection is closing
+        bool http_accepting_input() const noexcept { return !is_null() && !m_offloaded && !m_streaming && !m_closing; }
+
+        // Parses as many complete requests out of [input, input + input_size) as possible, and returns the number of bytes consumed
+        // Spans of a partially parsed head are relative to the first unconsumed byte, so parsing can resume on a copy of the unconsumed bytes
+        size_t http_parse_input(std::error_code &ec, const char *input, size_t input_size) {
+            size_t consumed = 0;
+
+            while (!ec && http_accepting_input()) {
+                const char *data = input + consumed;
+                const size_t size = input_size - consumed;
+
+                if (m_status == status::reading_head) {
+                    switch (m_parser.parse(data, size)) {
+                        default:
+                        case http_request_parser::status::incomplete: break;
+                        case http_request_parser::status::error: ec = std::make_error_code(std::errc::bad_message); break;
+                        case http_request_parser::status::complete: {
+                            m_request.set_method(m_parser.method().to_string(data));
+                            m_request.set_major(m_parser.major());
+                            m_request.set_minor(m_parser.minor());
+                            m_request.m_target = m_parser.target().to_string(data);
+                            m_request.set_received_head(std::string(data, m_parser.head_size()), m_parser.headers());
+
+                            consumed += m_parser.head_size();
+                            m_parser.reset();
+
+                            if (m_request.has_header("Transfer-Encoding")) {
+                                // Chunked is the only transfer coding supported for requests
+                                if (!impl::http_has_token(m_request.header("Transfer-Encoding"), "chunked")) {
+                                    ec = std::make_error_code(std::errc::bad_message);
+                                    break;
+                                }
+
+                                m_expected_length = length_chunked;
+                                m_chunked.reset();
+                                m_status = status::reading_body;
                             } else if (m_request.has_header("Content-Length")) {
                                 // Check Content-Length to see length of response
                                 errno = 0;
                                 m_expected_length = std::max(0LL, strtoll(m_request.header("Content-Length").c_str(), nullptr, 10));
                                 if (errno == ERANGE) {
                                     ec = std::make_error_code(std::errc::bad_message);
-                                    return;
+                                    break;
                                 }
+
+                                m_status = status::reading_body;
                             } else if (0) {
                                 // TODO: Check multipart/byteranges to see if the transfer length can be deduced
                             } else {
-                                m_status = status::reading_status;
-
-                                http_write_response(ec, http_request_received(std::move(m_request)));
-
-                                return;
+                                http_dispatch_request(ec);
                             }
 
-                            m_status = status::reading_body;
-
-                            return;
+                            continue;
                         }
+                    }
+                } else if (m_expected_length == length_chunked) {
+                    consumed += m_chunked.decode(data, size, m_request.m_body);
 
-                        if (isspace_or_tab(m_request_line[0])) {
-                            // TODO: handle folded headers
-                            return;
-                        }
+                    if (m_chunked.state() == http_chunked_decoder::status::error) {
+                        ec = std::make_error_code(std::errc::bad_message);
+                    } else if (m_chunked.state() == http_chunked_decoder::status::complete) {
+                        http_dispatch_request(ec);
+                        continue;
+                    }
+                } else if (uintmax_t(size) >= uintmax_t(m_expected_length)) {
+                    // Body is complete, so take it without changing the received headers
+                    m_request.m_body.assign(data, size_t(m_expected_length));
+                    consumed += size_t(m_expected_length);
 
-                        // Find end of header key
-                        const size_t colon = m_request_line.find(':');
-                        if (colon == m_request_line.npos) {
-                            ec = std::make_error_code(std::errc::bad_message);
-                            return;
-                        }
+                    http_dispatch_request(ec);
+                    continue;
+                }
 
-                        size_t value_start = colon + 1;
+                break;
+            }
 
-                        // Skip leading whitespace before value
-                        while (value_start < m_request_line.size() && isspace_or_tab(m_request_line[value_start]))
-                            ++value_start;
+            return consumed;
+        }
+
+        // Parses as many complete requests as possible, so pipelined requests are answered in order in one pass
+        // Requests are parsed in place in the read buffer. Only the start of a request that isn't complete yet is copied to m_input,
+        // so it stays contiguous when more arrives (or when it wraps around the end of the read buffer)
+        void http_process_input(std::error_code &ec) {
+            if (m_processing)
+                return;
+
+            m_processing = true;
 
-                        m_request.set_header(m_request_line.substr(0, colon), m_request_line.substr(value_start));
-                        m_request_line.clear();
+            while (!ec && http_accepting_input()) {
+                if (!m_input.empty()) {
+                    m_input.erase(0, http_parse_input(ec, m_input.data(), m_input.size()));
 
+                    if (m_input.empty()) {
+                        std::string().swap(m_input); // Release the storage, so idle connections don't hold on to it
+                    } else if (!ec && http_accepting_input() && read_bytes_pending()) {
+                        read_buffer.read_all_into(make_back_inserter(m_input)); // Still incomplete, so the rest must be appended
+                        continue;
+                    } else {
                         break;
                     }
                 }
-            } else { // Reading body (m_response_line is repurposed to read body)
-                if (m_expected_length == length_chunked) {
-                    // TODO: chunked transfer reading
-                } else {
-                    m_expected_length -= skate::tcp_socket::read(ec, m_request_line, std::min<uintmax_t>(m_expected_length, SIZE_MAX));
 
-                    if (m_expected_length == 0) {
-                        m_request.set_body(std::move(m_request_line));
-                        m_request_line = {};
+                const io_buffer_span<char> span = read_buffer.peek_read()[0];
+                if (span.empty())
+                    break;
 
-                        http_write_response(ec, http_request_received(std::move(m_request)));
-                    }
-                }
+                const size_t consumed = http_parse_input(ec, span.data, span.size());
+                read_buffer.consume(consumed);
+
+                if (consumed < span.size() && !ec && http_accepting_input())
+                    read_buffer.read_all_into(make_back_inserter(m_input));
             }
+
+            // Once closing, nothing more will be answered, so all input is dropped
+            if (m_closing) {
+                std::string().swap(m_input);
+                read_buffer.clear();
+            }
+
+            m_processing = false;
+        }
+
+
+    protected:
+        http_server_socket(skate::system_socket_descriptor desc, skate::socket_state current_state, bool blocking)
+            : tcp_socket(desc, current_state, blocking)
+            , m_status(status::reading_head)
+            , m_expected_length(0)
+            , m_processing(false)
+            , m_offloaded(false)
+            , m_lifetime(std::make_shared<char>())
+            , m_streaming(false)
+            , m_stream_raw(false)
+            , m_closing(false)
+            , m_chunks_written(0)
+            , m_idle_timer(0)
+        {}
+
+        virtual void connected(std::error_code &) override {
+            http_touch_idle_timer();
+        }
+
+        // Input isn't read while a request is offloaded or a response is streamed, since parsing is paused then anyway
+        // Leaving it in the socket lets TCP flow control hold back a client that keeps sending
+        virtual bool async_read_paused() const override { return m_offloaded || m_streaming; }
+
+        virtual void ready_read(std::error_code &ec) final override {
+            if (async_read_paused())
+                return;
+
+            http_touch_idle_timer();
+
+            if (is_blocking()) {
+                http_fill_input(ec);
+                if (ec)
+                    return;
+            }
+
+            http_process_input(ec);
+        }
+
+        virtual void ready_write(std::error_code &ec) final override {
+            http_pump_stream(ec);
+        }
+
+        // Returns how long a connection may go without receiving data before it is closed, or zero to keep idle connections open
+        // Checked whenever the idle countdown restarts
+        virtual std::chrono::milliseconds http_idle_timeout() const { return std::chrono::milliseconds::zero(); }
+
+        // Writes the next part of a chunked response body. Empty data is ignored, since an empty chunk ends the body
+        void http_write_chunk(std::error_code &ec, std::string data) {
+            if (ec)
+                return;
+            else if (!m_streaming) {
+                ec = std::make_error_code(std::errc::operation_not_permitted);
+                return;
+            } else if (data.empty())
+                return;
+
+            ++m_chunks_written;
+
+            std::vector<skate::socket_write_buffer> buffers;
+            buffers.reserve(3);
+
+            if (!m_stream_raw) {
+                char size[32];
+                const int size_length = snprintf(size, sizeof(size), "%zx\r\n", data.size());
+
+                buffers.push_back(std::string(size, size_length));
+            }
+
+            buffers.push_back(std::move(data));
+
+            if (!m_stream_raw)
+                buffers.push_back(skate::socket_write_buffer::unowned("\r\n", 2));
+
+            write_vectored(ec, std::move(buffers));
         }
 
+        // Ends a chunked response body, then continues with any pipelined requests
+        void http_end_chunked_response(std::error_code &ec) {
+            if (ec)
+                return;
+            else if (!m_streaming) {
+                ec = std::make_error_code(std::errc::operation_not_permitted);
+                return;
+            }
+
+            if (!m_stream_raw)
+                write(ec, "0\r\n\r\n", 5);
+
+            m_streaming = m_stream_raw = false;
+
+            if (m_closing)
+                close_write_when_flushed();
+            else
+                http_process_input(ec);
+        }
+
+        // Called while a chunked response is being streamed and everything written so far has been sent
+        // Continue the body with http_write_chunk() and finish it with http_end_chunked_response()
+        // If nothing is available yet, both can also be called later from the socket's event loop thread
+        virtual void http_response_writable(std::error_code &) {}
+
+        // Returns a handler to run on one of the event loop's worker threads instead of calling http_request_received(), or an empty function to handle the request on the loop
+        // The handler must not refer to the socket, since it runs concurrently with the loop and the connection may close before it finishes
+        // Responses are still written in request order, since the next request on the connection isn't parsed until the response is written
+        virtual std::function<http_server_response (http_client_request &&)> http_request_offload_handler(const http_client_request &) { return {}; }
+
         virtual http_server_response http_request_received(http_client_request &&request) {
             std::cout << "Request received\n";
 
@@ -672,7 +1687,18 @@ namespace skate {
         }
 
     public:
-        http_server_socket() {}
+        http_server_socket()
+            : m_status(status::reading_head)
+            , m_expected_length(0)
+            , m_processing(false)
+            , m_offloaded(false)
+            , m_lifetime(std::make_shared<char>())
+            , m_streaming(false)
+            , m_stream_raw(false)
+            , m_closing(false)
+            , m_chunks_written(0)
+            , m_idle_timer(0)
+        {}
         virtual ~http_server_socket() {}
     };
 }
@@ -12,12 +12,23 @@
 #include "select.h"
 #include "poll.h"
 #include "epoll.h"
+#include "io_uring.h"
 #include "wsaasyncselect.h"
 
 #include <memory>
 #include <unordered_map>
 #include <utility>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#if LINUX_OS
+# include <sys/eventfd.h>
+#endif
 
 #include <type_traits>
 
@@ -31,72 +42,268 @@ namespace skate {
         typedef poll_socket_watcher default_socket_watcher;
 #else
 # error Platform not supported
+#endif
+
+#if LINUX_OS
+        typedef epoll_socket_watcher default_pool_socket_watcher;
+#else
+        typedef default_socket_watcher default_pool_socket_watcher;
 #endif
     }
 
+    namespace impl {
+        // Maps descriptors to the sockets served by a socket_server, either owned (accepted by the server) or third-party
+        // On POSIX descriptors are small integers, so the table is a flat vector indexed by descriptor and lookups don't hash
+        class socket_descriptor_table {
+            struct entry {
+                entry() : s(nullptr) {}
+
+                socket *s;
+                std::unique_ptr<socket> owned;                  // Set if s is owned by the table
+            };
+
+#if POSIX_OS
+            std::vector<entry> entries;
+
+            entry *find_entry(system_socket_descriptor desc) noexcept {
+                return desc >= 0 && size_t(desc) < entries.size() && entries[desc].s? &entries[desc]: nullptr;
+            }
+            entry &insert_entry(system_socket_descriptor desc) {
+                if (size_t(desc) >= entries.size())
+                    entries.resize(std::max(size_t(desc) + 1, entries.size() * 2));
+
+                return entries[desc];
+            }
+#else
+            std::unordered_map<system_socket_descriptor, entry> entries;
+
+            entry *find_entry(system_socket_descriptor desc) noexcept {
+                const auto it = entries.find(desc);
+                return it != entries.end()? &it->second: nullptr;
+            }
+            entry &insert_entry(system_socket_descriptor desc) { return entries[desc]; }
+#endif
+
+            size_t third_party;                                 // Number of third-party sockets in the table
+
+        public:
+            socket_descriptor_table() : third_party(0) {}
+
+            socket *find(system_socket_descriptor desc) const noexcept {
+                const entry *e = const_cast<socket_descriptor_table *>(this)->find_entry(desc);
+                return e? e->s: nullptr;
+            }
+
+            // Adds a socket owned by the table, replacing any socket with the same descriptor
+            socket *insert_owned(system_socket_descriptor desc, std::unique_ptr<socket> s) {
+                erase(desc);
+
+                entry &e = insert_entry(desc);
+                e.s = s.get();
+                e.owned = std::move(s);
+
+                return e.s;
+            }
+
+            // Adds a socket not owned by the table, replacing any socket with the same descriptor
+            void insert_third_party(system_socket_descriptor desc, socket *s) {
+                erase(desc);
+
+                insert_entry(desc).s = s;
+                ++third_party;
+            }
+
+            // Removes a socket, destroying it if owned
+            void erase(system_socket_descriptor desc) {
+                entry *e = find_entry(desc);
+                if (!e)
+                    return;
+
+                if (!e->owned)
+                    --third_party;
+
+                std::unique_ptr<socket> owned = std::move(e->owned);
+                e->s = nullptr;
+#if !POSIX_OS
+                entries.erase(desc);
+#endif
+            }
+
+            size_t third_party_count() const noexcept { return third_party; }
+        };
+    }
+
     class WSAAsyncSelectWatcher;
 
     template<typename system_watcher = impl::default_socket_watcher>
-    class socket_server {
-        std::unordered_map<system_socket_descriptor, socket *> third_party_socket_map;           // Maps third-party descriptors (servers can watch other sockets than just incoming connections), not owned by this class
-        std::unordered_map<system_socket_descriptor, std::unique_ptr<socket>> client_socket_map; // Maps descriptors to their client socket objects
+    class socket_server : public socket_event_loop {
+        typedef std::pair<socket_event_target, std::function<void (std::error_code &)>> posted_function;
+
+        io_buffer_pool<char> buffer_pool;                                                        // Shared by accepted sockets' buffers, so idle connections hold no buffer memory. Declared first to outlive the sockets
+        impl::socket_descriptor_table sockets;                                                   // Maps descriptors to owned client sockets, and to third-party sockets (servers can watch other sockets than just incoming connections)
         system_watcher watcher;
-        bool canceled;
+        std::atomic<bool> canceled;
+        timer_wheel timers;
+        uint64_t last_generation;                                                                // Generation given to the last socket served
+
+        // Functions posted from other threads, run on the loop's thread after each poll
+        std::mutex posted_mtx;
+        std::vector<posted_function> posted;
+        std::vector<posted_function> posted_running;                                              // Swapped with posted so its capacity is reused
+        system_socket_descriptor wakeup_read;                                                    // Readable when functions have been posted (eventfd or pipe)
+        system_socket_descriptor wakeup_write;
+
+        // Worker threads for offload()
+        std::mutex work_mtx;
+        std::condition_variable work_cv;
+        std::deque<std::function<void ()>> work;
+        std::vector<std::thread> workers;
+        bool workers_stopping;
+
+        // Creates the descriptor that wakes the watcher when functions are posted from another thread
+        // Without it (on Windows), posted functions wait for the next poll to return
+        void create_wakeup() {
+            wakeup_read = wakeup_write = impl::system_invalid_socket_value;
 
-        socket *third_party_socket(system_socket_descriptor native) const {
-            const auto it = third_party_socket_map.find(native);
-            if (it != third_party_socket_map.end())
-                return it->second;
+#if LINUX_OS
+            wakeup_read = wakeup_write = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif POSIX_OS
+            int fds[2];
+            if (::pipe(fds) == 0) {
+                std::error_code ec;
+                impl::socket_set_blocking(ec, fds[0], false);
+                impl::socket_set_blocking(ec, fds[1], false);
+
+                wakeup_read = fds[0];
+                wakeup_write = fds[1];
+            }
+#endif
 
-            return nullptr;
+            if (wakeup_read != impl::system_invalid_socket_value) {
+                std::error_code ec;
+                watcher.watch(ec, wakeup_read, WatchRead);
+            }
         }
-        socket *owned_socket(system_socket_descriptor native) const {
-            const auto it = client_socket_map.find(native);
-            if (it != client_socket_map.end())
-                return it->second.get();
 
-            return nullptr;
+        void destroy_wakeup() {
+#if POSIX_OS
+            if (wakeup_read != impl::system_invalid_socket_value) {
+                std::error_code ec;
+                watcher.unwatch_dead_descriptor(ec, wakeup_read);
+
+                ::close(wakeup_read);
+                if (wakeup_write != wakeup_read)
+                    ::close(wakeup_write);
+            }
+#endif
         }
-        socket *get_socket(system_socket_descriptor native) const {
-            auto sock = third_party_socket(native);
-            if (sock)
-                return sock;
 
-            return owned_socket(native);
+        void signal_wakeup() {
+#if LINUX_OS
+            const uint64_t value = 1;
+            if (wakeup_write != impl::system_invalid_socket_value && ::write(wakeup_write, &value, sizeof(value)) < 0) {
+                // Counter is already signalled, or the descriptor is gone
+            }
+#elif POSIX_OS
+            const char value = 0;
+            if (wakeup_write != impl::system_invalid_socket_value && ::write(wakeup_write, &value, sizeof(value)) < 0) {
+                // Pipe is already full, so the watcher is already woken
+            }
+#endif
         }
 
-        void socket_accept_event_occurred(socket *s, socket_watch_flags) {
-            std::error_code ec;
-            struct sockaddr_storage remote_addr;
-            socklen_t remote_addr_len = sizeof(remote_addr);
+        void drain_wakeup() {
+#if POSIX_OS
+            char buffer[64];
+            while (::read(wakeup_read, buffer, sizeof(buffer)) > 0 && wakeup_read != wakeup_write);
+#endif
+        }
+
+        // Runs functions posted since the last poll, each handled like an event on its socket
+        void run_posted() {
+            {
+                std::lock_guard<std::mutex> lock(posted_mtx);
+                if (posted.empty())
+                    return;
+
+                std::swap(posted, posted_running);
+            }
+
+            for (const auto &fn: posted_running) {
+                socket *s = get_target(fn.first);
+                if (s && !s->is_listening())
+                    socket_nonaccept_event_occurred(s, 0, &fn.second);
+            }
+
+            posted_running.clear();
+        }
+
+        void stop_workers() {
+            {
+                std::lock_guard<std::mutex> lock(work_mtx);
+                workers_stopping = true;
+            }
+
+            work_cv.notify_all();
+
+            for (auto &worker: workers)
+                worker.join();
+
+            workers.clear();
+            workers_stopping = false;
+        }
+
+        socket *get_socket(system_socket_descriptor native) const { return sockets.find(native); }
+
+        // Returns the socket a target refers to, or null if it's no longer served
+        socket *get_target(const socket_event_target &target) const {
+            socket *s = sockets.find(target.desc);
+            return s && s->loop_generation == target.generation? s: nullptr;
+        }
+
+        // Stops serving a socket, destroying it if owned
+        void erase_socket(socket *s, system_socket_descriptor desc) {
+            for (const auto id: s->loop_timers)
+                timers.cancel(id);
+            s->loop_timers.clear();
 
+            sockets.erase(desc);
+        }
+
+        void socket_accept_event_occurred(socket *s, socket_watch_flags) {
             do {
+                std::error_code ec; // Fresh per connection, so a failure on one accept doesn't close the next
+
 #if POSIX_OS | WINDOWS_OS
-                const system_socket_descriptor remote = ::accept(s->native(),
-                                                                 reinterpret_cast<struct sockaddr *>(&remote_addr),
-                                                                 &remote_addr_len);
+                // The remote address isn't needed here, accepted sockets can look it up with remote_address()
+#if LINUX_OS
+                // Accepted sockets get the listener's blocking mode, as on other platforms, without extra system calls
+                const system_socket_descriptor remote = ::accept4(s->native(), nullptr, nullptr, SOCK_CLOEXEC | (s->is_blocking()? 0: SOCK_NONBLOCK));
+#else
+                const system_socket_descriptor remote = ::accept(s->native(), nullptr, nullptr);
+#endif
 
                 if (remote == impl::system_invalid_socket_value) {
                     ec = impl::socket_error();
                     if (impl::socket_would_block(ec))
                         break;
+#if POSIX_OS
+                    else if (ec == std::errc::connection_aborted || ec == std::errc::interrupted) // The peer gave up while queued, move on to the next connection
+                        continue;
+#endif
 
                     s->error(ec);
                     break;
                 } else {
-                    // Platform-dependent blocking inheritance. On Linux, sockets don't inherit blocking spec, whereas Windows and BSD do.
-                    const bool is_blocking =
-#if LINUX_OS
-                            true;
-#else
-                            s->is_blocking();
-#endif
-
+                    // Platform-dependent blocking inheritance. Windows and BSD inherit the listener's blocking mode, and Linux sets it in accept4()
+                    const bool is_blocking = s->is_blocking();
 
                     auto p = s->create(remote, socket_state::connected, is_blocking);
                     if (!p)
                         continue;
 
+                    p->set_buffer_pool(&buffer_pool);
+
                     if (!do_socket_init(p.get())) {
                         if (ec) {
                             p->error(ec);
@@ -104,12 +311,11 @@ namespace skate {
                             continue;
                         }
 
-                        client_socket_map.insert({remote, std::move(p)});
+                        socket *accepted = sockets.insert_owned(remote, std::move(p));
 
-                        s->do_server_connected(ec);
+                        accepted->do_server_connected(ec);
                         if (ec) {
-                            p->error(ec);
-                            error(p.get(), ec);
+                            error(accepted, ec);
                         }
                     }
                 }
@@ -119,27 +325,42 @@ namespace skate {
             } while (!s->is_blocking()); // If non-blocking listener socket, then read all available new connections immediately
         }
 
-        void socket_nonaccept_event_occurred(socket *s, socket_watch_flags flags) {
+        void socket_nonaccept_event_occurred(socket *s, socket_watch_flags flags, const std::function<void (std::error_code &)> *posted_fn = nullptr) {
             const system_socket_descriptor desc = s->native(); // Must be called before callbacks. If called after, the user may have closed the socket and erased the descriptor
             const socket_state original_state = s->state();
             std::error_code ec;
 
             s->did_write = false;
 
-            const bool attempt_read = (flags & WatchRead) || s->async_pending_read();
             const bool attempt_write = flags & WatchWrite;
+            const bool edge_triggered = watcher.edge_triggered();
+            const bool had_pending_write = s->async_pending_write();
+            bool attempt_read = false;
 
             if (!s->is_listening()) { // Ignore read/write events on accept()ing socket
-                if (attempt_write)
+                if (posted_fn)
+                    s->do_server_posted(ec, *posted_fn);
+
+                if (attempt_write && !s->is_null())
                     s->do_server_write(ec);
 
+                // Checked after the callbacks, since they may have resumed a paused socket
+                attempt_read = ((flags & WatchRead) || s->async_pending_read() || s->loop_read_deferred) && !s->async_read_paused();
+
                 if (attempt_read && !s->is_null()) {
-                    s->async_fill_read_buffer(ec); // Fill read buffer to minimize system calls
+                    s->loop_read_deferred = false;
 
                     do {
-                        s->do_server_read(ec);     // The read buffer is not filled during do_server_read
-                    } while (!s->is_null() && s->async_pending_read());
+                        s->async_fill_read_buffer(ec); // Fill read buffer to minimize system calls
+
+                        do {
+                            s->do_server_read(ec);     // The read buffer is not filled during do_server_read
+                        } while (!s->is_null() && s->async_pending_read() && !s->async_read_paused());
+                    } while (edge_triggered && !ec && !s->is_null() && !s->async_read_drained() && !s->async_read_paused()); // Edge-triggered events won't fire again for data left in the socket
                 }
+
+                if (s->async_read_paused())
+                    s->loop_read_deferred = true;
             }
 
             // Was it a hangup, or socket disconnected in callback? If so, unwatch and delete
@@ -147,19 +368,45 @@ namespace skate {
                 (s->state() != original_state && s->is_null())) {                       // Socket already was disconnected
                 s->do_server_disconnected(ec);
                 watcher.unwatch_dead_descriptor(ec, desc);
-                third_party_socket_map.erase(desc);
-                client_socket_map.erase(desc);
-            } else if (s->did_write) {                                                  // Data was queued to send, enable write watching
-                update_blocking(s, watcher.modify(ec, desc, WatchAll));
-            } else if ((flags & WatchWrite) && !s->did_write && !s->async_pending_write()) { // No data queued and no data sent, disable write watching
-                update_blocking(s, watcher.modify(ec, desc, WatchAll & ~WatchWrite));
-
-                if (s->async_closed_read() && s->async_closed_write())
-                    s->disconnect(ec);
-                else if (s->async_closed_read())
-                    s->shutdown(ec, socket_shutdown::read);
-                else if (s->async_closed_write())
-                    s->shutdown(ec, socket_shutdown::write);
+                erase_socket(s, desc);
+            } else if (edge_triggered) {                                                // Interest stays registered, so no watcher changes are needed
+                if ((had_pending_write || s->did_write) && !s->async_pending_write()) {    // Only act once, when pending writes finish
+                    if (s->async_closed_read() && s->async_closed_write())
+                        s->disconnect(ec);
+                    else if (s->async_closed_read())
+                        s->shutdown(ec, socket_shutdown::read);
+                    else if (s->async_closed_write())
+                        s->shutdown(ec, socket_shutdown::write);
+                }
+            } else {
+                // Level-triggered watchers keep reporting what they watch, so write interest is kept only while data is queued,
+                // and read interest is dropped while reading is paused
+                const bool write_done = (flags & WatchWrite) && !s->did_write && !s->async_pending_write(); // No data queued and no data sent
+                socket_watch_flags watching = s->loop_watching;
+
+                if (s->did_write)                                                       // Data was queued to send
+                    watching |= WatchWrite;
+                else if (write_done)
+                    watching &= ~WatchWrite;
+
+                if (s->async_read_paused())
+                    watching &= ~WatchRead;
+                else
+                    watching |= WatchRead;
+
+                if (watching != s->loop_watching) {
+                    update_blocking(s, watcher.modify(ec, desc, watching));
+                    s->loop_watching = watching;
+                }
+
+                if (write_done) {
+                    if (s->async_closed_read() && s->async_closed_write())
+                        s->disconnect(ec);
+                    else if (s->async_closed_read())
+                        s->shutdown(ec, socket_shutdown::read);
+                    else if (s->async_closed_write())
+                        s->shutdown(ec, socket_shutdown::write);
+                }
             }
 
             if (ec) {
@@ -171,6 +418,11 @@ namespace skate {
         std::error_code do_socket_init(socket *s) {
             std::error_code ec;
 
+            s->loop = this;
+            s->loop_generation = ++last_generation;
+            s->loop_watching = WatchAll;
+            s->loop_read_deferred = false;
+
             update_blocking(s, watcher.watch(ec, s->native(), WatchAll));
 
             if (ec) {
@@ -195,10 +447,102 @@ namespace skate {
         virtual void error(socket *, std::error_code ec) { std::cout << ec.message() << std::endl; }
 
     public:
-        socket_server() : canceled(false) {}
+        socket_server() : canceled(false), last_generation(0), workers_stopping(false) { create_wakeup(); }
         template<typename... Args>
-        explicit socket_server(Args&&... args) : watcher(std::forward<Args>(args)...), canceled(false) {}
-        virtual ~socket_server() {}
+        explicit socket_server(Args&&... args) : watcher(std::forward<Args>(args)...), canceled(false), last_generation(0), workers_stopping(false) { create_wakeup(); }
+        virtual ~socket_server() {
+            stop_workers();
+            destroy_wakeup();
+        }
+
+        // Sets the number of worker threads that run offload()ed work. With no workers, offload() runs work immediately
+        // Must not be called while offloaded work is being submitted
+        void set_worker_count(size_t count) {
+            stop_workers();
+
+            for (size_t i = 0; i < count; ++i) {
+                workers.emplace_back([this]() {
+                    while (true) {
+                        std::function<void ()> fn;
+
+                        {
+                            std::unique_lock<std::mutex> lock(work_mtx);
+                            work_cv.wait(lock, [this]() { return workers_stopping || !work.empty(); });
+
+                            if (work.empty()) // Only stop once all queued work is done
+                                return;
+
+                            fn = std::move(work.front());
+                            work.pop_front();
+                        }
+
+                        fn();
+                    }
+                });
+            }
+        }
+        size_t worker_count() const noexcept { return workers.size(); }
+
+        virtual void post(socket_event_target target, std::function<void (std::error_code &)> fn) override {
+            bool was_empty;
+
+            {
+                std::lock_guard<std::mutex> lock(posted_mtx);
+                was_empty = posted.empty();
+                posted.emplace_back(target, std::move(fn));
+            }
+
+            // Only the first post since the last run needs to wake the loop
+            if (was_empty)
+                signal_wakeup();
+        }
+
+        virtual timer_wheel::timer_id arm_timer(socket_event_target target, std::chrono::nanoseconds delay, std::function<void (std::error_code &)> fn) override {
+            socket *s = get_target(target);
+            if (!s)
+                return 0;
+
+            // Forget timers that already fired or were canceled, so the list stays short
+            s->loop_timers.erase(std::remove_if(s->loop_timers.begin(), s->loop_timers.end(), [this](timer_wheel::timer_id id) {
+                return !timers.is_armed(id);
+            }), s->loop_timers.end());
+
+            const timer_wheel::timer_id id = timers.arm(delay, [this, target, fn]() {
+                socket *s = get_target(target);
+                if (s && !s->is_listening())
+                    socket_nonaccept_event_occurred(s, 0, &fn);
+            });
+
+            s->loop_timers.push_back(id);
+
+            return id;
+        }
+        virtual bool reset_timer(timer_wheel::timer_id id, std::chrono::nanoseconds delay) override { return timers.reset(id, delay); }
+        virtual bool cancel_timer(timer_wheel::timer_id id) override { return timers.cancel(id); }
+
+        // Returns the pool that accepted sockets borrow buffer storage from
+        io_buffer_pool<char> &socket_buffer_pool() noexcept { return buffer_pool; }
+
+        // Returns the number of armed timers
+        size_t timer_count() const noexcept { return timers.size(); }
+
+        virtual void offload(socket_event_target target, std::function<void ()> fn, std::function<void (std::error_code &)> done) override {
+            if (workers.empty()) {
+                fn();
+                post(target, std::move(done));
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(work_mtx);
+                work.emplace_back([this, target, fn, done]() {
+                    fn();
+                    post(target, std::move(done));
+                });
+            }
+
+            work_cv.notify_one();
+        }
 
         // Add external socket to be watched by this server (any socket type works)
         void serve_socket(socket *s) {
@@ -206,7 +550,7 @@ namespace skate {
                 throw std::logic_error("Cannot serve a null socket");
 
             if (!do_socket_init(s))
-                third_party_socket_map[s->native()] = s;
+                sockets.insert_third_party(s->native(), s);
         }
 
         // Run this server, constantly polling for updates
@@ -216,14 +560,24 @@ namespace skate {
 #endif
         void run() {
             canceled = false;
-            while (!canceled && third_party_socket_map.size()) {
+            while (!canceled && sockets.third_party_count())
                 poll();
-                std::this_thread::yield();
-            }
+        }
+
+        // Run this server until canceled, waking at least once per interval to check for cancellation from another thread
+        // A poll that times out is not an error here
+#if WINDOWS_OS
+        template<typename W = system_watcher, typename std::enable_if<!std::is_same<W, WSAAsyncSelectWatcher>::value, bool>::type = true>
+#endif
+        void run(socket_timeout cancel_check_interval) {
+            while (!canceled && sockets.third_party_count())
+                poll(cancel_check_interval, false);
         }
 
         // Cancel a running server
+        // May be called from any thread, but a server blocked in run() without an interval only notices after its next event
         void cancel() { canceled = true; }
+        bool is_canceled() const noexcept { return canceled; }
 
         // Polls the set of socket descriptors for changes
         // listen(), poll(), and run() are the only non-reentrant function in this class
@@ -231,10 +585,28 @@ namespace skate {
 #if WINDOWS_OS
         template<typename W = system_watcher, typename std::enable_if<!std::is_same<W, WSAAsyncSelectWatcher>::value, bool>::type = true>
 #endif
-        void poll(socket_timeout timeout = socket_timeout::infinite()) {
+        // The wait is cut short when a timer is due, and timers are fired before returning. A wait cut short by a timer is not an error
+        void poll(socket_timeout timeout = socket_timeout::infinite(), bool timeout_is_error = true) {
             std::error_code ec;
 
+            // Wake in time for the next timer
+            bool timer_bound = false;
+            if (!timers.empty()) {
+                // Round up to whole milliseconds, since most watchers wait in milliseconds and truncating would wake early and spin until the timer is due
+                const auto next = std::chrono::duration_cast<std::chrono::milliseconds>(timers.next_timeout() + std::chrono::nanoseconds(999999));
+
+                if (timeout.is_infinite() || next < timeout.timeout()) {
+                    timeout = socket_timeout(next);
+                    timer_bound = true;
+                }
+            }
+
             watcher.poll(ec, [&](system_socket_descriptor desc, socket_watch_flags flags) {
+                if (desc == wakeup_read) {
+                    drain_wakeup();
+                    return;
+                }
+
                 auto socket = get_socket(desc);
                 if (!socket)
                     return; // Not being served by this server?
@@ -246,6 +618,12 @@ namespace skate {
                 }
             }, timeout);
 
+            run_posted();
+            timers.advance();
+
+            if ((timer_bound || !timeout_is_error) && ec == std::errc::timed_out)
+                return;
+
             if (ec) {
                 error(nullptr, ec);
 
@@ -284,6 +662,111 @@ namespace skate {
         }
 #endif
     };
+
+    // Runs several socket_server event loops, each on its own thread with its own watcher and set of client sockets
+    // Each loop gets its own listener bound with SO_REUSEPORT so the kernel spreads incoming connections across the loops,
+    // and a connection stays on the loop that accepted it for its whole lifetime
+    // If SO_REUSEPORT is not supported, only the first loop listens and the others stay idle
+    template<typename server_type = socket_server<impl::default_pool_socket_watcher>>
+    class socket_server_pool {
+        socket_server_pool(const socket_server_pool &) = delete;
+        socket_server_pool &operator=(const socket_server_pool &) = delete;
+
+        std::vector<std::unique_ptr<server_type>> loops;
+        std::vector<std::unique_ptr<socket>> listeners; // Owned listeners, each served by exactly one loop
+        std::vector<std::thread> threads;
+        socket_timeout cancel_check_interval;
+
+    public:
+        // Creates a pool of loop_count event loops, or one per hardware thread if loop_count is 0
+        // Loops check for cancellation at least once per cancel_check_interval
+        template<typename... Args>
+        explicit socket_server_pool(size_t loop_count = 0,
+                                    socket_timeout cancel_check_interval = socket_timeout(std::chrono::milliseconds(100)),
+                                    Args&&... args)
+            : cancel_check_interval(cancel_check_interval)
+        {
+            if (loop_count == 0)
+                loop_count = std::max(1u, std::thread::hardware_concurrency());
+
+            loops.reserve(loop_count);
+            for (size_t i = 0; i < loop_count; ++i)
+                loops.emplace_back(new server_type(args...));
+        }
+        virtual ~socket_server_pool() {
+            cancel();
+            join();
+        }
+
+        size_t size() const noexcept { return loops.size(); }
+        server_type &loop(size_t index) { return *loops.at(index); }
+
+        // Gives each loop count worker threads for offloaded work
+        void set_worker_count(size_t count) {
+            for (const auto &loop: loops)
+                loop->set_worker_count(count);
+        }
+
+        // Creates a nonblocking listener of type Socket per loop, bound to address, and serves each on its own loop
+        // Socket must derive from stream_socket and be default-constructible. Must be called before start()
+        template<typename Socket>
+        void listen(std::error_code &ec, socket_address address, int backlog = SOMAXCONN) {
+            listen<Socket>(ec, address, stream_listen_options(backlog));
+        }
+
+        // Creates listeners like listen(), applying options (backlog, TCP_DEFER_ACCEPT, TCP_FASTOPEN) to each
+        template<typename Socket>
+        void listen(std::error_code &ec, socket_address address, const stream_listen_options &options) {
+            if (ec)
+                return;
+
+            const size_t listener_count = Socket::supports_reuse_port()? loops.size(): 1;
+
+            for (size_t i = 0; i < listener_count && !ec; ++i) {
+                std::unique_ptr<Socket> listener{new Socket()};
+
+                listener->set_reuse_port(listener_count > 1);
+                listener->set_blocking(ec, false);
+                listener->bind(ec, address);
+                listener->listen(ec, options);
+
+                if (!ec) {
+                    loops[i]->serve_socket(listener.get());
+                    listeners.push_back(std::move(listener));
+                }
+            }
+        }
+
+        // Starts every loop on its own thread. Loops with nothing to serve exit immediately
+        void start() {
+            for (const auto &loop: loops) {
+                server_type *server = loop.get();
+
+                threads.emplace_back([server, this]() { server->run(cancel_check_interval); });
+            }
+        }
+
+        // Cancels every loop. Loops exit within one cancel check interval
+        void cancel() {
+            for (const auto &loop: loops)
+                loop->cancel();
+        }
+
+        // Waits for every loop thread to exit
+        void join() {
+            for (auto &thrd: threads)
+                if (thrd.joinable())
+                    thrd.join();
+
+            threads.clear();
+        }
+
+        // Starts the pool and blocks until every loop has exited
+        void run() {
+            start();
+            join();
+        }
+    };
 }
 
 #endif // SKATE_SERVER_H
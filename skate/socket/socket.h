@@ -8,6 +8,7 @@
 #define SKATE_SOCKET_H
 
 #include "address.h"
+#include "timer.h"
 #include "../io/buffer.h"
 #include "../containers/abstract_list.h"
 
@@ -25,6 +26,13 @@
 
 #if POSIX_OS
 # include <sys/ioctl.h>
+# include <sys/uio.h>
+# include <netinet/tcp.h>
+#endif
+
+#if LINUX_OS
+# include <sys/sendfile.h>
+# include <netinet/udp.h>
 #endif
 
 // See https://beej.us/guide/bgnet/html
@@ -114,11 +122,17 @@ namespace skate {
         }
 
         inline void socket_set_blocking(std::error_code &ec, system_socket_descriptor sock, bool b) noexcept {
+#if LINUX_OS
+            int opt = !b; // One system call instead of fcntl()'s get and set
+            if (!ec && ::ioctl(sock, FIONBIO, &opt) < 0)
+                ec = socket_error();
+#else
             if (!ec) {
                 const int flags = ::fcntl(sock, F_GETFL);
                 if (flags < 0 || ::fcntl(sock, F_SETFL, b? (flags & ~O_NONBLOCK): (flags | O_NONBLOCK)) < 0)
                     ec = socket_error();
             }
+#endif
         }
     }
 
@@ -176,6 +190,123 @@ namespace skate {
 # error Platform not supported
 #endif
 
+    namespace impl {
+        // Per-thread free lists of socket-sized memory blocks, so accepting and closing connections recycles socket objects instead of going to the heap each time
+        // Blocks are allocated individually rather than carved out of larger slabs, so a socket may be freed on a different thread than it was allocated on
+        class socket_allocator {
+            static constexpr size_t granularity = 64;           // Sizes are rounded up to a multiple of this
+            static constexpr size_t classes = 64;               // Sizes up to classes * granularity bytes are cached
+            static constexpr size_t max_free_per_class = 256;
+
+            struct free_block {
+                free_block *next;
+            };
+
+            struct cache {
+                cache() {
+                    std::fill(heads, heads + classes, nullptr);
+                    std::fill(counts, counts + classes, size_t(0));
+                }
+                ~cache() {
+                    for (size_t i = 0; i < classes; ++i) {
+                        while (heads[i]) {
+                            free_block *next = heads[i]->next;
+                            ::operator delete(heads[i]);
+                            heads[i] = next;
+                        }
+                    }
+
+                    destroyed() = true;
+                }
+
+                free_block *heads[classes];
+                size_t counts[classes];
+            };
+
+            // Set once the thread's cache is gone, so sockets destroyed later in thread (or program) shutdown go straight to the heap
+            static bool &destroyed() noexcept {
+                static thread_local bool d = false;
+                return d;
+            }
+
+            static cache &local() {
+                static thread_local cache c;
+                return c;
+            }
+
+            static size_t class_of(size_t size) noexcept { return (size + granularity - 1) / granularity - 1; }
+
+        public:
+            static void *allocate(size_t size) {
+                const size_t index = class_of(size);
+                if (index >= classes || destroyed())
+                    return ::operator new(size);
+
+                cache &c = local();
+                if (c.heads[index]) {
+                    free_block *block = c.heads[index];
+                    c.heads[index] = block->next;
+                    --c.counts[index];
+                    return block;
+                }
+
+                return ::operator new((index + 1) * granularity);
+            }
+
+            static void deallocate(void *p, size_t size) noexcept {
+                const size_t index = class_of(size);
+                if (!p)
+                    return;
+                else if (index >= classes || destroyed()) {
+                    ::operator delete(p);
+                    return;
+                }
+
+                cache &c = local();
+                if (c.counts[index] >= max_free_per_class) {
+                    ::operator delete(p);
+                    return;
+                }
+
+                free_block *block = static_cast<free_block *>(p);
+                block->next = c.heads[index];
+                c.heads[index] = block;
+                ++c.counts[index];
+            }
+        };
+    }
+
+    // Identifies a socket served by an event loop, from socket::event_target()
+    // Descriptors are reused once closed, so the generation tells a socket apart from a later one with the same descriptor
+    struct socket_event_target {
+        system_socket_descriptor desc;
+        uint64_t generation;
+    };
+
+    // Interface to the event loop serving a socket, for work that runs off the loop's thread
+    class socket_event_loop {
+    public:
+        virtual ~socket_event_loop() {}
+
+        // Runs fn on the loop's thread for the target socket, handled like an event on that socket. May be called from any thread
+        // fn is dropped if the socket is no longer served when the loop gets to it. Errors set by fn are reported to the socket
+        virtual void post(socket_event_target target, std::function<void (std::error_code &)> fn) = 0;
+
+        // Runs work on one of the loop's worker threads, then posts done for the target socket
+        // If the loop has no worker threads, work runs on the calling thread. May be called from any thread
+        virtual void offload(socket_event_target target, std::function<void ()> work, std::function<void (std::error_code &)> done) = 0;
+
+        // Arms a timer that runs fn on the loop's thread for the target socket after delay, handled like an event on that socket
+        // The socket's timers are canceled when it stops being served. Returns 0 if the socket isn't served. Must only be called from the loop's thread
+        virtual timer_wheel::timer_id arm_timer(socket_event_target target, std::chrono::nanoseconds delay, std::function<void (std::error_code &)> fn) = 0;
+
+        // Changes the delay of an armed timer, counted from now. Returns false if the timer already fired or was canceled
+        virtual bool reset_timer(timer_wheel::timer_id id, std::chrono::nanoseconds delay) = 0;
+
+        // Cancels an armed timer. Returns false if the timer already fired or was canceled
+        virtual bool cancel_timer(timer_wheel::timer_id id) = 0;
+    };
+
     // A base socket class
     // Subclasses must do the following:
     //   - Set socket::did_write to true immediately when the socket object is written to, whether or not the write actually succeeded
@@ -216,10 +347,27 @@ namespace skate {
             if (ec)
                 error(ec);
         }
+        void do_server_posted(std::error_code &ec, const std::function<void (std::error_code &)> &fn) {
+            if (!ec)
+                fn(ec);
+
+            if (ec)
+                error(ec);
+        }
+
+        socket_event_loop *loop; // Event loop serving this socket, if any
+        uint64_t loop_generation; // Set by the loop when it starts serving this socket
+        std::vector<timer_wheel::timer_id> loop_timers; // Timers the loop has armed for this socket, some possibly already fired
+        uint8_t loop_watching; // socket_watch_flags the loop's watcher is watching for on this socket
+        bool loop_read_deferred; // Whether reading was skipped while paused, so data may be waiting once resumed
 
     protected:
         socket(system_socket_descriptor sock, socket_state current_state, bool is_blocking) noexcept
-            : did_write(false)
+            : loop(nullptr)
+            , loop_generation(0)
+            , loop_watching(0)
+            , loop_read_deferred(false)
+            , did_write(false)
             , sock(sock)
             , s(current_state)
             , blocking(is_blocking)
@@ -233,7 +381,15 @@ namespace skate {
         virtual void disconnected(std::error_code &) {}
         virtual void error(std::error_code) {}
 
+        // Called by a socket_server to have the socket borrow buffer storage from a pool owned by the server, instead of keeping its own
+        // The pool outlives the socket. Sockets without byte buffers ignore it
+        virtual void set_buffer_pool(io_buffer_pool<char> *) {}
+
     public:
+        // Socket objects are recycled through impl::socket_allocator. The virtual destructor ensures the size passed to delete is that of the full object
+        static void *operator new(size_t size) { return impl::socket_allocator::allocate(size); }
+        static void operator delete(void *p, size_t size) noexcept { impl::socket_allocator::deallocate(p, size); }
+
         socket() : socket(impl::system_invalid_socket_value, socket_state::invalid, true) {}
         virtual ~socket() {
             if (sock != impl::system_invalid_socket_value)
@@ -252,6 +408,12 @@ namespace skate {
 
         bool is_blocking() const noexcept { return blocking; }
 
+        // Returns the event loop serving this socket, or null if it isn't served by a socket_server
+        socket_event_loop *event_loop() const noexcept { return loop; }
+
+        // Returns the handle to pass to event_loop() functions for this socket
+        socket_event_target event_target() const noexcept { return { sock, loop_generation }; }
+
         // Returns remote address information (only if connected)
         // port is in native byte order, and is indeterminate if an error occurs
         socket_address remote_address(std::error_code &ec) const {
@@ -407,6 +569,12 @@ namespace skate {
         virtual bool async_closed_read() const = 0;
         // Must return true if write stream is closed
         virtual bool async_closed_write() const = 0;
+        // Must return false if the last async_fill_read_buffer() stopped before the native socket ran out of data (e.g. the read buffer was full)
+        // Edge-triggered watchers rely on this to know whether another fill is needed, since they won't signal the same data again
+        virtual bool async_read_drained() const { return true; }
+        // May return true while the socket can't take more input, so a server stops reading from it (and stops watching it for reads)
+        // Reading resumes after the next event on the socket (e.g. a posted function) that finds it no longer paused
+        virtual bool async_read_paused() const { return false; }
 
         // Factory to create another socket with this type and protocol, specifically for accepting new connections
         // May return null if creating a new socket is not supported (the default)
@@ -478,22 +646,198 @@ namespace skate {
         bool blocking;
     };
 
+    // An open file descriptor shared between its owners, e.g. an HTTP response and the socket sending it
+    // Use make_shared_file() to create one that closes the descriptor when the last owner releases it
+    typedef std::shared_ptr<const int> shared_file;
+
+#if POSIX_OS
+    // Takes ownership of fd, which is closed once the last copy of the result is destroyed. Returns null if fd is invalid
+    inline shared_file make_shared_file(int fd) {
+        if (fd < 0)
+            return {};
+
+        try {
+            return shared_file(new int(fd), [](const int *p) { ::close(*p); delete p; });
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+    }
+#endif
+
+    // A block of data to send with stream_socket::write_vectored()
+    // Owns its data, either by taking a string or by sharing one, so the socket can queue it without copying
+    // May instead refer to a range of an open file, which is sent without passing through user space where possible
+    class socket_write_buffer {
+        std::shared_ptr<const std::string> owner;
+        shared_file file_owner;
+        const char *ptr;
+        size_t len;
+        int file;          // File descriptor if this refers to a file range, -1 otherwise
+        uint64_t offset;   // Offset of the next byte to send from file
+
+    public:
+        socket_write_buffer(std::string data)
+            : owner(std::make_shared<const std::string>(std::move(data)))
+            , ptr(owner->data())
+            , len(owner->size())
+            , file(-1)
+            , offset(0)
+        {}
+        socket_write_buffer(std::shared_ptr<const std::string> data)
+            : owner(std::move(data))
+            , ptr(owner? owner->data(): nullptr)
+            , len(owner? owner->size(): 0)
+            , file(-1)
+            , offset(0)
+        {}
+
+        // Refers to data that is not owned, which must stay valid until the socket has sent it (e.g. a string literal)
+        static socket_write_buffer unowned(const char *data, size_t len) { return socket_write_buffer(data, len, -1, 0); }
+
+        // Refers to length bytes of an open file starting at offset. The descriptor is not owned and must stay open until the socket has sent it
+        static socket_write_buffer file_range(int fd, uint64_t offset, size_t length) { return socket_write_buffer(nullptr, length, fd, offset); }
+
+        // Refers to length bytes of a shared file starting at offset. The buffer keeps the file open until it is destroyed
+        static socket_write_buffer file_range(shared_file file, uint64_t offset, size_t length) {
+            socket_write_buffer buffer(nullptr, length, file? *file: -1, offset);
+            buffer.file_owner = std::move(file);
+            return buffer;
+        }
+
+        const char *data() const noexcept { return ptr; }
+        size_t size() const noexcept { return len; }
+        bool empty() const noexcept { return len == 0; }
+
+        bool is_file() const noexcept { return file >= 0; }
+        int file_descriptor() const noexcept { return file; }
+        uint64_t file_offset() const noexcept { return offset; }
+
+        // Removes count bytes from the front of the buffer
+        void consume(size_t count) noexcept {
+            if (is_file())
+                offset += count;
+            else
+                ptr += count;
+
+            len -= count;
+        }
+
+    private:
+        socket_write_buffer(const char *data, size_t len, int file, uint64_t offset) : ptr(data), len(len), file(file), offset(offset) {}
+    };
+
+    // Options applied by stream_socket::listen() to a bound socket
+    struct stream_listen_options {
+        stream_listen_options(int backlog = SOMAXCONN) : backlog(backlog), defer_accept(0), fast_open_queue(0) {}
+
+        int backlog;                        // Maximum number of connections waiting to be accepted
+        std::chrono::seconds defer_accept;  // If nonzero, connections are only reported once they have data to read, or after this long (TCP_DEFER_ACCEPT, Linux only)
+        int fast_open_queue;                // If nonzero, accepts data in the SYN of up to this many pending connections (TCP_FASTOPEN)
+    };
+
     class stream_socket : public socket {
         constexpr static const size_t READ_BUFFER_SIZE = 4096;
+        constexpr static const size_t MAX_VECTORED_BUFFERS = 64; // Most buffers passed to the kernel in one write
 
     protected:
         stream_socket(system_socket_descriptor s, socket_state current_state, bool is_blocking)
             : socket(s, current_state, is_blocking)
+            , write_queue_bytes(0)
+            , write_high_mark(0)
+            , write_low_mark(0)
+            , write_paused_state(false)
+            , reuse_port(false)
+            , read_drained(true)
         {}
 
+        // Called when write_bytes_pending() reaches the high watermark. Producers should stop writing until writable() is called
+        virtual void write_paused(std::error_code &) {}
+
+        // Called when pending writes that reached the high watermark have drained to the low watermark
+        virtual void writable(std::error_code &) {}
+
     public:
-        stream_socket() {}
+        stream_socket() : write_queue_bytes(0), write_high_mark(0), write_low_mark(0), write_paused_state(false), reuse_port(false), read_drained(true) {}
         virtual ~stream_socket() {}
 
         virtual socket_type type() const noexcept final { return socket_type::stream; }
 
         void set_read_limit(size_t limit) noexcept { read_buffer.set_max_size(limit); }
 
+        // Returns true if the platform can bind several listening sockets to the same address and balance incoming connections across them
+        static constexpr bool supports_reuse_port() noexcept {
+#if LINUX_OS && defined(SO_REUSEPORT)
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Sets whether SO_REUSEPORT is enabled when the socket is bound. Must be called before bind() to have any effect
+        // Ignored if the platform doesn't support it (see supports_reuse_port())
+        void set_reuse_port(bool b) noexcept { reuse_port = b; }
+        bool is_reuse_port() const noexcept { return reuse_port; }
+
+        // Returns true if the platform supports stream_listen_options::defer_accept
+        static constexpr bool supports_defer_accept() noexcept {
+#if LINUX_OS && defined(TCP_DEFER_ACCEPT)
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Returns true if the platform supports stream_listen_options::fast_open_queue
+        static constexpr bool supports_fast_open() noexcept {
+#if LINUX_OS && defined(TCP_FASTOPEN)
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Starts a bound socket listening for connections with the given options
+        // Fails with operation_not_supported if an option that is set isn't supported on this platform
+        using socket::listen;
+        void listen(std::error_code &ec, const stream_listen_options &options) {
+            if (ec)
+                return;
+
+            if (state() != socket_state::bound) {
+                ec = std::make_error_code(std::errc::not_connected);
+                return;
+            }
+
+            if (options.defer_accept.count() > 0) {
+#if LINUX_OS && defined(TCP_DEFER_ACCEPT)
+                const int value = int(std::min<std::chrono::seconds::rep>(options.defer_accept.count(), INT_MAX));
+                if (::setsockopt(native(), IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value)) < 0) {
+                    ec = impl::socket_error();
+                    return;
+                }
+#else
+                ec = std::make_error_code(std::errc::operation_not_supported);
+                return;
+#endif
+            }
+
+            if (options.fast_open_queue > 0) { // Must be set before listen()
+#if LINUX_OS && defined(TCP_FASTOPEN)
+                const int value = options.fast_open_queue;
+                if (::setsockopt(native(), IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value)) < 0) {
+                    ec = impl::socket_error();
+                    return;
+                }
+#else
+                ec = std::make_error_code(std::errc::operation_not_supported);
+                return;
+#endif
+            }
+
+            socket::listen(ec, options.backlog);
+        }
+
         // Read data from the socket, up to max bytes, and returns the number of bytes read
         // If the socket is blocking it will wait until exactly max bytes are read, unless an error occurs
         // Reads any data that was buffered in the socket first, then reads directly from the socket
@@ -583,15 +927,19 @@ namespace skate {
             if (ec || is_blocking())
                 return;
 
-            // Read directly from the socket into a temporary buffer
-            std::array<char, READ_BUFFER_SIZE> buf;
-
-            size_t bytes_read = 0;
+            // Read directly from the socket into free space in the read buffer, without an intermediate copy
+            size_t bytes_read = 0, requested = 0;
             do {
-                bytes_read = direct_read(ec, buf.data(), std::min(buf.size(), read_buffer.free_space()));
+                const io_buffer_span<char> span = read_buffer.reserve_write(READ_BUFFER_SIZE)[0];
 
-                read_buffer.write(buf.data(), buf.data() + bytes_read);
-            } while (bytes_read == buf.size() && !ec);
+                requested = span.size();
+                bytes_read = direct_read(ec, span.data, requested);
+
+                read_buffer.commit_write(bytes_read);
+            } while (requested && bytes_read == requested && !ec);
+
+            // A short read means the socket ran dry (or errored), a full read means the read buffer limit stopped it
+            read_drained = ec || bytes_read < requested;
         }
 
         // Write data to the socket
@@ -610,13 +958,23 @@ namespace skate {
             if (write_buffer.read_all([&](const char *data, size_t len) { return direct_write(ec, data, len); }) == buffered) {
                 // ec must be valid if all data was written
 
+                // Queued vectored writes come before the new data
+                flush_write_queue(ec);
+
                 // Attempt direct write of new data
-                written_from_new_buffer = direct_write(ec, data, len);
+                if (write_queue.empty())
+                    written_from_new_buffer = direct_write(ec, data, len);
             }
 
-            // Any data that didn't get sent, add to the write buffer
-            if (written_from_new_buffer != len)
-                write_buffer.write(data + written_from_new_buffer, data + len);
+            // Any data that didn't get sent, add to the write buffer, or behind the queued buffers to keep the order
+            if (written_from_new_buffer != len) {
+                if (write_queue.empty())
+                    write_buffer.write(data + written_from_new_buffer, data + len);
+                else
+                    enqueue_write(std::string(data + written_from_new_buffer, data + len));
+            }
+
+            update_write_watermarks(ec);
         }
         void write(std::error_code &ec, const char *str) {
             write(ec, str, strlen(str));
@@ -628,16 +986,68 @@ namespace skate {
             write(ec, &c, 1);
         }
 
+        // Write several buffers to the socket with as few system calls as possible (writev()/sendmsg() where available)
+        // Buffers that couldn't be sent immediately are queued as-is instead of being copied into the write buffer
+        // The error code is set to success if the socket couldn't accept more data immediately
+        void write_vectored(std::error_code &ec, std::vector<socket_write_buffer> buffers) {
+            if (ec)
+                return;
+
+            socket::did_write = true;
+
+            for (auto &buffer: buffers)
+                if (!buffer.empty())
+                    enqueue_write(std::move(buffer));
+
+            // Everything in write_buffer is older than the queue, so it must go first
+            const size_t buffered = write_buffer.size();
+            if (write_buffer.read_all([&](const char *data, size_t len) { return direct_write(ec, data, len); }) == buffered)
+                flush_write_queue(ec);
+
+            update_write_watermarks(ec);
+        }
+
+        // Send length bytes of an open file, starting at offset, with sendfile() where available so the data never passes through user space
+        // The transfer is queued behind any pending writes and continues asynchronously whenever the socket becomes writable
+        // The file descriptor is not owned and must stay open until the transfer completes (see write_bytes_pending())
+        // The error code is set to success if the socket couldn't accept more data immediately
+        void send_file(std::error_code &ec, int fd, uint64_t offset, uint64_t length) {
+            if (ec)
+                return;
+
+            if (fd < 0 || length > SIZE_MAX) {
+                ec = std::make_error_code(std::errc::invalid_argument);
+                return;
+            }
+
+            send_file_range(ec, socket_write_buffer::file_range(fd, offset, size_t(length)));
+        }
+
+        // As above, but the socket shares ownership of the file until the transfer completes or the socket is destroyed
+        // The file may be closed by the caller's last copy being released at any time without interrupting the transfer
+        void send_file(std::error_code &ec, shared_file file, uint64_t offset, uint64_t length) {
+            if (ec)
+                return;
+
+            if (!file || *file < 0 || length > SIZE_MAX) {
+                ec = std::make_error_code(std::errc::invalid_argument);
+                return;
+            }
+
+            send_file_range(ec, socket_write_buffer::file_range(std::move(file), offset, size_t(length)));
+        }
+
         // Attempt to flush the write buffer
         virtual void async_flush_write_buffer(std::error_code &ec) override {
-            if (write_buffer.size())
+            if (write_buffer.size() || write_queue.size())
                 write(ec, nullptr, 0);
         }
 
         virtual bool async_pending_read() const override { return read_buffer.size(); }
         virtual bool async_closed_read() const override { return read_buffer.is_closed(); }
-        virtual bool async_pending_write() const override { return write_buffer.size(); }
+        virtual bool async_pending_write() const override { return write_buffer.size() || write_queue.size(); }
         virtual bool async_closed_write() const override { return write_buffer.is_closed(); }
+        virtual bool async_read_drained() const override { return read_drained; }
 
         using socket::connect_sync; // Import so overloads are available, see https://stackoverflow.com/questions/1628768/why-does-an-overridden-function-in-the-derived-class-hide-other-overloads-of-the?rq=1
         virtual void connect_sync(std::error_code &ec, socket_address remote) override {
@@ -665,9 +1075,24 @@ namespace skate {
             direct_bind(ec, local, false);
         }
 
-        size_t write_bytes_pending() const noexcept { return write_buffer.size(); }
+        size_t write_bytes_pending() const noexcept { return write_buffer.size() + write_queue_bytes; }
         size_t read_bytes_pending() const noexcept { return read_buffer.size(); }
 
+        // Sets the watermarks for write_paused() and writable(). A high watermark of 0 (the default) disables them
+        // Writes are still accepted past the high watermark, it is up to the producer to stop
+        void set_write_watermarks(size_t high, size_t low) noexcept {
+            write_high_mark = high;
+            write_low_mark = std::min(low, high);
+        }
+        size_t write_high_watermark() const noexcept { return write_high_mark; }
+        size_t write_low_watermark() const noexcept { return write_low_mark; }
+
+        // Returns true if write_paused() was called and writable() hasn't been called since
+        bool is_write_paused() const noexcept { return write_paused_state; }
+
+        // Prevents further writes. Once all pending data has been sent, a socket_server shuts down the write side of the socket
+        void close_write_when_flushed() noexcept { write_buffer.close(); }
+
     protected:
         // Synchronously binds to a local address or connects to a remote address
         void direct_bind(std::error_code &ec, socket_address address, bool address_is_remote) noexcept {
@@ -689,6 +1114,9 @@ namespace skate {
                 ec = impl::socket_error();
             } else if (address_is_remote? ::connect(sock, address.native(), address.native_length()) < 0:
                        (::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes)) < 0 ||
+#if LINUX_OS && defined(SO_REUSEPORT)
+                        (reuse_port && ::setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&yes), sizeof(yes)) < 0) ||
+#endif
                         ::bind(sock, address.native(), address.native_length()) < 0)) {
                 ec = impl::socket_error();
 
@@ -768,8 +1196,203 @@ namespace skate {
             return original_size;
         }
 
-        io_buffer<char> write_buffer; // Outgoing buffer awaiting sending
-        io_buffer<char> read_buffer;  // Incoming buffer awaiting reading
+#if POSIX_OS
+        // Write several buffers directly to the socket, and return the number of bytes written
+        // Returns a "would block" error if the operation would block
+        size_t direct_write_vectored(std::error_code &ec, struct iovec *iov, size_t count) {
+            if (!is_connected() && !is_bound()) {
+                ec = std::make_error_code(std::errc::not_connected);
+                return 0;
+            }
+
+            size_t total = 0;
+            while (count) {
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+
+                const ssize_t sent = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    ec = impl::socket_error();
+
+                    // Ignore "would block" errors for stream sockets
+                    if (impl::socket_would_block(ec))
+                        ec.clear();
+
+                    return total;
+                }
+
+                total += sent;
+
+                // Skip fully sent buffers and adjust a partially sent one
+                size_t remaining = sent;
+                while (count && remaining >= iov->iov_len) {
+                    remaining -= iov->iov_len;
+                    ++iov;
+                    --count;
+                }
+
+                if (count) {
+                    iov->iov_base = static_cast<char *>(iov->iov_base) + remaining;
+                    iov->iov_len -= remaining;
+                }
+            }
+
+            ec.clear();
+            return total;
+        }
+#endif
+
+        // Calls write_paused() or writable() if pending writes crossed a watermark
+        void update_write_watermarks(std::error_code &ec) {
+            if (ec || write_high_mark == 0)
+                return;
+
+            const size_t pending = write_bytes_pending();
+
+            if (!write_paused_state && pending >= write_high_mark) {
+                write_paused_state = true;
+                write_paused(ec);
+            } else if (write_paused_state && pending <= write_low_mark) {
+                write_paused_state = false;
+                writable(ec);
+            }
+        }
+
+        void send_file_range(std::error_code &ec, socket_write_buffer buffer) {
+#if POSIX_OS
+            std::vector<socket_write_buffer> buffers;
+            buffers.push_back(std::move(buffer));
+
+            write_vectored(ec, std::move(buffers));
+#else
+            (void) buffer;
+            ec = std::make_error_code(std::errc::function_not_supported);
+#endif
+        }
+
+        void enqueue_write(socket_write_buffer buffer) {
+            write_queue_bytes += buffer.size();
+            write_queue.push_back(std::move(buffer));
+        }
+
+        // Sends as much of the write queue as the socket accepts, removing sent buffers from the queue
+        void flush_write_queue(std::error_code &ec) {
+            while (!ec && !write_queue.empty()) {
+                size_t count = 0;
+                size_t requested = 0;
+
+#if POSIX_OS
+                struct iovec iov[MAX_VECTORED_BUFFERS];
+                size_t written = 0;
+
+                if (write_queue.front().is_file()) {
+                    const socket_write_buffer &front = write_queue.front();
+
+                    requested = front.size();
+                    written = direct_send_file(ec, front.file_descriptor(), front.file_offset(), front.size());
+                } else {
+                    // Gather in-memory buffers up to the next file range
+                    for (; count < std::min(write_queue.size(), MAX_VECTORED_BUFFERS) && !write_queue[count].is_file(); ++count) {
+                        iov[count].iov_base = const_cast<char *>(write_queue[count].data());
+                        iov[count].iov_len = write_queue[count].size();
+                        requested += write_queue[count].size();
+                    }
+
+                    written = direct_write_vectored(ec, iov, count);
+                }
+#else
+                count = std::min(write_queue.size(), MAX_VECTORED_BUFFERS);
+
+                size_t written = 0;
+
+                for (size_t i = 0; i < count && written == requested; ++i) {
+                    requested += write_queue[i].size();
+                    written += direct_write(ec, write_queue[i].data(), write_queue[i].size());
+                }
+#endif
+
+                write_queue_bytes -= written;
+                for (size_t remaining = written; remaining; ) {
+                    socket_write_buffer &front = write_queue.front();
+
+                    if (front.size() > remaining) {
+                        front.consume(remaining);
+                        break;
+                    }
+
+                    remaining -= front.size();
+                    write_queue.pop_front();
+                }
+
+                if (written != requested)
+                    break; // Socket couldn't take everything
+            }
+        }
+
+#if POSIX_OS
+        // Send part of a file directly to the socket, and return the number of bytes written
+        // Returns a "would block" error if the operation would block
+        size_t direct_send_file(std::error_code &ec, int fd, uint64_t offset, size_t len) {
+            if (!is_connected() && !is_bound()) {
+                ec = std::make_error_code(std::errc::not_connected);
+                return 0;
+            }
+
+            const size_t original_size = len;
+            while (len) {
+# if LINUX_OS
+                off_t file_offset = off_t(offset);
+                const ssize_t sent = ::sendfile(sock, fd, &file_offset, std::min<size_t>(len, 0x7ffff000));
+# else
+                // No zero-copy path, so copy through a temporary buffer
+                std::array<char, 65536> buf;
+                const ssize_t file_read = ::pread(fd, buf.data(), std::min(len, buf.size()), off_t(offset));
+                if (file_read < 0) {
+                    ec = std::error_code(errno, std::system_category());
+                    return original_size - len;
+                }
+
+                const ssize_t sent = file_read == 0? 0: ::send(sock, buf.data(), size_t(file_read), MSG_NOSIGNAL);
+# endif
+                if (sent < 0) {
+                    ec = impl::socket_error();
+
+                    // Ignore "would block" errors for stream sockets
+                    if (impl::socket_would_block(ec))
+                        ec.clear();
+
+                    return original_size - len;
+                } else if (sent == 0) {
+                    // File ended before the requested length was sent
+                    ec = std::make_error_code(std::errc::io_error);
+                    return original_size - len;
+                }
+
+                offset += sent;
+                len -= sent;
+            }
+
+            ec.clear();
+            return original_size;
+        }
+#endif
+
+        virtual void set_buffer_pool(io_buffer_pool<char> *pool) override {
+            read_buffer.set_pool(pool);
+            write_buffer.set_pool(pool);
+        }
+
+        io_buffer<char> write_buffer;                 // Outgoing buffer awaiting sending
+        io_buffer<char> read_buffer;                  // Incoming buffer awaiting reading
+        std::deque<socket_write_buffer> write_queue;  // Outgoing buffers from write_vectored() awaiting sending, always sent after write_buffer
+        size_t write_queue_bytes;                     // Total bytes in write_queue
+        size_t write_high_mark;                       // Pending write bytes at which write_paused() is called, or 0 if disabled
+        size_t write_low_mark;                        // Pending write bytes at which writable() is called after pausing
+        bool write_paused_state;                      // Whether write_paused() was called without a matching writable()
+        bool reuse_port;                              // Whether SO_REUSEPORT is set on the socket when bound
+        bool read_drained;                            // Whether the last buffer fill read everything available on the socket
     };
 
     class socket_datagram {
@@ -1073,13 +1696,299 @@ namespace skate {
         virtual std::unique_ptr<socket> create(system_socket_descriptor desc, socket_state current_state, bool is_blocking) override { return std::unique_ptr<socket>{new tcp_socket(desc, current_state, is_blocking)}; }
     };
 
+    // One receive slot for udp_socket::read_datagrams(), backed by caller-owned storage that can be reused between batches
+    struct udp_receive_slot {
+        udp_receive_slot() : data(nullptr), capacity(0), size(0), segment_size(0), truncated(false) {}
+        udp_receive_slot(char *data, size_t capacity) : data(data), capacity(capacity), size(0), segment_size(0), truncated(false) {}
+
+        char *data;             // Caller-owned storage for the datagram
+        size_t capacity;        // Size of the storage
+        size_t size;            // Number of bytes received
+        size_t segment_size;    // If receive coalescing merged several datagrams into this slot, the size of each (the last may be shorter), otherwise 0
+        bool truncated;         // Whether the datagram was larger than the storage and was cut off
+        socket_address remote;  // Sender of the datagram
+    };
+
+    // One datagram for udp_socket::write_datagrams(). If remote is unspecified, the datagram is sent to the connected address
+    struct udp_send_datagram {
+        udp_send_datagram() : data(nullptr), size(0) {}
+        udp_send_datagram(const char *data, size_t size, socket_address remote = {}) : data(data), size(size), remote(remote) {}
+
+        const char *data;
+        size_t size;
+        socket_address remote;
+    };
+
     class udp_socket : public datagram_socket {
+        constexpr static const size_t MAX_BATCH = 64; // Most datagrams passed to the kernel in one system call
+
     public:
         virtual ~udp_socket() {}
 
         virtual socket_protocol protocol() const noexcept override { return socket_protocol::udp; }
 
         virtual std::unique_ptr<socket> create(system_socket_descriptor, socket_state, bool) override { return {}; }
+
+        // Returns true if the platform supports segmentation offload (UDP_SEGMENT) and receive coalescing (UDP_GRO)
+        static constexpr bool supports_offload() noexcept {
+#if LINUX_OS && defined(UDP_SEGMENT) && defined(UDP_GRO)
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Enables receive coalescing, where the kernel may merge consecutive datagrams of equal size from one sender into a single slot
+        // See udp_receive_slot::segment_size for how to split them again
+        void set_receive_coalescing(std::error_code &ec, bool enable) noexcept {
+            if (ec)
+                return;
+
+#if LINUX_OS && defined(UDP_GRO)
+            const int value = enable;
+            if (::setsockopt(sock, IPPROTO_UDP, UDP_GRO, &value, sizeof(value)) < 0)
+                ec = impl::socket_error();
+#else
+            if (enable)
+                ec = std::make_error_code(std::errc::function_not_supported);
+#endif
+        }
+
+        // Sets the segment size for segmentation offload, so one large write is split into datagrams of this size by the kernel or NIC
+        // A size of 0 disables segmentation
+        void set_send_segment_size(std::error_code &ec, uint16_t size) noexcept {
+            if (ec)
+                return;
+
+#if LINUX_OS && defined(UDP_SEGMENT)
+            const int value = size;
+            if (::setsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &value, sizeof(value)) < 0)
+                ec = impl::socket_error();
+#else
+            if (size)
+                ec = std::make_error_code(std::errc::function_not_supported);
+#endif
+        }
+
+        // Receives up to count datagrams into the provided slots, and returns the number of slots filled
+        // Bypasses the read buffer. Uses recvmmsg() where available to receive many datagrams per system call
+        // If the socket is blocking, waits for at least one datagram. The error code is set to success if no more datagrams were available immediately
+        size_t read_datagrams(std::error_code &ec, udp_receive_slot *slots, size_t count) {
+            if (ec)
+                return 0;
+
+            const size_t received = direct_read_datagrams(ec, slots, count);
+
+            if (impl::socket_would_block(ec))
+                ec.clear();
+
+            return received;
+        }
+
+        // Sends up to count datagrams, and returns the number actually sent
+        // Any datagrams already buffered are sent first. Uses sendmmsg() where available to send many datagrams per system call
+        // The error code is set to success if the socket couldn't accept more datagrams immediately
+        size_t write_datagrams(std::error_code &ec, const udp_send_datagram *datagrams, size_t count) {
+            if (ec)
+                return 0;
+
+            socket::did_write = true;
+            async_flush_write_buffer(ec);
+
+            // Datagrams still buffered after the flush (the socket would block) must not be overtaken by new ones
+            if (ec || write_buffer.size())
+                return 0;
+
+            const size_t sent = direct_write_datagrams(ec, datagrams, count);
+
+            if (impl::socket_would_block(ec))
+                ec.clear();
+
+            return sent;
+        }
+
+#if LINUX_OS
+        // Flushes buffered datagrams in batches
+        virtual void async_flush_write_buffer(std::error_code &ec) override {
+            if (ec)
+                return;
+
+            write_buffer.read_all([&](const socket_datagram *datagrams, size_t total_datagrams) {
+                std::array<udp_send_datagram, MAX_BATCH> batch;
+                size_t sent = 0;
+
+                while (sent < total_datagrams) {
+                    const size_t n = std::min(total_datagrams - sent, batch.size());
+
+                    for (size_t i = 0; i < n; ++i)
+                        batch[i] = udp_send_datagram(datagrams[sent + i].data().data(), datagrams[sent + i].data().size(), datagrams[sent + i].remote_address());
+
+                    const size_t batch_sent = direct_write_datagrams(ec, batch.data(), n);
+                    sent += batch_sent;
+
+                    if (batch_sent != n)
+                        break; // Error occured, so break early
+                }
+
+                return sent;
+            });
+
+            if (impl::socket_would_block(ec))
+                ec.clear();
+        }
+#endif
+
+    protected:
+        // Receive datagrams directly from the socket, and return the number received
+        // Returns a "would block" error if nothing could be received without blocking
+        size_t direct_read_datagrams(std::error_code &ec, udp_receive_slot *slots, size_t count) {
+            if (!is_connected() && !is_bound()) {
+                ec = std::make_error_code(std::errc::not_connected);
+                return 0;
+            }
+
+            size_t received = 0;
+
+#if LINUX_OS
+            while (received < count) {
+                const size_t n = std::min(count - received, MAX_BATCH);
+
+                struct mmsghdr msgs[MAX_BATCH];
+                struct iovec iov[MAX_BATCH];
+                struct sockaddr_storage addresses[MAX_BATCH];
+                union {
+                    char buf[CMSG_SPACE(sizeof(int))];
+                    struct cmsghdr align;
+                } control[MAX_BATCH];
+
+                memset(msgs, 0, sizeof(*msgs) * n);
+                for (size_t i = 0; i < n; ++i) {
+                    iov[i].iov_base = slots[received + i].data;
+                    iov[i].iov_len = slots[received + i].capacity;
+                    addresses[i].ss_family = AF_UNSPEC;
+
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                    msgs[i].msg_hdr.msg_name = &addresses[i];
+                    msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+                    msgs[i].msg_hdr.msg_control = control[i].buf;
+                    msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+                }
+
+                // Only the first batch may block, and then only until one datagram arrives
+                const int result = ::recvmmsg(sock, msgs, unsigned(n), received? MSG_DONTWAIT: MSG_WAITFORONE, nullptr);
+                if (result < 0) {
+                    if (!received)
+                        ec = impl::socket_error();
+                    break;
+                }
+
+                for (int i = 0; i < result; ++i) {
+                    udp_receive_slot &slot = slots[received + i];
+
+                    slot.size = msgs[i].msg_len;
+                    slot.truncated = msgs[i].msg_hdr.msg_flags & MSG_TRUNC;
+                    slot.remote = socket_address(addresses[i]);
+                    slot.segment_size = 0;
+
+# if defined(UDP_GRO)
+                    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+                        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                            int segment_size = 0;
+                            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                            slot.segment_size = segment_size > 0 && size_t(segment_size) < slot.size? size_t(segment_size): 0;
+                        }
+                    }
+# endif
+                }
+
+                received += result;
+                if (size_t(result) != n)
+                    break;
+            }
+#else
+            for (; received < count; ++received) {
+                udp_receive_slot &slot = slots[received];
+
+                slot.size = direct_read_from(ec, slot.data, slot.capacity, slot.remote);
+                slot.truncated = false;
+                slot.segment_size = 0;
+
+                if (ec) {
+                    if (received)
+                        ec.clear();
+                    break;
+                }
+            }
+#endif
+
+            if (received)
+                ec.clear();
+
+            return received;
+        }
+
+        // Send datagrams directly to the socket, and return the number sent
+        // Returns a "would block" error if the operation would block
+        size_t direct_write_datagrams(std::error_code &ec, const udp_send_datagram *datagrams, size_t count) {
+            if (!is_connected() && !is_bound()) {
+                ec = std::make_error_code(std::errc::not_connected);
+                return 0;
+            }
+
+            size_t sent = 0;
+
+#if LINUX_OS
+            while (sent < count) {
+                const size_t n = std::min(count - sent, MAX_BATCH);
+
+                struct mmsghdr msgs[MAX_BATCH];
+                struct iovec iov[MAX_BATCH];
+
+                memset(msgs, 0, sizeof(*msgs) * n);
+                for (size_t i = 0; i < n; ++i) {
+                    const udp_send_datagram &datagram = datagrams[sent + i];
+
+                    iov[i].iov_base = const_cast<char *>(datagram.data);
+                    iov[i].iov_len = datagram.size;
+
+                    msgs[i].msg_hdr.msg_iov = &iov[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+
+                    if (!datagram.remote.is_unspecified()) {
+                        msgs[i].msg_hdr.msg_name = const_cast<struct sockaddr *>(datagram.remote.native());
+                        msgs[i].msg_hdr.msg_namelen = datagram.remote.native_length();
+                    }
+                }
+
+                const int result = ::sendmmsg(sock, msgs, unsigned(n), 0);
+                if (result < 0) {
+                    ec = impl::socket_error();
+                    return sent;
+                }
+
+                sent += result;
+                if (size_t(result) != n)
+                    break;
+            }
+
+            ec.clear();
+#else
+            for (; sent < count; ++sent) {
+                const udp_send_datagram &datagram = datagrams[sent];
+
+                if (datagram.remote.is_unspecified())
+                    direct_write(ec, datagram.data, datagram.size);
+                else
+                    direct_write_to(ec, datagram.data, datagram.size, datagram.remote);
+
+                if (ec)
+                    break;
+            }
+#endif
+
+            return sent;
+        }
     };
 }
 
@@ -0,0 +1,337 @@
+/** @file
+ *
+ *  @author Oliver Adams
+ *  @copyright Copyright (C) 2021, Licensed under Apache 2.0
+ */
+
+#ifndef SKATE_TIMER_H
+#define SKATE_TIMER_H
+
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+
+namespace skate {
+    // Hierarchical timer wheel, with O(1) arm, reset, and cancel
+    // Four levels of 256 slots each cover 2^32 ticks. Timers are kept in the coarsest level that fits their delay,
+    // and move down a level each time the wheel below them completes a turn, so each timer is touched at most once per level
+    // Not thread-safe
+    class timer_wheel {
+    public:
+        typedef std::chrono::steady_clock clock;
+        typedef std::function<void ()> callback;
+        typedef uint64_t timer_id; // 0 is never a valid timer
+
+    private:
+        static constexpr unsigned level_bits = 8;
+        static constexpr unsigned levels = 4;
+        static constexpr uint32_t slots = 1u << level_bits;
+        static constexpr uint32_t slot_mask = slots - 1;
+        static constexpr uint32_t none = UINT32_MAX;
+        static constexpr uint32_t due_list = levels * slots; // List of timers being fired by advance()
+
+        struct node {
+            node() : prev(none), next(none), list(none), generation(1), expires(0) {}
+
+            uint32_t prev, next;            // Links in the slot list, or next free node
+            uint32_t list;                  // Slot list the node is in, or none if not armed
+            uint32_t generation;            // Incremented when the node is freed, so stale ids can be detected
+            uint64_t expires;               // Tick at which the timer fires
+            callback fn;
+        };
+
+        std::vector<node> nodes;
+        uint32_t free_head;
+        std::array<uint32_t, levels * slots + 1> heads;
+        std::array<std::array<uint64_t, slots / 64>, levels> occupied; // Bitmap of non-empty slots per level
+        std::chrono::nanoseconds resolution;
+        clock::time_point start;
+        uint64_t now_tick;                  // Last tick processed by advance()
+        size_t armed;
+
+        static timer_id make_id(uint32_t index, uint32_t generation) noexcept { return (uint64_t(generation) << 32) | (index + 1); }
+
+        node *find(timer_id id) noexcept {
+            const uint32_t index = uint32_t(id) - 1;
+            if (id == 0 || index >= nodes.size() || nodes[index].generation != uint32_t(id >> 32) || nodes[index].list == none)
+                return nullptr;
+
+            return &nodes[index];
+        }
+        const node *find(timer_id id) const noexcept { return const_cast<timer_wheel *>(this)->find(id); }
+
+        uint64_t tick_of(clock::time_point t) const noexcept {
+            return t <= start? 0: uint64_t((t - start) / resolution);
+        }
+
+        void link(uint32_t index, uint32_t list) {
+            node &n = nodes[index];
+
+            n.list = list;
+            n.prev = none;
+            n.next = heads[list];
+            if (n.next != none)
+                nodes[n.next].prev = index;
+            heads[list] = index;
+
+            if (list != due_list)
+                occupied[list / slots][(list % slots) / 64] |= uint64_t(1) << (list % 64);
+        }
+
+        void unlink(uint32_t index) {
+            node &n = nodes[index];
+
+            if (n.prev != none)
+                nodes[n.prev].next = n.next;
+            else
+                heads[n.list] = n.next;
+
+            if (n.next != none)
+                nodes[n.next].prev = n.prev;
+
+            if (n.list != due_list && heads[n.list] == none)
+                occupied[n.list / slots][(n.list % slots) / 64] &= ~(uint64_t(1) << (n.list % 64));
+
+            n.prev = n.next = n.list = none;
+        }
+
+        // Puts an armed node in the slot for its expiry, relative to the current tick
+        void place(uint32_t index) {
+            const uint64_t expires = nodes[index].expires;
+            const uint64_t delta = expires > now_tick? expires - now_tick: 0;
+
+            if (delta == 0) { // Already due, so fire on the next advance
+                link(index, due_list);
+                return;
+            }
+
+            unsigned level = 0;
+            while (level + 1 < levels && delta >= (uint64_t(1) << (level_bits * (level + 1))))
+                ++level;
+
+            link(index, level * slots + uint32_t((expires >> (level_bits * level)) & slot_mask));
+        }
+
+        uint32_t allocate() {
+            if (free_head != none) {
+                const uint32_t index = free_head;
+                free_head = nodes[index].next;
+                return index;
+            }
+
+            nodes.emplace_back();
+            return uint32_t(nodes.size() - 1);
+        }
+
+        void release(uint32_t index) {
+            node &n = nodes[index];
+
+            n.fn = nullptr;
+            ++n.generation;
+            n.next = free_head;
+            free_head = index;
+            --armed;
+        }
+
+        uint64_t ticks_for(std::chrono::nanoseconds delay) const noexcept {
+            const uint64_t max_ticks = (uint64_t(1) << (level_bits * levels)) - 1;
+            if (delay <= std::chrono::nanoseconds::zero())
+                return 1;
+
+            // Round up so a timer never fires early
+            const uint64_t ticks = uint64_t((delay + resolution - std::chrono::nanoseconds(1)) / resolution);
+            return std::min(std::max<uint64_t>(ticks, 1), max_ticks);
+        }
+
+        // Moves the timers in a higher-level slot down to the levels that now fit them
+        void cascade(unsigned level) {
+            const uint32_t list = level * slots + uint32_t((now_tick >> (level_bits * level)) & slot_mask);
+
+            uint32_t index = heads[list];
+            while (index != none) {
+                const uint32_t next = nodes[index].next;
+
+                unlink(index);
+                place(index);
+
+                index = next;
+            }
+        }
+
+        // Moves the wheel to the next tick and queues the timers that expire on it
+        void step() {
+            ++now_tick;
+
+            // Each time a level completes a turn, the current slot of the level above it is redistributed, highest level first
+            unsigned top = 0;
+            while (top + 1 < levels && (now_tick & ((uint64_t(1) << (level_bits * (top + 1))) - 1)) == 0)
+                ++top;
+
+            for (unsigned level = top; level > 0; --level)
+                cascade(level);
+
+            const uint32_t list = uint32_t(now_tick & slot_mask);
+            while (heads[list] != none) {
+                const uint32_t index = heads[list];
+
+                unlink(index);
+                link(index, due_list);
+            }
+        }
+
+        // Returns the number of ticks from the current tick to the next slot with timers at a level, or 0 if the level is empty
+        uint64_t ticks_to_next_slot(unsigned level) const noexcept {
+            const uint32_t current = uint32_t((now_tick >> (level_bits * level)) & slot_mask);
+
+            for (uint32_t offset = 1; offset <= slots; ++offset) {
+                const uint32_t slot = (current + offset) & slot_mask;
+                const uint64_t word = occupied[level][slot / 64];
+
+                if (word == 0) { // Skip to the end of this word
+                    offset += 63 - (slot % 64);
+                    continue;
+                }
+
+                if (word & (uint64_t(1) << (slot % 64))) {
+                    if (level == 0)
+                        return offset;
+
+                    // Timers in a higher level slot move down when the slot is reached. Wake then to cascade them
+                    const uint64_t unit = uint64_t(1) << (level_bits * level);
+                    return offset * unit - (now_tick & (unit - 1));
+                }
+            }
+
+            return 0;
+        }
+
+    public:
+        // Creates a timer wheel with the given tick length. Timers fire on the first advance() at least their delay after being armed
+        explicit timer_wheel(std::chrono::nanoseconds resolution = std::chrono::milliseconds(1), clock::time_point now = clock::now())
+            : free_head(none)
+            , resolution(std::max(resolution, std::chrono::nanoseconds(1)))
+            , start(now)
+            , now_tick(0)
+            , armed(0)
+        {
+            heads.fill(uint32_t(none));
+            for (auto &level: occupied)
+                level.fill(0);
+        }
+
+        size_t size() const noexcept { return armed; }
+        bool empty() const noexcept { return armed == 0; }
+
+        // Arms a timer that calls fn once, after delay has elapsed (relative to now)
+        timer_id arm(std::chrono::nanoseconds delay, callback fn, clock::time_point now = clock::now()) {
+            const uint32_t index = allocate();
+            node &n = nodes[index];
+
+            n.fn = std::move(fn);
+            n.expires = tick_of(now) + ticks_for(delay);
+            ++armed;
+
+            place(index);
+
+            return make_id(index, n.generation);
+        }
+
+        // Changes when an armed timer fires, keeping its callback. Returns false if the timer already fired or was canceled
+        bool reset(timer_id id, std::chrono::nanoseconds delay, clock::time_point now = clock::now()) {
+            node *n = find(id);
+            if (!n)
+                return false;
+
+            const uint32_t index = uint32_t(n - nodes.data());
+
+            unlink(index);
+            n->expires = tick_of(now) + ticks_for(delay);
+            place(index);
+
+            return true;
+        }
+
+        // Cancels an armed timer. Returns false if the timer already fired or was canceled
+        bool cancel(timer_id id) {
+            node *n = find(id);
+            if (!n)
+                return false;
+
+            const uint32_t index = uint32_t(n - nodes.data());
+
+            unlink(index);
+            release(index);
+
+            return true;
+        }
+
+        bool is_armed(timer_id id) const noexcept { return find(id) != nullptr; }
+
+        // Calls the callbacks of all timers due by now, and returns the number fired
+        // Callbacks may arm, reset, or cancel timers, including ones that are also due
+        size_t advance(clock::time_point now = clock::now()) {
+            const uint64_t target = tick_of(now);
+            size_t fired = 0;
+
+            if (armed == 0) { // Nothing to cascade, so jump straight to the target
+                now_tick = std::max(now_tick, target);
+                return 0;
+            }
+
+            while (true) {
+                while (heads[due_list] != none) {
+                    const uint32_t index = heads[due_list];
+                    callback fn = std::move(nodes[index].fn);
+
+                    unlink(index);
+                    release(index);
+
+                    ++fired;
+                    fn();
+                }
+
+                if (now_tick >= target)
+                    break;
+
+                if (armed == 0) {
+                    now_tick = target;
+                    break;
+                }
+
+                step();
+            }
+
+            return fired;
+        }
+
+        // Returns how long until the next timer may be due, for use as a poll timeout, or a negative duration if no timers are armed
+        // May be earlier than the actual expiry, when timers in a higher level need to move down
+        std::chrono::nanoseconds next_timeout(clock::time_point now = clock::now()) const {
+            if (armed == 0)
+                return std::chrono::nanoseconds(-1);
+            else if (heads[due_list] != none)
+                return std::chrono::nanoseconds::zero();
+
+            uint64_t ticks = 0;
+            for (unsigned level = 0; level < levels; ++level) {
+                const uint64_t level_ticks = ticks_to_next_slot(level);
+
+                if (level_ticks && (ticks == 0 || level_ticks < ticks))
+                    ticks = level_ticks;
+            }
+
+            // Timers in the current slot of a higher level (a full turn away) are found by the cascade at the end of level 0's turn
+            if (ticks == 0)
+                ticks = slots - (now_tick & slot_mask);
+
+            const clock::time_point due = start + resolution * int64_t(now_tick + ticks);
+            return due <= now? std::chrono::nanoseconds::zero(): std::chrono::duration_cast<std::chrono::nanoseconds>(due - now);
+        }
+    };
+}
+
+#endif // SKATE_TIMER_H
@@ -0,0 +1,432 @@
+/** @file
+ *
+ *  @author Oliver Adams
+ *  @copyright Copyright (C) 2021, Licensed under Apache 2.0
+ */
+
+#ifndef SKATE_THREAD_POOL_H
+#define SKATE_THREAD_POOL_H
+
+#include "includes.h"
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if LINUX_OS
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+namespace skate {
+    namespace impl {
+        // Chase-Lev work-stealing deque of pointers, see "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013)
+        // The owning thread pushes and pops at the bottom, any thread may steal from the top
+        template<typename T>
+        class work_stealing_deque {
+            static_assert(std::is_pointer<T>::value, "work_stealing_deque only holds pointers");
+
+            work_stealing_deque(const work_stealing_deque &) = delete;
+            work_stealing_deque &operator=(const work_stealing_deque &) = delete;
+
+            struct ring {
+                ring(size_t capacity) : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+
+                size_t capacity() const noexcept { return mask + 1; }
+                T get(int64_t index) const noexcept { return slots[size_t(index) & mask].load(std::memory_order_relaxed); }
+                void put(int64_t index, T value) noexcept { slots[size_t(index) & mask].store(value, std::memory_order_relaxed); }
+
+                ring *grow(int64_t top, int64_t bottom) const {
+                    ring *r = new ring(capacity() * 2);
+                    for (int64_t i = top; i < bottom; ++i)
+                        r->put(i, get(i));
+                    return r;
+                }
+
+                const size_t mask;
+                std::unique_ptr<std::atomic<T>[]> slots;
+            };
+
+            static constexpr size_t cache_line = 64;
+
+            char pad0[cache_line];
+            std::atomic<int64_t> top;                   // Position of the oldest element, advanced by thieves and the owner
+            char pad1[cache_line];
+            std::atomic<int64_t> bottom;                // Position after the newest element, only modified by the owner
+            std::atomic<ring *> array;
+            char pad2[cache_line];
+            std::vector<std::unique_ptr<ring>> rings;   // Every ring used so far, since thieves may still be reading an old one. Only touched by the owner
+
+        public:
+            work_stealing_deque(size_t capacity = 256) : top(0), bottom(0) {
+                size_t rounded = 2;
+                while (rounded < capacity)
+                    rounded *= 2;
+
+                rings.emplace_back(new ring(rounded));
+                array.store(rings.back().get(), std::memory_order_relaxed);
+            }
+
+            // Owner only
+            void push(T value) {
+                const int64_t b = bottom.load(std::memory_order_relaxed);
+                const int64_t t = top.load(std::memory_order_acquire);
+                ring *a = array.load(std::memory_order_relaxed);
+
+                if (b - t > int64_t(a->capacity()) - 1) {
+                    rings.emplace_back(a->grow(t, b));
+                    a = rings.back().get();
+                    array.store(a, std::memory_order_release);
+                }
+
+                a->put(b, value);
+                bottom.store(b + 1, std::memory_order_release);
+            }
+
+            // Owner only. Returns the most recently pushed element, or nullptr if empty
+            T pop() {
+                const int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+                ring *a = array.load(std::memory_order_relaxed);
+                bottom.store(b, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t t = top.load(std::memory_order_relaxed);
+
+                if (t > b) {
+                    bottom.store(b + 1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+
+                T value = a->get(b);
+                if (t == b) {                           // Last element, so race thieves for it
+                    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                        value = nullptr;
+
+                    bottom.store(b + 1, std::memory_order_relaxed);
+                }
+
+                return value;
+            }
+
+            // Any thread. Returns the oldest element, or nullptr if empty or another thread took it first
+            T steal() {
+                int64_t t = top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                const int64_t b = bottom.load(std::memory_order_acquire);
+
+                if (t >= b)
+                    return nullptr;
+
+                ring *a = array.load(std::memory_order_acquire);
+                T value = a->get(t);
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    return nullptr;
+
+                return value;
+            }
+
+            // Only a snapshot when called from other threads
+            bool empty() const noexcept { return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed); }
+        };
+    }
+
+    struct thread_pool_options {
+        thread_pool_options(size_t threads = 0) : threads(threads), pin_threads(false), first_cpu(0) {}
+
+        size_t threads;                     // Number of worker threads, or 0 for one per hardware thread
+        bool pin_threads;                   // If true, worker i is pinned to CPU (first_cpu + i) modulo the number of CPUs (Linux and Windows only)
+        size_t first_cpu;                   // First CPU to pin a worker to
+    };
+
+    // Fixed-size pool of worker threads that run tasks
+    // Each worker keeps its own deque of tasks. Tasks posted from a worker go to that worker's deque, and idle workers steal from the others,
+    // so tasks that spawn more tasks don't contend on a shared queue. Tasks posted from other threads go through a shared queue, and are taken in batches
+    // Tasks posted with post() must not throw. Use submit() to get the result or exception through a future
+    // Waiting on a future from inside a task can deadlock if every worker does the same
+    class thread_pool {
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator=(const thread_pool &) = delete;
+
+    public:
+        typedef std::function<void ()> task;
+
+    private:
+        static constexpr size_t max_injected_batch = 32;   // Most tasks a worker takes from the shared queue at once
+
+        struct worker {
+            worker(uint32_t seed) : seed(seed) {}
+
+            impl::work_stealing_deque<task *> tasks;
+            std::thread thread;
+            uint32_t seed;                  // State for picking steal victims
+        };
+
+        struct current_worker {
+            thread_pool *pool;
+            size_t index;
+        };
+
+        static current_worker &current() noexcept {
+            static thread_local current_worker w = {nullptr, 0};
+            return w;
+        }
+
+        std::vector<std::unique_ptr<worker>> workers;
+        std::mutex mtx;                     // Guards injected, and sleeping workers wait on it
+        std::condition_variable wake;
+        std::deque<task *> injected;        // Tasks posted from outside the pool
+        std::atomic<size_t> injected_count;
+        std::atomic<size_t> sleeping;
+        bool stopping;
+
+        static void pin(std::thread &thread, size_t cpu) {
+#if LINUX_OS
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu % CPU_SETSIZE, &set);
+
+            pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#elif WINDOWS_OS
+            if (cpu < sizeof(DWORD_PTR) * CHAR_BIT)
+                SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << cpu);
+#else
+            (void) thread;
+            (void) cpu;
+#endif
+        }
+
+        // Wakes sleeping workers after tasks were added
+        void notify(size_t added) {
+            std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in run(), so either the sleeper sees the task or the task is seen here
+            if (sleeping.load(std::memory_order_relaxed) == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if (added == 1)
+                wake.notify_one();
+            else
+                wake.notify_all();
+        }
+
+        // Must hold mtx
+        bool has_work() const {
+            if (!injected.empty())
+                return true;
+
+            for (const auto &w: workers)
+                if (!w->tasks.empty())
+                    return true;
+
+            return false;
+        }
+
+        // Takes a batch of tasks from the shared queue. The first is returned, and the rest go in the worker's own deque where they can be stolen
+        task *take_injected(worker &self) {
+            if (injected_count.load(std::memory_order_relaxed) == 0)
+                return nullptr;
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if (injected.empty())
+                return nullptr;
+
+            const size_t count = std::min(size_t(max_injected_batch), std::max<size_t>(1, injected.size() / workers.size()));
+            task *first = injected.front();
+            injected.pop_front();
+
+            for (size_t i = 1; i < count; ++i) {
+                self.tasks.push(injected.front());
+                injected.pop_front();
+            }
+
+            injected_count.fetch_sub(count, std::memory_order_relaxed);
+
+            return first;
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+                wake.notify_all();
+            }
+
+            for (auto &w: workers)
+                if (w->thread.joinable())
+                    w->thread.join();
+
+            for (task *t: injected)
+                delete t;
+            injected.clear();
+        }
+
+        task *steal(worker &self, size_t index) {
+            const size_t count = workers.size();
+
+            self.seed ^= self.seed << 13;       // xorshift32
+            self.seed ^= self.seed >> 17;
+            self.seed ^= self.seed << 5;
+
+            const size_t start = self.seed % count;
+            for (size_t i = 0; i < count; ++i) {
+                const size_t victim = (start + i) % count;
+                if (victim == index)
+                    continue;
+
+                if (task *t = workers[victim]->tasks.steal())
+                    return t;
+            }
+
+            return nullptr;
+        }
+
+        task *find_task(size_t index) {
+            worker &self = *workers[index];
+
+            if (task *t = self.tasks.pop())
+                return t;
+            else if (task *t = take_injected(self))
+                return t;
+
+            return steal(self, index);
+        }
+
+        void run(size_t index) {
+            current().pool = this;
+            current().index = index;
+
+            while (true) {
+                task *t = nullptr;
+
+                for (unsigned attempt = 0; attempt < 64 && (t = find_task(index)) == nullptr; ++attempt)
+                    std::this_thread::yield();
+
+                if (t == nullptr) {
+                    std::unique_lock<std::mutex> lock(mtx);
+
+                    sleeping.fetch_add(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                    const bool idle = !has_work();
+                    if (idle && stopping) {     // Only exit once all work is done
+                        sleeping.fetch_sub(1, std::memory_order_relaxed);
+                        break;
+                    } else if (idle)
+                        wake.wait(lock);
+
+                    sleeping.fetch_sub(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                std::unique_ptr<task> owned(t);
+                (*owned)();
+            }
+
+            current().pool = nullptr;
+        }
+
+    public:
+        explicit thread_pool(thread_pool_options options = thread_pool_options())
+            : injected_count(0)
+            , sleeping(0)
+            , stopping(false)
+        {
+            const size_t cpus = cpu_count();
+            const size_t count = options.threads? options.threads: cpus;
+
+            workers.reserve(count);
+            for (size_t i = 0; i < count; ++i)
+                workers.emplace_back(new worker(uint32_t(i * 2654435761u + 1)));
+
+            // Start threads only once all workers exist, since workers look at each other's deques
+            try {
+                for (size_t i = 0; i < count; ++i) {
+                    workers[i]->thread = std::thread(&thread_pool::run, this, i);
+
+                    if (options.pin_threads)
+                        pin(workers[i]->thread, (options.first_cpu + i) % cpus);
+                }
+            } catch (...) {
+                stop();
+                throw;
+            }
+        }
+
+        // Runs all tasks already posted, then joins the workers
+        ~thread_pool() { stop(); }
+
+        static size_t cpu_count() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+        size_t size() const noexcept { return workers.size(); }
+
+        // Returns true if called from one of this pool's worker threads
+        bool is_worker_thread() const noexcept { return current().pool == this; }
+
+        // Queues a task to run on a worker
+        void post(task fn) {
+            std::unique_ptr<task> t(new task(std::move(fn)));
+
+            if (is_worker_thread()) {
+                workers[current().index]->tasks.push(t.get());
+            } else {
+                std::lock_guard<std::mutex> lock(mtx);
+                injected.push_back(t.get());
+                injected_count.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            t.release();
+            notify(1);
+        }
+
+        // Queues a sequence of tasks (convertible to std::function<void ()>), with a single lock and wakeup for the whole batch
+        template<typename It>
+        void post_batch(It begin, It end) {
+            std::vector<std::unique_ptr<task>> batch;
+            for (; begin != end; ++begin)
+                batch.emplace_back(new task(*begin));
+
+            if (batch.empty())
+                return;
+
+            if (is_worker_thread()) {
+                worker &self = *workers[current().index];
+
+                for (auto &t: batch)
+                    self.tasks.push(t.release());
+            } else {
+                std::lock_guard<std::mutex> lock(mtx);
+
+                for (auto &t: batch) {
+                    injected.push_back(t.get());
+                    t.release();
+                }
+
+                injected_count.fetch_add(batch.size(), std::memory_order_relaxed);
+            }
+
+            notify(batch.size());
+        }
+
+        // Queues a function to run on a worker, and returns a future for its result
+        template<typename F>
+        std::future<decltype(std::declval<F &>()())> submit(F fn) {
+            typedef decltype(std::declval<F &>()()) result;
+
+            auto job = std::make_shared<std::packaged_task<result ()>>(std::move(fn));
+            std::future<result> future = job->get_future();
+
+            post([job]() { (*job)(); });
+
+            return future;
+        }
+    };
+}
+
+#endif // SKATE_THREAD_POOL_H
@@ -9,6 +9,12 @@
 
 #include <time.h>
 #include <mutex>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
 
 #include "includes.h"
 
@@ -170,30 +176,130 @@ namespace skate {
         bool enabled;
     };
 
-    static std::string time_point_to_string(std::chrono::time_point<std::chrono::system_clock> when, time_point_string_options options = {}) {
-        const auto adjusted = std::chrono::time_point_cast<std::chrono::nanoseconds>(when);
-        const auto truncated = adjusted - std::chrono::nanoseconds(adjusted.time_since_epoch().count() % 1000000000); // Truncate nanoseconds off adjusted time
-        const time_t t = std::chrono::system_clock::to_time_t(std::chrono::time_point_cast<std::chrono::system_clock::duration>(truncated));
-        struct tm x;
+    // Formats time points like time_point_to_string(), but reuses the formatted date and time while the second stays the same,
+    // so usually only the fractional digits are rewritten and localtime() isn't called at all
+    // Not thread-safe, use one per thread (see time_point_to_string())
+    class time_point_formatter {
+        time_point_string_options options;
+        int64_t cached_second;              // Second that result's prefix was formatted for
+        bool cached;
+        size_t prefix_size;                 // Size of the date and time, before any fractional digits
+        std::string result;
 
-        if (options.utc)
-            skate::gmtime_r(&t, &x);
-        else
-            skate::localtime_r(&t, &x);
+    public:
+        time_point_formatter(time_point_string_options options = time_point_string_options::default_enabled())
+            : options(options)
+            , cached_second(0)
+            , cached(false)
+            , prefix_size(0)
+        {}
+
+        const time_point_string_options &get_options() const noexcept { return options; }
+        void set_options(time_point_string_options o) {
+            options = o;
+            cached = false;
+        }
 
-        std::string result = skate::strftime(options.format, x);
+        // Returns true if this formatter produces the same output as one with the specified options
+        bool has_options(const time_point_string_options &o) const noexcept {
+            return options.fractional_second_places == o.fractional_second_places &&
+                   options.utc == o.utc &&
+                   (options.format == o.format || strcmp(options.format, o.format) == 0);
+        }
 
-        if (options.fractional_second_places) {
-            std::string fractional = std::to_string(adjusted.time_since_epoch().count() % 1000000000);
+        // Returns the formatted time. The reference is valid until the next call
+        const std::string &format(std::chrono::time_point<std::chrono::system_clock> when) {
+            const int64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+            int64_t second = nanoseconds / 1000000000;
+            int64_t fraction = nanoseconds % 1000000000;
 
-            result.push_back('.');
+            if (fraction < 0) {                 // Round towards negative infinity for times before the epoch
+                fraction += 1000000000;
+                --second;
+            }
 
-            if (options.fractional_second_places < fractional.size())
-                fractional.resize(options.fractional_second_places, '0');
-            else
-                result.resize(result.size() + options.fractional_second_places - fractional.size(), '0');
+            if (!cached || second != cached_second) {
+                const time_t t = time_t(second);
+                struct tm x;
+
+                if (options.utc)
+                    skate::gmtime_r(&t, &x);
+                else
+                    skate::localtime_r(&t, &x);
+
+                result = skate::strftime(options.format, x);
+                prefix_size = result.size();
+                cached_second = second;
+                cached = true;
+            } else {
+                result.resize(prefix_size);
+            }
+
+            if (options.fractional_second_places) {
+                char digits[9];
+                for (size_t i = sizeof(digits); i > 0; --i) {
+                    digits[i - 1] = char('0' + fraction % 10);
+                    fraction /= 10;
+                }
+
+                result.push_back('.');
+                result.append(digits, std::min<size_t>(options.fractional_second_places, sizeof(digits)));
+
+                if (options.fractional_second_places > sizeof(digits))
+                    result.append(options.fractional_second_places - sizeof(digits), '0');
+            }
 
-            result += fractional;
+            return result;
+        }
+    };
+
+    namespace impl {
+        // Returns a formatter for the current thread, keeping a few so callers alternating between options still hit the cache
+        inline time_point_formatter &thread_time_point_formatter(const time_point_string_options &options) {
+            static thread_local std::array<time_point_formatter, 4> formatters;
+            static thread_local size_t next = 0;
+
+            for (auto &formatter: formatters)
+                if (formatter.has_options(options))
+                    return formatter;
+
+            time_point_formatter &formatter = formatters[next++ % formatters.size()];
+            formatter.set_options(options);
+            return formatter;
+        }
+    }
+
+    inline std::string time_point_to_string(std::chrono::time_point<std::chrono::system_clock> when, time_point_string_options options = {}) {
+        return impl::thread_time_point_formatter(options).format(when);
+    }
+
+    // Returns the time as an HTTP date (RFC 7231 IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"), for Date and Last-Modified headers
+    // The string is cached per thread and only reformatted when the second changes. The reference is valid until the next call on the same thread
+    inline const std::string &http_date_string(std::chrono::time_point<std::chrono::system_clock> when = std::chrono::system_clock::now()) {
+        static const char weekday[][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+        static const char month[][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        static thread_local time_t cached_second = 0;
+        static thread_local std::string result;
+
+        const time_t t = std::chrono::system_clock::to_time_t(when);
+        if (result.empty() || t != cached_second) {
+            struct tm x;
+            char buffer[32];
+
+            if (!skate::gmtime_r(&t, &x))
+                x = tm();
+
+            snprintf(buffer, sizeof(buffer), "%s, %.2d %s %.4d %.2d:%.2d:%.2d GMT",
+                    weekday[x.tm_wday % 7],
+                    x.tm_mday,
+                    month[x.tm_mon % 12],
+                    x.tm_year + 1900,
+                    x.tm_hour,
+                    x.tm_min,
+                    x.tm_sec);
+
+            result = buffer;
+            cached_second = t;
         }
 
         return result;
@@ -14,6 +14,10 @@
 #include <utility>
 #include <type_traits>
 #include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "io/buffer.h"
 
 #if 0
 template<typename T>
@@ -132,8 +136,13 @@ namespace skate {
     class MessageInterface
     {
         mutable std::mutex mtx;
-        bool closed; // Tracks whether the write queue is closed permanently (true) or open for writing (false)
+        std::atomic<bool> closed; // Tracks whether the write queue is closed permanently (true) or open for writing (false)
         bool first_message_is_stale; // Tracks whether the first message in the read queue is stale (true) (meaning it was read with ReadWithoutRemoving and is still in the queue) or not (false).
+        const bool lockless; // If true, the implementation is threadsafe on its own, so mtx is never locked and the lock passed to implementations is not held. ReadWithoutRemoving is not supported
+
+        std::unique_lock<std::mutex> lock_interface() const {
+            return lockless? std::unique_lock<std::mutex>(mtx, std::defer_lock): std::unique_lock<std::mutex>(mtx);
+        }
 
     protected:
         bool readMessageImplIsClosed() const noexcept {return closed;}
@@ -201,7 +210,7 @@ namespace skate {
         // Reimplementations must return the maximum number of pending messages possible that can be queued with this device.
         virtual size_t capacityForWaitingMessagesImpl() const noexcept {return 0;}
 
-        MessageInterface() : closed(false), first_message_is_stale(false) {}
+        MessageInterface(bool lockless = false) : closed(false), first_message_is_stale(false), lockless(lockless) {}
 
     public:
         typedef Message MessageType;
@@ -218,7 +227,7 @@ namespace skate {
             return send(std::move(Message(m)), type);
         }
         MessageError send(Message &&m, MessageQueueType type = QueueBlockUntilSent) {
-            std::unique_lock<std::mutex> lock(mtx);
+            std::unique_lock<std::mutex> lock = lock_interface();
 
             if (closed)
                 return MessageFailed;
@@ -245,7 +254,7 @@ namespace skate {
         // This entire operation is atomic, and fails with MessageAtomicImpossible if the messages can NEVER be sent atomically on this device (for instance, if the number of items is too large to queue atomically)
         // Return value is identical in operation to send().
         MessageError sendMessagesAtomically(std::vector<Message> &&messages, MessageQueueType type = QueueBlockUntilSent) {
-            std::unique_lock<std::mutex> lock(mtx);
+            std::unique_lock<std::mutex> lock = lock_interface();
 
             if (closed)
                 return MessageFailed;
@@ -255,17 +264,14 @@ namespace skate {
 
         // Returns true if the writer has been closed.
         bool isClosed() const {
-            std::unique_lock<std::mutex> lock(mtx);
             return closed;
         }
         // Closes the writer to sending new messages. If cancel_pending_messages is true, any existing messages queued and not yet handled will be discarded.
         void close(bool cancel_pending_messages = false) {
-            std::unique_lock<std::mutex> lock(mtx);
+            std::unique_lock<std::mutex> lock = lock_interface();
 
-            if (!closed) {
-                closed = true;
+            if (!closed.exchange(true))
                 closeImpl(cancel_pending_messages);
-            }
         }
 
         //================================================================================================================================
@@ -276,6 +282,14 @@ namespace skate {
         //
         // Returns true if a valid message was read, false if no message was available.
         MessageError read(Message &m, MessageQueueType type = QueueBlockUntilDone, MessageReadType consume_type = ReadAndRemove) {
+            if (lockless) {
+                if (consume_type == ReadWithoutRemoving)
+                    return MessageUnsupported;
+
+                std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+                return readMessageImpl(lock, m, type, consume_type);
+            }
+
             std::unique_lock<std::mutex> lock(MessageInterface<Message>::mtx);
 
             if (first_message_is_stale) {
@@ -304,13 +318,13 @@ namespace skate {
 
         // Returns the number of currently-pending messages waiting to be read in the queue.
         size_t waitingMessages() const {
-            std::unique_lock<std::mutex> lock(MessageInterface<Message>::mtx);
+            std::unique_lock<std::mutex> lock = lock_interface();
             return waitingMessagesImpl();
         }
 
         // Returns the maximum number of pending messages possible that can be queued with this device.
         size_t capacityForWaitingMessages() const {
-            std::unique_lock<std::mutex> lock(MessageInterface<Message>::mtx);
+            std::unique_lock<std::mutex> lock = lock_interface();
             return capacityForWaitingMessagesImpl();
         }
     };
@@ -510,6 +524,110 @@ namespace skate {
             return std::shared_ptr<MessageBufferInterface<Message>>(new MessageBufferInterface(max_buffer_size));
         }
     };
+
+    // A bounded message queue for many senders and readers that never takes a lock while messages flow, backed by io_mpmc_buffer
+    // Blocks only when full (QueueBlockUntilSent) or empty (QueueBlockUntilDone/QueueBlockUntilSent reads). ReadWithoutRemoving and QueueBlockUntilDone sends are unsupported
+    template<typename Message>
+    class MessageQueueInterface : public MessageInterface<Message>
+    {
+    protected:
+        io_mpmc_buffer<Message> buffer;
+
+        void closeImpl(bool cancel_pending_messages) {
+            if (cancel_pending_messages)
+                buffer.clear();
+
+            // Wake blocked senders (which then fail) and readers (which fail once the queue is empty)
+            buffer.unregister_consumer();
+            buffer.unregister_producer();
+
+            MessageInterface<Message>::closeImpl(cancel_pending_messages);
+        }
+
+        MessageError sendMessageImpl(std::unique_lock<std::mutex> &, Message &&m, MessageQueueType type) {
+            switch (type) {
+                case QueueBlockUntilDone:
+                    return MessageUnsupported;
+                case QueueBlockUntilSent:
+                    return buffer.write(std::move(m))? MessageSuccess: MessageFailed;
+                case QueueImmediate:
+                    return buffer.write(std::move(m), false)? MessageSuccess: MessageTryAgain;
+                case QueueForceSend: {
+                    MessageError result = MessageSuccess;
+                    Message discarded;
+
+                    while (!buffer.write(std::move(m), false)) {
+                        if (buffer.read(discarded, false))
+                            result = MessageSuccessLostData;
+                    }
+
+                    return result;
+                }
+            }
+
+            return MessageUnsupported;
+        }
+
+        MessageError sendMessagesAtomicImpl(std::unique_lock<std::mutex> &, std::vector<Message> &&messages, MessageQueueType type) {
+            if (buffer.capacity() < messages.size())
+                return MessageAtomicImpossible;
+
+            switch (type) {
+                case QueueBlockUntilDone:
+                    return MessageUnsupported;
+                case QueueBlockUntilSent:
+                    return buffer.write_from(messages)? MessageSuccess: MessageFailed;
+                case QueueImmediate:
+                    return buffer.write_from(messages, false)? MessageSuccess: MessageTryAgain;
+                case QueueForceSend: {
+                    MessageError result = MessageSuccess;
+                    Message discarded;
+
+                    while (!buffer.write_from(messages, false)) {
+                        if (buffer.read(discarded, false))
+                            result = MessageSuccessLostData;
+                    }
+
+                    return result;
+                }
+            }
+
+            return MessageUnsupported;
+        }
+
+        MessageError readMessageImpl(std::unique_lock<std::mutex> &, Message &m, MessageQueueType queueType, MessageReadType) {
+            switch (queueType) {
+                case QueueBlockUntilDone:
+                case QueueBlockUntilSent:
+                    return buffer.read(m)? MessageSuccess: MessageFailed;
+                case QueueImmediate:
+                case QueueForceSend:
+                    return buffer.read(m, false)? MessageSuccess: MessageTryAgain;
+            }
+
+            return MessageUnsupported;
+        }
+
+        size_t waitingMessagesImpl() const noexcept {return buffer.size();}
+        size_t capacityForWaitingMessagesImpl() const noexcept {return buffer.capacity();}
+
+        MessageQueueInterface(size_t max_buffer_size = 1024)
+            : MessageInterface<Message>(true)
+            , buffer(max_buffer_size)
+        {
+            // The interface itself stands in for the senders and readers until it is closed
+            buffer.register_consumer();
+            buffer.register_producer();
+        }
+
+    public:
+        virtual ~MessageQueueInterface() {}
+
+        // Creates a queue holding at least max_buffer_size messages (rounded up to a power of two, or 1024 if 0)
+        static std::shared_ptr<MessageQueueInterface<Message>> create(size_t max_buffer_size = 1024) {
+            return std::shared_ptr<MessageQueueInterface<Message>>(new MessageQueueInterface(max_buffer_size));
+        }
+    };
 }
 
 #include <functional>
@@ -776,14 +894,21 @@ namespace skate {
     template<typename Message>
     class MessageBroadcaster
     {
+        typedef std::vector<MessageHandler<Message>> Writers;
+
         const bool close_on_exit;
         std::mutex mtx;
-        std::vector<MessageHandler<Message>> writers__;
+        std::shared_ptr<Writers> writers__; // Replaced, never modified once published, when writers are added or removed, so sends work on a snapshot without holding mtx
+
+        std::shared_ptr<Writers> writers() {
+            std::lock_guard<std::mutex> lock(mtx);
+            return writers__;
+        }
 
     public:
         typedef Message MessageType;
 
-        MessageBroadcaster(bool close_on_exit = true) : close_on_exit(close_on_exit) {}
+        MessageBroadcaster(bool close_on_exit = true) : close_on_exit(close_on_exit), writers__(std::make_shared<Writers>()) {}
         ~MessageBroadcaster() {
             if (close_on_exit)
                 close();
@@ -791,19 +916,28 @@ namespace skate {
 
         MessageHandler<Message> add(MessageHandler<Message> writer) {
             std::lock_guard<std::mutex> lock(mtx);
-            writers__.push_back(writer);
+            std::shared_ptr<Writers> updated = std::make_shared<Writers>(*writers__);
+            updated->push_back(writer);
+            writers__ = updated;
             return writer;
         }
         void remove(MessageHandler<Message> writer) {
             std::lock_guard<std::mutex> lock(mtx);
-            const auto it = writers__.find(writer);
-            if (it != writers__.end())
-                writers__.erase(it);
+            const auto it = std::find(writers__->begin(), writers__->end(), writer);
+            if (it != writers__->end()) {
+                std::shared_ptr<Writers> updated = std::make_shared<Writers>(*writers__);
+                updated->erase(updated->begin() + (it - writers__->begin()));
+                writers__ = updated;
+            }
         }
 
         MessageHandler<Message> addBuffer(size_t max_buffer_size = 0) {
             return add(MessageBufferInterface<Message>::create(max_buffer_size));
         }
+        // Adds a lock-free bounded queue, for many concurrent senders and readers (see MessageQueueInterface)
+        MessageHandler<Message> addQueue(size_t max_buffer_size = 1024) {
+            return add(MessageQueueInterface<Message>::create(max_buffer_size));
+        }
         template<typename Pred>
         MessageHandler<Message> addCallback(Pred pred, size_t max_buffer_size = 0, MessageReadType consume_type = ReadAndRemove) {
             return add(MessageCallbackInterface<Message>::create(pred, max_buffer_size, consume_type));
@@ -816,14 +950,14 @@ namespace skate {
         }
 
         MessageError sendToOne(Message &&m, MessageQueueType type = QueueImmediate) {
-            std::lock_guard<std::mutex> lock(mtx);
+            const auto writers = this->writers();
 
             bool try_again = false;
             size_t unsupported = 0;
 
             // WARNING! Although it is normally unsafe to std::move the same value inside a loop, here it is necessary to keep move semantics
             // Subclasses of MessageInterface are not allowed to move the object unless the message was actually sent
-            for (auto writer: writers__) {
+            for (auto &writer: *writers) {
                 const MessageError result = writer.send(std::move(m), type);
 
                 // If sent, then return send result
@@ -841,20 +975,20 @@ namespace skate {
 
             if (try_again)
                 return MessageTryAgain;
-            else if (unsupported == writers__.size())
+            else if (unsupported == writers->size())
                 return MessageUnsupported;
             else
                 return MessageFailed;
         }
         MessageError sendMessagesAtomicallyToOne(std::vector<Message> &&messages, MessageQueueType type = QueueImmediate) {
-            std::lock_guard<std::mutex> lock(mtx);
+            const auto writers = this->writers();
 
             bool try_again = false;
             size_t unsupported = 0;
             size_t no_atomic = 0;
 
             // See note in sendMessageToOne regarding std::move of the messages vector
-            for (auto writer: writers__) {
+            for (auto &writer: *writers) {
                 const MessageError result = writer.sendMessagesAtomically(std::move(messages), type);
 
                 // If sent, then return send result
@@ -873,9 +1007,9 @@ namespace skate {
 
             if (try_again)
                 return MessageTryAgain;
-            else if (unsupported == writers__.size())
+            else if (unsupported == writers->size())
                 return MessageUnsupported;
-            else if (no_atomic + unsupported == writers__.size())
+            else if (no_atomic + unsupported == writers->size())
                 return MessageAtomicImpossible;
             else
                 return MessageFailed;
@@ -883,14 +1017,14 @@ namespace skate {
 
         template<typename M = Message, typename std::enable_if<std::is_copy_constructible<M>::value, bool>::type = true>
         MessageError send(const Message &m, MessageQueueType type = QueueBlockUntilSent) {
-            std::lock_guard<std::mutex> lock(mtx);
+            const auto writers = this->writers();
 
             size_t unsupported = 0;
             size_t try_again = 0;
             size_t failed = 0;
             MessageError result = MessageSuccess;
 
-            for (auto writer: writers__) {
+            for (auto &writer: *writers) {
                 const MessageError r = writer.send(m, type);
 
                 switch (r) {
@@ -905,9 +1039,9 @@ namespace skate {
 
             if (failed)
                 return MessageFailed;
-            else if (unsupported == writers__.size())
+            else if (unsupported == writers->size())
                 return MessageUnsupported;
-            else if (try_again + unsupported == writers__.size())
+            else if (try_again + unsupported == writers->size())
                 return MessageTryAgain;
             else
                 return result;
@@ -915,7 +1049,7 @@ namespace skate {
 
         template<typename M = Message, typename std::enable_if<std::is_copy_constructible<M>::value, bool>::type = true>
         MessageError sendMessages(const std::vector<Message> &messages, MessageQueueType type = QueueBlockUntilSent) {
-            std::lock_guard<std::mutex> lock(mtx);
+            const auto writers = this->writers();
 
             size_t unsupported = 0;
             size_t try_again = 0;
@@ -923,7 +1057,7 @@ namespace skate {
             MessageError result = MessageSuccess;
 
             for (const Message &m: messages) {
-                for (auto writer: writers__) {
+                for (auto &writer: *writers) {
                     const MessageError r = writer.send(m, type);
 
                     switch (r) {
@@ -939,9 +1073,9 @@ namespace skate {
 
             if (failed)
                 return MessageFailed;
-            else if (unsupported == writers__.size())
+            else if (unsupported == writers->size())
                 return MessageUnsupported;
-            else if (try_again + unsupported == writers__.size())
+            else if (try_again + unsupported == writers->size())
                 return MessageTryAgain;
             else
                 return result;
@@ -949,7 +1083,7 @@ namespace skate {
 
         template<typename M = Message, typename std::enable_if<std::is_copy_constructible<M>::value, bool>::type = true>
         MessageError sendMessagesAtomically(const std::vector<Message> &messages, MessageQueueType type = QueueBlockUntilSent) {
-            std::lock_guard<std::mutex> lock(mtx);
+            const auto writers = this->writers();
 
             size_t unsupported = 0;
             size_t try_again = 0;
@@ -957,7 +1091,7 @@ namespace skate {
             size_t no_atomic = 0;
             MessageError result = MessageSuccess;
 
-            for (auto writer: writers__) {
+            for (auto &writer: *writers) {
                 const MessageError r = writer.sendMessagesAtomically(messages, type);
 
                 switch (r) {
@@ -972,11 +1106,11 @@ namespace skate {
 
             if (failed)
                 return MessageFailed;
-            else if (unsupported == writers__.size())
+            else if (unsupported == writers->size())
                 return MessageUnsupported;
-            else if (no_atomic + unsupported == writers__.size())
+            else if (no_atomic + unsupported == writers->size())
                 return MessageAtomicImpossible;
-            else if (try_again + no_atomic + unsupported == writers__.size())
+            else if (try_again + no_atomic + unsupported == writers->size())
                 return MessageTryAgain;
             else
                 return result;
@@ -991,8 +1125,8 @@ namespace skate {
     private:
         template<typename Pred>
         void all_handlers(Pred pred) {
-            std::lock_guard<std::mutex> lock(mtx);
-            for (auto writer: writers__)
+            const auto writers = this->writers();
+            for (auto &writer: *writers)
                 pred(writer);
         }
     };